@@ -1 +1 @@
-gcc -std=c99 ./smb.c -osmb
\ No newline at end of file
+gcc -std=c99 ./smb.c -osmb -lws2_32
\ No newline at end of file
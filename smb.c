@@ -2,10 +2,58 @@
 // by PixelBrushArt
 // based on the disassembly by doppelganger
 
+// Needed for clock_gettime() and friends when compiling with -std=c99
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+    #define _POSIX_C_SOURCE 200809L
+#endif
+
 // Libaries
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stddef.h>
+#include <signal.h>
 // #include <threads.h>
+#ifdef _WIN32
+    // Has to come before windows.h
+    #include <winsock2.h>
+    #include <windows.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+    #endif
+#else
+    #include <time.h>
+    #include <errno.h>
+    #include <sched.h>
+    #include <pthread.h>
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/socket.h>
+    #include <netinet/in.h>
+    #include <arpa/inet.h>
+#endif
+
+// Every thread gets its own copy of variables marked with this
+#ifdef _MSC_VER
+    #define THREAD_LOCAL __declspec(thread)
+#else
+    #define THREAD_LOCAL __thread
+#endif
+
+#define CACHE_LINE_SIZE 64
+
+// SIMD, whatever the compiler was told the CPU can do
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#elif defined(__SSSE3__)
+    #include <tmmintrin.h>
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
 
 // Type definitions
 // - Note -
@@ -143,529 +191,580 @@ struct PPU {
         VRAM reading and writing shares the same internal address register that rendering uses. So after loading data into video memory, the program should reload the scroll position afterwards with PPUSCROLL and PPUCTRL (bits 1…0) writes in order to avoid wrong scrolling. 
     */
     byte PPU_DATA              ;
+
+    /*
+        0x3f00-0x3f1f: Palette RAM
+        ----- ----
+
+        0x00-0x0f are the four background palettes, 0x10-0x1f the four sprite palettes.
+        Entry 0 is the universal background color, every other palette's entry 0 is transparent.
+    */
+    byte PPU_PALETTE[32];
 };
 typedef struct PPU PPU;
  
-byte SND_REGISTER          ;// 0x4000
-byte SND_SQUARE1_REG       ;// 0x4000
-byte SND_SQUARE2_REG       ;// 0x4004
-byte SND_TRIANGLE_REG      ;// 0x4008
-byte SND_NOISE_REG         ;// 0x400c
-byte SND_DELTA_REG         ;// 0x4010
-byte SND_MASTERCTRL_REG    ;// 0x4015
- 
-byte SPR_DMA               ;// 0x4014
-byte JOYPAD_PORT           ;// 0x4016
-byte JOYPAD_PORT1          ;// 0x4016
-byte JOYPAD_PORT2          ;// 0x4017
+// Sprites
+struct Sprite {
+	unsigned int x;
+	// Like on the NES, the sprite shows up one line below this
+	unsigned int y;
+	byte tile;
+	/*
+	    7: Flip vertically
+	    6: Flip horizontally
+	    5: Priority (0: in front of background; 1: behind background)
+	    1-0: Palette (4 to 7)
+	*/
+	byte attributes;
+};
+typedef struct Sprite Sprite;
 
-// GAME SPECIFIC DEFINES
+// Sprite pool
+// The NES only has 64 sprites and shows at most 8 on a line, we don't have to care about either.
+// The pool lives in GameState like everything else, so it can't grow by allocating,
+// instead spriteCount grows into a generously sized array as sprites get handed out.
+#ifndef SpritePoolSize
+    #define SpritePoolSize 256
+#endif
+// What the NES can show on one scanline, for the sprite limit compatibility mode
+#define SpritesPerLineLimit 8
 
-byte ObjectOffset = 0x08;
+// Object slots
+// Every object in the game has a slot in the object tables in GameState, grouped by class:
+// the player, then the enemies, fireballs, blocks, misc objects and air bubbles.
+// The NES had 6 enemy slots, give it more with -DEnemySlots=... and the like.
+#define PlayerSlots 1
+#ifndef EnemySlots
+    #define EnemySlots 6
+#endif
+#ifndef FireballSlots
+    #define FireballSlots 2
+#endif
+#define BlockSlots 4
+#ifndef MiscSlots
+    #define MiscSlots 9
+#endif
+#define BubbleSlots 3
 
-byte FrameCounter = 0x09;
+#define FirstPlayerSlot 0
+#define FirstEnemySlot (FirstPlayerSlot + PlayerSlots)
+#define FirstFireballSlot (FirstEnemySlot + EnemySlots)
+#define FirstBlockSlot (FirstFireballSlot + FireballSlots)
+#define FirstMiscSlot (FirstBlockSlot + BlockSlots)
+#define FirstBubbleSlot (FirstMiscSlot + MiscSlots)
+#define SprObjectSlots (FirstBubbleSlot + BubbleSlots)
 
-byte SavedJoypadBits       ; // 0x06fc
-byte SavedJoypad1Bits      ; // 0x06fc
-byte SavedJoypad2Bits      ; // 0x06fd
-byte JoypadBitMask         ; // 0x074a
-byte JoypadOverride        ; // 0x0758
- 
-byte A_B_Buttons           ; // 0x0a
-byte PreviousA_B_Buttons   ; // 0x0d
-byte Up_Down_Buttons       ; // 0x0b
-byte Left_Right_Buttons    ; // 0x0c
- 
-byte GameEngineSubroutine  ; // 0x0e
- 
-byte Mirror_PPU_CTRL_REG1  ; // 0x0778
-byte Mirror_PPU_CTRL_REG2  ; // 0x0779
- 
-byte OperMode              ; // 0x0770
-byte OperMode_Task         ; // 0x0772
-byte ScreenRoutineTask     ; // 0x073c
-
-byte GamePauseStatus       ; // 0x0776
-byte GamePauseTimer        ; // 0x0777
-
-byte DemoAction            ; // 0x0717
-byte DemoActionTimer       ; // 0x0718
-
-byte TimerControl          ; // 0x0747
-byte IntervalTimerControl  ; // 0x077f
-
-byte Timers                ; // 0x0780
-byte SelectTimer           ; // 0x0780
-byte PlayerAnimTimer       ; // 0x0781
-byte JumpSwimTimer         ; // 0x0782
-byte RunningTimer          ; // 0x0783
-byte BlockBounceTimer      ; // 0x0784
-byte SideCollisionTimer    ; // 0x0785
-byte JumpspringTimer       ; // 0x0786
-byte GameTimerCtrlTimer    ; // 0x0787
-byte ClimbSideTimer        ; // 0x0789
-byte EnemyFrameTimer       ; // 0x078a
-byte FrenzyEnemyTimer      ; // 0x078f
-byte BowserFireBreathTimer ; // 0x0790
-byte StompTimer            ; // 0x0791
-byte AirBubbleTimer        ; // 0x0792
-byte ScrollIntervalTimer   ; // 0x0795
-byte EnemyIntervalTimer    ; // 0x0796
-byte BrickCoinTimer        ; // 0x079d
-byte InjuryTimer           ; // 0x079e
-byte StarInvincibleTimer   ; // 0x079f
-byte ScreenTimer           ; // 0x07a0
-byte WorldEndTimer         ; // 0x07a1
-byte DemoTimer             ; // 0x07a2
-
-// This is prolly a pointer
-byte Sprite_Data           ; // 0x0200
- 
-byte Sprite_Y_Position     ; // 0x0200
-byte Sprite_Tilenumber     ; // 0x0201
-byte Sprite_Attributes     ; // 0x0202
-byte Sprite_X_Position     ; // 0x0203
- 
-byte ScreenEdge_PageLoc    ; // 0x071a
-byte ScreenEdge_X_Pos      ; // 0x071c
-byte ScreenLeft_PageLoc    ; // 0x071a
-byte ScreenRight_PageLoc   ; // 0x071b
-byte ScreenLeft_X_Pos      ; // 0x071c
-byte ScreenRight_X_Pos     ; // 0x071d
- 
-byte PlayerFacingDir       ; // 0x33
-byte DestinationPageLoc    ; // 0x34
-byte VictoryWalkControl    ; // 0x35
-byte ScrollFractional      ; // 0x0768
-byte PrimaryMsgCounter     ; // 0x0719
-byte SecondaryMsgCounter   ; // 0x0749
-
-byte HorizontalScroll      ; // 0x073f
-byte VerticalScroll        ; // 0x0740
-byte ScrollLock            ; // 0x0723
-byte ScrollThirtyTwo       ; // 0x073d
-byte Player_X_Scroll       ; // 0x06ff
-byte Player_Pos_ForScroll  ; // 0x0755
-byte ScrollAmount          ; // 0x0775
-
-byte AreaData              ; // 0xe7
-byte AreaDataLow           ; // 0xe7
-byte AreaDataHigh          ; // 0xe8
-byte EnemyData             ; // 0xe9
-byte EnemyDataLow          ; // 0xe9
-byte EnemyDataHigh         ; // 0xea
-
-byte AreaParserTaskNum     ; // 0x071f
-byte ColumnSets            ; // 0x071e
-byte CurrentPageLoc        ; // 0x0725
-byte CurrentColumnPos      ; // 0x0726
-byte BackloadingFlag       ; // 0x0728
-byte BehindAreaParserFlag  ; // 0x0729
-byte AreaObjectPageLoc     ; // 0x072a
-byte AreaObjectPageSel     ; // 0x072b
-byte AreaDataOffset        ; // 0x072c
-byte AreaObjOffsetBuffer   ; // 0x072d
-byte AreaObjectLength      ; // 0x0730
-byte StaircaseControl      ; // 0x0734
-byte AreaObjectHeight      ; // 0x0735
-byte MushroomLedgeHalfLen  ; // 0x0736
-byte EnemyDataOffset       ; // 0x0739
-byte EnemyObjectPageLoc    ; // 0x073a
-byte EnemyObjectPageSel    ; // 0x073b
-byte MetatileBuffer        ; // 0x06a1
-byte BlockBufferColumnPos  ; // 0x06a0
-byte CurrentNTAddr_Low     ; // 0x0721
-byte CurrentNTAddr_High    ; // 0x0720
-byte AttributeBuffer       ; // 0x03f9
-
-byte LoopCommand           ; // 0x0745
- 
-byte DisplayDigits         ; // 0x07d7
-#define TopScoreDisplayLength 6
-byte TopScoreDisplay[TopScoreDisplayLength]; // 0x07d7
-byte ScoreAndCoinDisplay   ; // 0x07dd
-byte PlayerScoreDisplay    ; // 0x07dd
-byte GameTimerDisplay      ; // 0x07f8
-byte DigitModifier         ; // 0x0134
- 
-byte VerticalFlipFlag      ; // 0x0109
-byte FloateyNum_Control    ; // 0x0110
-byte ShellChainCounter     ; // 0x0125
-byte FloateyNum_Timer      ; // 0x012c
-byte FloateyNum_X_Pos      ; // 0x0117
-byte FloateyNum_Y_Pos      ; // 0x011e
-byte FlagpoleFNum_Y_Pos    ; // 0x010d
-byte FlagpoleFNum_YMFDummy ; // 0x010e
-byte FlagpoleScore         ; // 0x010f
-byte FlagpoleCollisionYPos ; // 0x070f
-byte StompChainCounter     ; // 0x0484
- 
-byte VRAM_Buffer1_Offset   ; // 0x0300
-byte VRAM_Buffer1          ; // 0x0301
-byte VRAM_Buffer2_Offset   ; // 0x0340
-byte VRAM_Buffer2          ; // 0x0341
-byte VRAM_Buffer_AddrCtrl  ; // 0x0773
-byte Sprite0HitDetectFlag  ; // 0x0722
-byte DisableScreenFlag     ; // 0x0774
-byte DisableIntermediate   ; // 0x0769
-byte ColorRotateOffset     ; // 0x06d4
- 
-byte TerrainControl        ; // 0x0727
-byte AreaStyle             ; // 0x0733
-byte ForegroundScenery     ; // 0x0741
-byte BackgroundScenery     ; // 0x0742
-byte CloudTypeOverride     ; // 0x0743
-byte BackgroundColorCtrl   ; // 0x0744
-byte AreaType              ; // 0x074e
-byte AreaAddrsLOffset      ; // 0x074f
-byte AreaPointer           ; // 0x0750
- 
-byte PlayerEntranceCtrl    ; // 0x0710
-byte GameTimerSetting      ; // 0x0715
-byte AltEntranceControl    ; // 0x0752
-byte EntrancePage          ; // 0x0751
-byte NumberOfPlayers       ; // 0x077a
-byte WarpZoneControl       ; // 0x06d6
-byte ChangeAreaTimer       ; // 0x06de
- 
-byte MultiLoopCorrectCntr  ; // 0x06d9
-byte MultiLoopPassCntr     ; // 0x06da
- 
-byte FetchNewGameTimerFlag ; // 0x0757
-byte GameTimerExpiredFlag  ; // 0x0759
- 
-byte PrimaryHardMode       ; // 0x076a
-byte SecondaryHardMode     ; // 0x06cc
-byte WorldSelectNumber     ; // 0x076b
-byte WorldSelectEnableFlag ; // 0x07fc
-byte ContinueWorld         ; // 0x07fd
- 
-byte CurrentPlayer         ; // 0x0753
-byte PlayerSize            ; // 0x0754
-byte PlayerStatus          ; // 0x0756
- 
-byte OnscreenPlayerInfo    ; // 0x075a
-byte NumberofLives         ; // 0x075a ;used by current player
-byte HalfwayPage           ; // 0x075b
-byte LevelNumber           ; // 0x075c ;the actual dash number
-byte Hidden1UpFlag         ; // 0x075d
-byte CoinTally             ; // 0x075e
-byte WorldNumber           ; // 0x075f
-byte AreaNumber            ; // 0x0760 ;internal number used to find areas
- 
-byte CoinTallyFor1Ups      ; // 0x0748
- 
-byte OffscreenPlayerInfo   ; // 0x0761
-byte OffScr_NumberofLives  ; // 0x0761 ;used by offscreen player
-byte OffScr_HalfwayPage    ; // 0x0762
-byte OffScr_LevelNumber    ; // 0x0763
-byte OffScr_Hidden1UpFlag  ; // 0x0764
-byte OffScr_CoinTally      ; // 0x0765
-byte OffScr_WorldNumber    ; // 0x0766
-byte OffScr_AreaNumber     ; // 0x0767
- 
-byte BalPlatformAlignment  ; // 0x03a0
-byte Platform_X_Scroll     ; // 0x03a1
-byte PlatformCollisionFlag ; // 0x03a2
-byte YPlatformTopYPos      ; // 0x0401
-byte YPlatformCenterYPos   ; // 0x58
- 
-byte BrickCoinTimerFlag    ; // 0x06bc
-byte StarFlagTaskControl   ; // 0x0746
- 
-byte PseudoRandomBitReg    ; // 0x07a7
-byte WarmBootValidation    ; // 0x07ff
- 
-byte SprShuffleAmtOffset   ; // 0x06e0
-byte SprShuffleAmt         ; // 0x06e1
-byte SprDataOffset         ; // 0x06e4
-byte Player_SprDataOffset  ; // 0x06e4
-byte Enemy_SprDataOffset   ; // 0x06e5
-byte Block_SprDataOffset   ; // 0x06ec
-byte Alt_SprDataOffset     ; // 0x06ec
-byte Bubble_SprDataOffset  ; // 0x06ee
-byte FBall_SprDataOffset   ; // 0x06f1
-byte Misc_SprDataOffset    ; // 0x06f3
-byte SprDataOffset_Ctrl    ; // 0x03ee
- 
-byte Player_State          ; // 0x1d
-byte Enemy_State           ; // 0x1e
-byte Fireball_State        ; // 0x24
-byte Block_State           ; // 0x26
-byte Misc_State            ; // 0x2a
- 
-byte Player_MovingDir      ; // 0x45
-byte Enemy_MovingDir       ; // 0x46
- 
-byte SprObject_X_Speed     ; // 0x57
-byte Player_X_Speed        ; // 0x57
-byte Enemy_X_Speed         ; // 0x58
-byte Fireball_X_Speed      ; // 0x5e
-byte Block_X_Speed         ; // 0x60
-byte Misc_X_Speed          ; // 0x64
- 
-byte Jumpspring_FixedYPos  ; // 0x58
-byte JumpspringAnimCtrl    ; // 0x070e
-byte JumpspringForce       ; // 0x06db
- 
-byte SprObject_PageLoc     ; // 0x6d
-byte Player_PageLoc        ; // 0x6d
-byte Enemy_PageLoc         ; // 0x6e
-byte Fireball_PageLoc      ; // 0x74
-byte Block_PageLoc         ; // 0x76
-byte Misc_PageLoc          ; // 0x7a
-byte Bubble_PageLoc        ; // 0x83
-
-
-byte SprObject_X_Position  ; // 0x86
-byte Player_X_Position     ; // 0x86
-byte Enemy_X_Position      ; // 0x87
-byte Fireball_X_Position   ; // 0x8d
-byte Block_X_Position      ; // 0x8f
-byte Misc_X_Position       ; // 0x93
-byte Bubble_X_Position     ; // 0x9c
- 
-byte SprObject_Y_Speed     ; // 0x9f
-byte Player_Y_Speed        ; // 0x9f
-byte Enemy_Y_Speed         ; // 0xa0
-byte Fireball_Y_Speed      ; // 0xa6
-byte Block_Y_Speed         ; // 0xa8
-byte Misc_Y_Speed          ; // 0xac
- 
-byte SprObject_Y_HighPos   ; // 0xb5
-byte Player_Y_HighPos      ; // 0xb5
-byte Enemy_Y_HighPos       ; // 0xb6
-byte Fireball_Y_HighPos    ; // 0xbc
-byte Block_Y_HighPos       ; // 0xbe
-byte Misc_Y_HighPos        ; // 0xc2
-byte Bubble_Y_HighPos      ; // 0xcb
- 
-byte SprObject_Y_Position  ; // 0xce
-byte Player_Y_Position     ; // 0xce
-byte Enemy_Y_Position      ; // 0xcf
-byte Fireball_Y_Position   ; // 0xd5
-byte Block_Y_Position      ; // 0xd7
-byte Misc_Y_Position       ; // 0xdb
-byte Bubble_Y_Position     ; // 0xe4
- 
-byte SprObject_Rel_XPos    ; // 0x03ad
-byte Player_Rel_XPos       ; // 0x03ad
-byte Enemy_Rel_XPos        ; // 0x03ae
-byte Fireball_Rel_XPos     ; // 0x03af
-byte Bubble_Rel_XPos       ; // 0x03b0
-byte Block_Rel_XPos        ; // 0x03b1
-byte Misc_Rel_XPos         ; // 0x03b3
- 
-byte SprObject_Rel_YPos    ; // 0x03b8
-byte Player_Rel_YPos       ; // 0x03b8
-byte Enemy_Rel_YPos        ; // 0x03b9
-byte Fireball_Rel_YPos     ; // 0x03ba
-byte Bubble_Rel_YPos       ; // 0x03bb
-byte Block_Rel_YPos        ; // 0x03bc
-byte Misc_Rel_YPos         ; // 0x03be
-
-byte SprObject_SprAttrib   ; // 0x03c4
-byte Player_SprAttrib      ; // 0x03c4
-byte Enemy_SprAttrib       ; // 0x03c5
- 
-byte SprObject_X_MoveForce ; // 0x0400
-byte Enemy_X_MoveForce     ; // 0x0401
- 
-byte SprObject_YMF_Dummy   ; // 0x0416
-byte Player_YMF_Dummy      ; // 0x0416
-byte Enemy_YMF_Dummy       ; // 0x0417
-byte Bubble_YMF_Dummy      ; // 0x042c
- 
-byte SprObject_Y_MoveForce ; // 0x0433
-byte Player_Y_MoveForce    ; // 0x0433
-byte Enemy_Y_MoveForce     ; // 0x0434
-byte Block_Y_MoveForce     ; // 0x043c
- 
-byte DisableCollisionDet   ; // 0x0716
-byte Player_CollisionBits  ; // 0x0490
-byte Enemy_CollisionBits   ; // 0x0491
- 
-byte SprObj_BoundBoxCtrl   ; // 0x0499
-byte Player_BoundBoxCtrl   ; // 0x0499
-byte Enemy_BoundBoxCtrl    ; // 0x049a
-byte Fireball_BoundBoxCtrl ; // 0x04a0
-byte Misc_BoundBoxCtrl     ; // 0x04a2
- 
-byte EnemyFrenzyBuffer     ; // 0x06cb
-byte EnemyFrenzyQueue      ; // 0x06cd
-byte Enemy_Flag            ; // 0x0f
-byte Enemy_ID              ; // 0x16
- 
-byte PlayerGfxOffset       ; // 0x06d5
-byte Player_XSpeedAbsolute ; // 0x0700
-byte FrictionAdderHigh     ; // 0x0701
-byte FrictionAdderLow      ; // 0x0702
-byte RunningSpeed          ; // 0x0703
-byte SwimmingFlag          ; // 0x0704
-byte Player_X_MoveForce    ; // 0x0705
-byte DiffToHaltJump        ; // 0x0706
-byte JumpOrigin_Y_HighPos  ; // 0x0707
-byte JumpOrigin_Y_Position ; // 0x0708
-byte VerticalForce         ; // 0x0709
-byte VerticalForceDown     ; // 0x070a
-byte PlayerChangeSizeFlag  ; // 0x070b
-byte PlayerAnimTimerSet    ; // 0x070c
-byte PlayerAnimCtrl        ; // 0x070d
-byte DeathMusicLoaded      ; // 0x0712
-byte FlagpoleSoundQueue    ; // 0x0713
-byte CrouchingFlag         ; // 0x0714
-byte MaximumLeftSpeed      ; // 0x0450
-byte MaximumRightSpeed     ; // 0x0456
- 
-byte SprObject_OffscrBits  ; // 0x03d0
-byte Player_OffscreenBits  ; // 0x03d0
-byte Enemy_OffscreenBits   ; // 0x03d1
-byte FBall_OffscreenBits   ; // 0x03d2
-byte Bubble_OffscreenBits  ; // 0x03d3
-byte Block_OffscreenBits   ; // 0x03d4
-byte Misc_OffscreenBits    ; // 0x03d6
-byte EnemyOffscrBitsMasked ; // 0x03d8
- 
-byte Cannon_Offset         ; // 0x046a
-byte Cannon_PageLoc        ; // 0x046b
-byte Cannon_X_Position     ; // 0x0471
-byte Cannon_Y_Position     ; // 0x0477
-byte Cannon_Timer          ; // 0x047d
- 
-byte Whirlpool_Offset      ; // 0x046a
-byte Whirlpool_PageLoc     ; // 0x046b
-byte Whirlpool_LeftExtent  ; // 0x0471
-byte Whirlpool_Length      ; // 0x0477
-byte Whirlpool_Flag        ; // 0x047d
- 
-byte VineFlagOffset        ; // 0x0398
-byte VineHeight            ; // 0x0399
-byte VineObjOffset         ; // 0x039a
-byte VineStart_Y_Position  ; // 0x039d
- 
-byte Block_Orig_YPos       ; // 0x03e4
-byte Block_BBuf_Low        ; // 0x03e6
-byte Block_Metatile        ; // 0x03e8
-byte Block_PageLoc2        ; // 0x03ea
-byte Block_RepFlag         ; // 0x03ec
-byte Block_ResidualCounter ; // 0x03f0
-byte Block_Orig_XPos       ; // 0x03f1
- 
-byte BoundingBox_UL_XPos   ; // 0x04ac
-byte BoundingBox_UL_YPos   ; // 0x04ad
-byte BoundingBox_DR_XPos   ; // 0x04ae
-byte BoundingBox_DR_YPos   ; // 0x04af
-byte BoundingBox_UL_Corner ; // 0x04ac
-byte BoundingBox_LR_Corner ; // 0x04ae
-byte EnemyBoundingBoxCoord ; // 0x04b0
- 
-byte PowerUpType           ; // 0x39
- 
-byte FireballBouncingFlag  ; // 0x3a
-byte FireballCounter       ; // 0x06ce
-byte FireballThrowingTimer ; // 0x0711
- 
-byte HammerEnemyOffset     ; // 0x06ae
-byte JumpCoinMiscOffset    ; // 0x06b7
- 
-byte Block_Buffer_1        ; // 0x0500
-byte Block_Buffer_2        ; // 0x05d0
- 
-byte HammerThrowingTimer   ; // 0x03a2
-byte HammerBroJumpTimer    ; // 0x3c
-byte Misc_Collision_Flag   ; // 0x06be
- 
-byte RedPTroopaOrigXPos    ; // 0x0401
-byte RedPTroopaCenterYPos  ; // 0x58
- 
-byte XMovePrimaryCounter   ; // 0xa0
-byte XMoveSecondaryCounter ; // 0x58
- 
-byte CheepCheepMoveMFlag   ; // 0x58
-byte CheepCheepOrigYPos    ; // 0x0434
-byte BitMFilter            ; // 0x06dd
- 
-byte LakituReappearTimer   ; // 0x06d1
-byte LakituMoveSpeed       ; // 0x58
-byte LakituMoveDirection   ; // 0xa0
- 
-byte FirebarSpinState_Low  ; // 0x58
-byte FirebarSpinState_High ; // 0xa0
-byte FirebarSpinSpeed      ; // 0x0388
-byte FirebarSpinDirection  ; // 0x34
- 
-byte DuplicateObj_Offset   ; // 0x06cf
-byte NumberofGroupEnemies  ; // 0x06d3
- 
-byte BlooperMoveCounter    ; // 0xa0
-byte BlooperMoveSpeed      ; // 0x58
- 
-byte BowserBodyControls    ; // 0x0363
-byte BowserFeetCounter     ; // 0x0364
-byte BowserMovementSpeed   ; // 0x0365
-byte BowserOrigXPos        ; // 0x0366
-byte BowserFlameTimerCtrl  ; // 0x0367
-byte BowserFront_Offset    ; // 0x0368
-byte BridgeCollapseOffset  ; // 0x0369
-byte BowserGfxFlag         ; // 0x036a
-byte BowserHitPoints       ; // 0x0483
-byte MaxRangeFromOrigin    ; // 0x06dc
- 
-byte BowserFlamePRandomOfs ; // 0x0417
- 
-byte PiranhaPlantUpYPos    ; // 0x0417
-byte PiranhaPlantDownYPos  ; // 0x0434
-byte PiranhaPlant_Y_Speed  ; // 0x58
-byte PiranhaPlant_MoveFlag ; // 0xa0
- 
-byte FireworksCounter      ; // 0x06d7
-byte ExplosionGfxCounter   ; // 0x58
-byte ExplosionTimerCounter ; // 0xa0
-
-// Sound related defines
-byte Squ2_NoteLenBuffer    ; // 0x07b3
-byte Squ2_NoteLenCounter   ; // 0x07b4
-byte Squ2_EnvelopeDataCtrl ; // 0x07b5
-byte Squ1_NoteLenCounter   ; // 0x07b6
-byte Squ1_EnvelopeDataCtrl ; // 0x07b7
-byte Tri_NoteLenBuffer     ; // 0x07b8
-byte Tri_NoteLenCounter    ; // 0x07b9
-byte Noise_BeatLenCounter  ; // 0x07ba
-byte Squ1_SfxLenCounter    ; // 0x07bb
-byte Squ2_SfxLenCounter    ; // 0x07bd
-byte Sfx_SecondaryCounter  ; // 0x07be
-byte Noise_SfxLenCounter   ; // 0x07bf
-
-byte PauseSoundQueue       ; // 0xfa
-byte Square1SoundQueue     ; // 0xff
-byte Square2SoundQueue     ; // 0xfe
-byte NoiseSoundQueue       ; // 0xfd
-byte AreaMusicQueue        ; // 0xfb
-byte EventMusicQueue       ; // 0xfc
-
-byte Square1SoundBuffer    ; // 0xf1
-byte Square2SoundBuffer    ; // 0xf2
-byte NoiseSoundBuffer      ; // 0xf3
-byte AreaMusicBuffer       ; // 0xf4
-byte EventMusicBuffer      ; // 0x07b1
-byte PauseSoundBuffer      ; // 0x07b2
-
-byte MusicData             ; // 0xf5
-byte MusicDataLow          ; // 0xf5
-byte MusicDataHigh         ; // 0xf6
-byte MusicOffset_Square2   ; // 0xf7
-byte MusicOffset_Square1   ; // 0xf8
-byte MusicOffset_Triangle  ; // 0xf9
-byte MusicOffset_Noise     ; // 0x07b0
- 
-byte NoteLenLookupTblOfs   ; // 0xf0
-byte DAC_Counter           ; // 0x07c0
-byte NoiseDataLoopbackOfs  ; // 0x07c1
-byte NoteLengthTblAdder    ; // 0x07c4
-byte AreaMusicBuffer_Alt   ; // 0x07c5
-byte PauseModeFlag         ; // 0x07c6
-byte GroundMusicHeaderOfs  ; // 0x07c7
-byte AltRegContentFlag     ; // 0x07ca
+// Area collision map size, in pages of 16 metatile columns. Has to be a power of two,
+// longer areas wrap around like the block buffers do.
+#ifndef AreaMaxPages
+    #define AreaMaxPages 32
+#endif
+#define AreaColumns (AreaMaxPages * 16)
+#define CollisionLayers 3
+
+//-------------------------------------------------------------------------------------
+// GAME STATE
+// Everything the game keeps in RAM lives in here as one flat block.
+// That way the whole game can be saved, restored or compared with a single memcpy.
+// Don't put any pointers in here, they won't survive being copied around!
+struct GameState {
+    PPU ppu;
+    // Both name tables, 0x2000 and 0x2400, laid out like in VRAM.
+    // 32x30 tiles each, the last 64 bytes of each table go unused since attributes live below.
+    byte nameTable[2048];
+    // Attributes of both name tables, 64 bytes each (0x23c0 and 0x27c0)
+    byte attributeTable[128];
+    // Only the first spriteCount sprites are in use, see allocateSprite()
+    Sprite spriteArray[SpritePoolSize];
+    word spriteCount;
+
+    // NES hardware registers
+    byte SND_REGISTER          ;// 0x4000
+    byte SND_SQUARE1_REG       ;// 0x4000
+    byte SND_SQUARE2_REG       ;// 0x4004
+    byte SND_TRIANGLE_REG      ;// 0x4008
+    byte SND_NOISE_REG         ;// 0x400c
+    byte SND_DELTA_REG         ;// 0x4010
+    byte SND_MASTERCTRL_REG    ;// 0x4015
+
+    byte SPR_DMA               ;// 0x4014
+    byte JOYPAD_PORT           ;// 0x4016
+    byte JOYPAD_PORT1          ;// 0x4016
+    byte JOYPAD_PORT2          ;// 0x4017
+
+    // GAME SPECIFIC DEFINES
+
+    byte ObjectOffset          ; // 0x08
+
+    byte FrameCounter          ; // 0x09
+
+    byte SavedJoypadBits       ; // 0x06fc
+    byte SavedJoypad1Bits      ; // 0x06fc
+    byte SavedJoypad2Bits      ; // 0x06fd
+    byte JoypadBitMask[2]      ; // 0x074a, 0x074b
+    byte JoypadOverride        ; // 0x0758
+
+    byte A_B_Buttons           ; // 0x0a
+    byte PreviousA_B_Buttons   ; // 0x0d
+    byte Up_Down_Buttons       ; // 0x0b
+    byte Left_Right_Buttons    ; // 0x0c
+
+    byte GameEngineSubroutine  ; // 0x0e
+
+    byte Mirror_PPU_CTRL_REG1  ; // 0x0778
+    byte Mirror_PPU_CTRL_REG2  ; // 0x0779
+
+    byte OperMode              ; // 0x0770
+    byte OperMode_Task         ; // 0x0772
+    byte ScreenRoutineTask     ; // 0x073c
+
+    byte GamePauseStatus       ; // 0x0776
+    byte GamePauseTimer        ; // 0x0777
+
+    byte DemoAction            ; // 0x0717
+    byte DemoActionTimer       ; // 0x0718
+
+    byte TimerControl          ; // 0x0747
+    byte IntervalTimerControl  ; // 0x077f
+
+    byte Timers                ; // 0x0780
+    byte SelectTimer           ; // 0x0780
+    byte PlayerAnimTimer       ; // 0x0781
+    byte JumpSwimTimer         ; // 0x0782
+    byte RunningTimer          ; // 0x0783
+    byte BlockBounceTimer      ; // 0x0784
+    byte SideCollisionTimer    ; // 0x0785
+    byte JumpspringTimer       ; // 0x0786
+    byte GameTimerCtrlTimer    ; // 0x0787
+    byte ClimbSideTimer        ; // 0x0789
+    byte EnemyFrameTimer       [EnemySlots]; // 0x078a
+    byte FrenzyEnemyTimer      ; // 0x078f
+    byte BowserFireBreathTimer ; // 0x0790
+    byte StompTimer            ; // 0x0791
+    byte AirBubbleTimer        ; // 0x0792
+    byte ScrollIntervalTimer   ; // 0x0795
+    byte EnemyIntervalTimer    [EnemySlots]; // 0x0796
+    byte BrickCoinTimer        ; // 0x079d
+    byte InjuryTimer           ; // 0x079e
+    byte StarInvincibleTimer   ; // 0x079f
+    byte ScreenTimer           ; // 0x07a0
+    byte WorldEndTimer         ; // 0x07a1
+    byte DemoTimer             ; // 0x07a2
+
+    // This is prolly a pointer
+    byte Sprite_Data           ; // 0x0200
+
+    byte Sprite_Y_Position     ; // 0x0200
+    byte Sprite_Tilenumber     ; // 0x0201
+    byte Sprite_Attributes     ; // 0x0202
+    byte Sprite_X_Position     ; // 0x0203
+
+    byte ScreenEdge_PageLoc    ; // 0x071a
+    byte ScreenEdge_X_Pos      ; // 0x071c
+    byte ScreenLeft_PageLoc    ; // 0x071a
+    byte ScreenRight_PageLoc   ; // 0x071b
+    byte ScreenLeft_X_Pos      ; // 0x071c
+    byte ScreenRight_X_Pos     ; // 0x071d
+
+    byte PlayerFacingDir       ; // 0x33
+    byte DestinationPageLoc    ; // 0x34
+    byte VictoryWalkControl    ; // 0x35
+    byte ScrollFractional      ; // 0x0768
+    byte PrimaryMsgCounter     ; // 0x0719
+    byte SecondaryMsgCounter   ; // 0x0749
+
+    byte HorizontalScroll      ; // 0x073f
+    byte VerticalScroll        ; // 0x0740
+    byte ScrollLock            ; // 0x0723
+    byte ScrollThirtyTwo       ; // 0x073d
+    byte Player_X_Scroll       ; // 0x06ff
+    byte Player_Pos_ForScroll  ; // 0x0755
+    byte ScrollAmount          ; // 0x0775
+
+    byte AreaData              ; // 0xe7
+    byte AreaDataLow           ; // 0xe7
+    byte AreaDataHigh          ; // 0xe8
+    byte EnemyData             ; // 0xe9
+    byte EnemyDataLow          ; // 0xe9
+    byte EnemyDataHigh         ; // 0xea
+
+    byte AreaParserTaskNum     ; // 0x071f
+    byte ColumnSets            ; // 0x071e
+    byte CurrentPageLoc        ; // 0x0725
+    byte CurrentColumnPos      ; // 0x0726
+    byte BackloadingFlag       ; // 0x0728
+    byte BehindAreaParserFlag  ; // 0x0729
+    byte AreaObjectPageLoc     ; // 0x072a
+    byte AreaObjectPageSel     ; // 0x072b
+    byte AreaDataOffset        ; // 0x072c
+    byte AreaObjOffsetBuffer   ; // 0x072d
+    byte AreaObjectLength      ; // 0x0730
+    byte StaircaseControl      ; // 0x0734
+    byte AreaObjectHeight      ; // 0x0735
+    byte MushroomLedgeHalfLen  ; // 0x0736
+    byte EnemyDataOffset       ; // 0x0739
+    byte EnemyObjectPageLoc    ; // 0x073a
+    byte EnemyObjectPageSel    ; // 0x073b
+    #define MetatileRows 13
+    byte MetatileBuffer[MetatileRows]; // 0x06a1
+    byte BlockBufferColumnPos  ; // 0x06a0
+    byte CurrentNTAddr_Low     ; // 0x0721
+    byte CurrentNTAddr_High    ; // 0x0720
+    byte AttributeBuffer       ; // 0x03f9
+
+    byte LoopCommand           ; // 0x0745
+
+    byte DisplayDigits         ; // 0x07d7
+    #define TopScoreDisplayLength 6
+    byte TopScoreDisplay[TopScoreDisplayLength]; // 0x07d7
+    byte ScoreAndCoinDisplay   ; // 0x07dd
+    // One decimal digit per byte, highest first
+    #define PlayerScoreDisplayLength 6
+    byte PlayerScoreDisplay[PlayerScoreDisplayLength]; // 0x07dd
+    byte GameTimerDisplay      ; // 0x07f8
+    byte DigitModifier         ; // 0x0134
+
+    byte VerticalFlipFlag      ; // 0x0109
+    byte FloateyNum_Control    [EnemySlots]; // 0x0110
+    byte ShellChainCounter     [EnemySlots]; // 0x0125
+    byte FloateyNum_Timer      ; // 0x012c
+    byte FloateyNum_X_Pos      ; // 0x0117
+    byte FloateyNum_Y_Pos      ; // 0x011e
+    byte FlagpoleFNum_Y_Pos    ; // 0x010d
+    byte FlagpoleFNum_YMFDummy ; // 0x010e
+    byte FlagpoleScore         ; // 0x010f
+    byte FlagpoleCollisionYPos ; // 0x070f
+    byte StompChainCounter     ; // 0x0484
+
+    // These are a lot bigger than the NES' 64 bytes, see the VRAM update buffers
+    #define VRAM_BufferSize 1024
+    word VRAM_Buffer1_Offset   ; // 0x0300
+    byte VRAM_Buffer1[VRAM_BufferSize]; // 0x0301
+    word VRAM_Buffer2_Offset   ; // 0x0340
+    byte VRAM_Buffer2[VRAM_BufferSize]; // 0x0341
+    byte VRAM_Buffer_AddrCtrl  ; // 0x0773
+    byte Sprite0HitDetectFlag  ; // 0x0722
+    byte DisableScreenFlag     ; // 0x0774
+    byte DisableIntermediate   ; // 0x0769
+    byte ColorRotateOffset     ; // 0x06d4
+
+    byte TerrainControl        ; // 0x0727
+    byte AreaStyle             ; // 0x0733
+    byte ForegroundScenery     ; // 0x0741
+    byte BackgroundScenery     ; // 0x0742
+    byte CloudTypeOverride     ; // 0x0743
+    byte BackgroundColorCtrl   ; // 0x0744
+    byte AreaType              ; // 0x074e
+    byte AreaAddrsLOffset      ; // 0x074f
+    byte AreaPointer           ; // 0x0750
+
+    byte PlayerEntranceCtrl    ; // 0x0710
+    byte GameTimerSetting      ; // 0x0715
+    byte AltEntranceControl    ; // 0x0752
+    byte EntrancePage          ; // 0x0751
+    byte NumberOfPlayers       ; // 0x077a
+    byte WarpZoneControl       ; // 0x06d6
+    byte ChangeAreaTimer       ; // 0x06de
+
+    byte MultiLoopCorrectCntr  ; // 0x06d9
+    byte MultiLoopPassCntr     ; // 0x06da
+
+    byte FetchNewGameTimerFlag ; // 0x0757
+    byte GameTimerExpiredFlag  ; // 0x0759
+
+    byte PrimaryHardMode       ; // 0x076a
+    byte SecondaryHardMode     ; // 0x06cc
+    byte WorldSelectNumber     ; // 0x076b
+    byte WorldSelectEnableFlag ; // 0x07fc
+    byte ContinueWorld         ; // 0x07fd
+
+    byte CurrentPlayer         ; // 0x0753
+    byte PlayerSize            ; // 0x0754
+    byte PlayerStatus          ; // 0x0756
+
+    byte OnscreenPlayerInfo    ; // 0x075a
+    byte NumberofLives         ; // 0x075a ;used by current player
+    byte HalfwayPage           ; // 0x075b
+    byte LevelNumber           ; // 0x075c ;the actual dash number
+    byte Hidden1UpFlag         ; // 0x075d
+    byte CoinTally             ; // 0x075e
+    byte WorldNumber           ; // 0x075f
+    byte AreaNumber            ; // 0x0760 ;internal number used to find areas
+
+    byte CoinTallyFor1Ups      ; // 0x0748
+
+    byte OffscreenPlayerInfo   ; // 0x0761
+    byte OffScr_NumberofLives  ; // 0x0761 ;used by offscreen player
+    byte OffScr_HalfwayPage    ; // 0x0762
+    byte OffScr_LevelNumber    ; // 0x0763
+    byte OffScr_Hidden1UpFlag  ; // 0x0764
+    byte OffScr_CoinTally      ; // 0x0765
+    byte OffScr_WorldNumber    ; // 0x0766
+    byte OffScr_AreaNumber     ; // 0x0767
+
+    byte BalPlatformAlignment  ; // 0x03a0
+    byte Platform_X_Scroll     ; // 0x03a1
+    byte PlatformCollisionFlag ; // 0x03a2
+    byte YPlatformTopYPos      ; // 0x0401
+    byte YPlatformCenterYPos   ; // 0x58
+
+    byte BrickCoinTimerFlag    ; // 0x06bc
+    byte StarFlagTaskControl   ; // 0x0746
+
+    // 7 byte shift register, enemies use the byte of their slot (wrapping if there's more of them)
+    byte PseudoRandomBitReg    [7]; // 0x07a7
+    byte WarmBootValidation    ; // 0x07ff
+
+    byte SprShuffleAmtOffset   ; // 0x06e0
+    byte SprShuffleAmt         ; // 0x06e1
+    byte SprDataOffset         ; // 0x06e4
+    byte Player_SprDataOffset  ; // 0x06e4
+    byte Enemy_SprDataOffset   ; // 0x06e5
+    byte Block_SprDataOffset   ; // 0x06ec
+    byte Alt_SprDataOffset     ; // 0x06ec
+    byte Bubble_SprDataOffset  ; // 0x06ee
+    byte FBall_SprDataOffset   ; // 0x06f1
+    byte Misc_SprDataOffset    ; // 0x06f3
+    byte SprDataOffset_Ctrl    ; // 0x03ee
+
+    // Object tables
+    // On the NES these are arrays indexed by slot, see the object slots above.
+    // What the disassembly calls Enemy_X_Position,x is SprObject_X_Position[FirstEnemySlot + x] here.
+    byte SprObject_State       [SprObjectSlots]; // 0x1d
+    byte SprObject_MovingDir   [SprObjectSlots]; // 0x45
+    byte SprObject_X_Speed     [SprObjectSlots]; // 0x57
+    byte SprObject_PageLoc     [SprObjectSlots]; // 0x6d
+    byte SprObject_X_Position  [SprObjectSlots]; // 0x86
+    byte SprObject_Y_Speed     [SprObjectSlots]; // 0x9f
+    byte SprObject_Y_HighPos   [SprObjectSlots]; // 0xb5
+    byte SprObject_Y_Position  [SprObjectSlots]; // 0xce
+    byte SprObject_X_MoveForce [SprObjectSlots]; // 0x0400
+    byte SprObject_YMF_Dummy   [SprObjectSlots]; // 0x0416
+    byte SprObject_Y_MoveForce [SprObjectSlots]; // 0x0433
+    byte SprObject_CollisionBits[SprObjectSlots]; // 0x0490
+    byte SprObj_BoundBoxCtrl   [SprObjectSlots]; // 0x0499
+    // Bounding boxes in screen coordinates, the NES kept these as 4 bytes per object.
+    // EnemyBoundingBoxCoord is FirstEnemySlot now, see Collision.
+    byte BoundingBox_UL_XPos   [SprObjectSlots]; // 0x04ac
+    byte BoundingBox_UL_YPos   [SprObjectSlots]; // 0x04ad
+    byte BoundingBox_DR_XPos   [SprObjectSlots]; // 0x04ae
+    byte BoundingBox_DR_YPos   [SprObjectSlots]; // 0x04af
+    // The NES only kept these for whichever object was being handled, now every slot has its own
+    byte SprObject_Rel_XPos    [SprObjectSlots]; // 0x03ad
+    byte SprObject_Rel_YPos    [SprObjectSlots]; // 0x03b8
+    byte SprObject_SprAttrib   [SprObjectSlots]; // 0x03c4
+    byte SprObject_OffscrBits  [SprObjectSlots]; // 0x03d0
+    // Enemies only
+    byte Enemy_Flag            [EnemySlots]; // 0x0f
+    byte Enemy_ID              [EnemySlots]; // 0x16
+
+    byte Jumpspring_FixedYPos  ; // 0x58
+    byte JumpspringAnimCtrl    ; // 0x070e
+    byte JumpspringForce       ; // 0x06db
+
+    byte DisableCollisionDet   ; // 0x0716
+
+    byte EnemyFrenzyBuffer     ; // 0x06cb
+    byte EnemyFrenzyQueue      ; // 0x06cd
+
+    byte PlayerGfxOffset       ; // 0x06d5
+    byte Player_XSpeedAbsolute ; // 0x0700
+    byte FrictionAdderHigh     ; // 0x0701
+    byte FrictionAdderLow      ; // 0x0702
+    byte RunningSpeed          ; // 0x0703
+    byte SwimmingFlag          ; // 0x0704
+    byte Player_X_MoveForce    ; // 0x0705
+    byte DiffToHaltJump        ; // 0x0706
+    byte JumpOrigin_Y_HighPos  ; // 0x0707
+    byte JumpOrigin_Y_Position ; // 0x0708
+    byte VerticalForce         ; // 0x0709
+    byte VerticalForceDown     ; // 0x070a
+    byte PlayerChangeSizeFlag  ; // 0x070b
+    byte PlayerAnimTimerSet    ; // 0x070c
+    byte PlayerAnimCtrl        ; // 0x070d
+    byte DeathMusicLoaded      ; // 0x0712
+    byte FlagpoleSoundQueue    ; // 0x0713
+    byte CrouchingFlag         ; // 0x0714
+    byte MaximumLeftSpeed      ; // 0x0450
+    byte MaximumRightSpeed     ; // 0x0456
+
+    byte EnemyOffscrBitsMasked [EnemySlots]; // 0x03d8
+
+    byte Cannon_Offset         ; // 0x046a
+    byte Cannon_PageLoc        ; // 0x046b
+    byte Cannon_X_Position     ; // 0x0471
+    byte Cannon_Y_Position     ; // 0x0477
+    byte Cannon_Timer          ; // 0x047d
+
+    byte Whirlpool_Offset      ; // 0x046a
+    byte Whirlpool_PageLoc     ; // 0x046b
+    byte Whirlpool_LeftExtent  ; // 0x0471
+    byte Whirlpool_Length      ; // 0x0477
+    byte Whirlpool_Flag        ; // 0x047d
+
+    byte VineFlagOffset        ; // 0x0398
+    byte VineHeight            ; // 0x0399
+    byte VineObjOffset         ; // 0x039a
+    byte VineStart_Y_Position  ; // 0x039d
+
+    // Hit blocks being handled, the NES does two at a time
+    #define BlockObjects 2
+    byte Block_Orig_YPos[BlockObjects]; // 0x03e4
+    byte Block_BBuf_Low[BlockObjects]; // 0x03e6
+    byte Block_Metatile[BlockObjects]; // 0x03e8
+    byte Block_PageLoc2[BlockObjects]; // 0x03ea
+    byte Block_RepFlag[BlockObjects]; // 0x03ec
+    byte Block_ResidualCounter ; // 0x03f0
+    byte Block_Orig_XPos       ; // 0x03f1
+
+
+    byte PowerUpType           ; // 0x39
+
+    byte FireballBouncingFlag  ; // 0x3a
+    byte FireballCounter       ; // 0x06ce
+    byte FireballThrowingTimer ; // 0x0711
+
+    byte HammerEnemyOffset     ; // 0x06ae
+    byte JumpCoinMiscOffset    ; // 0x06b7
+
+    // 16 columns of 13 metatiles each, index is row * 16 + column
+    #define BlockBufferSize (MetatileRows * 16)
+    byte Block_Buffer_1[BlockBufferSize]; // 0x0500
+    byte Block_Buffer_2[BlockBufferSize]; // 0x05d0
+
+    byte HammerThrowingTimer   [EnemySlots]; // 0x03a2
+    byte HammerBroJumpTimer    ; // 0x3c
+    byte Misc_Collision_Flag   ; // 0x06be
+
+    byte RedPTroopaOrigXPos    ; // 0x0401
+    byte RedPTroopaCenterYPos  ; // 0x58
+
+    byte XMovePrimaryCounter   ; // 0xa0
+    byte XMoveSecondaryCounter ; // 0x58
+
+    byte CheepCheepMoveMFlag   ; // 0x58
+    byte CheepCheepOrigYPos    ; // 0x0434
+    byte BitMFilter            ; // 0x06dd
+
+    byte LakituReappearTimer   ; // 0x06d1
+    byte LakituMoveSpeed       ; // 0x58
+    byte LakituMoveDirection   ; // 0xa0
+
+    byte FirebarSpinState_Low  ; // 0x58
+    byte FirebarSpinState_High ; // 0xa0
+    byte FirebarSpinSpeed      ; // 0x0388
+    byte FirebarSpinDirection  ; // 0x34
+
+    byte DuplicateObj_Offset   ; // 0x06cf
+    byte NumberofGroupEnemies  ; // 0x06d3
+
+    byte BlooperMoveCounter    ; // 0xa0
+    byte BlooperMoveSpeed      ; // 0x58
+
+    byte BowserBodyControls    ; // 0x0363
+    byte BowserFeetCounter     ; // 0x0364
+    byte BowserMovementSpeed   ; // 0x0365
+    byte BowserOrigXPos        ; // 0x0366
+    byte BowserFlameTimerCtrl  ; // 0x0367
+    byte BowserFront_Offset    ; // 0x0368
+    byte BridgeCollapseOffset  ; // 0x0369
+    byte BowserGfxFlag         ; // 0x036a
+    byte BowserHitPoints       ; // 0x0483
+    byte MaxRangeFromOrigin    ; // 0x06dc
+
+    byte BowserFlamePRandomOfs ; // 0x0417
+
+    byte PiranhaPlantUpYPos    ; // 0x0417
+    byte PiranhaPlantDownYPos  ; // 0x0434
+    byte PiranhaPlant_Y_Speed  ; // 0x58
+    byte PiranhaPlant_MoveFlag ; // 0xa0
+
+    byte FireworksCounter      ; // 0x06d7
+    byte ExplosionGfxCounter   ; // 0x58
+    byte ExplosionTimerCounter ; // 0xa0
+
+    // Sound related defines
+    byte Squ2_NoteLenBuffer    ; // 0x07b3
+    byte Squ2_NoteLenCounter   ; // 0x07b4
+    byte Squ2_EnvelopeDataCtrl ; // 0x07b5
+    byte Squ1_NoteLenCounter   ; // 0x07b6
+    byte Squ1_EnvelopeDataCtrl ; // 0x07b7
+    byte Tri_NoteLenBuffer     ; // 0x07b8
+    byte Tri_NoteLenCounter    ; // 0x07b9
+    byte Noise_BeatLenCounter  ; // 0x07ba
+    byte Squ1_SfxLenCounter    ; // 0x07bb
+    byte Squ2_SfxLenCounter    ; // 0x07bd
+    byte Sfx_SecondaryCounter  ; // 0x07be
+    byte Noise_SfxLenCounter   ; // 0x07bf
+
+    byte PauseSoundQueue       ; // 0xfa
+    byte Square1SoundQueue     ; // 0xff
+    byte Square2SoundQueue     ; // 0xfe
+    byte NoiseSoundQueue       ; // 0xfd
+    byte AreaMusicQueue        ; // 0xfb
+    byte EventMusicQueue       ; // 0xfc
+
+    byte Square1SoundBuffer    ; // 0xf1
+    byte Square2SoundBuffer    ; // 0xf2
+    byte NoiseSoundBuffer      ; // 0xf3
+    byte AreaMusicBuffer       ; // 0xf4
+    byte EventMusicBuffer      ; // 0x07b1
+    byte PauseSoundBuffer      ; // 0x07b2
+
+    byte MusicData             ; // 0xf5
+    byte MusicDataLow          ; // 0xf5
+    byte MusicDataHigh         ; // 0xf6
+    byte MusicOffset_Square2   ; // 0xf7
+    byte MusicOffset_Square1   ; // 0xf8
+    byte MusicOffset_Triangle  ; // 0xf9
+    byte MusicOffset_Noise     ; // 0x07b0
+
+    byte NoteLenLookupTblOfs   ; // 0xf0
+    byte DAC_Counter           ; // 0x07c0
+    byte NoiseDataLoopbackOfs  ; // 0x07c1
+    byte NoteLengthTblAdder    ; // 0x07c4
+    byte AreaMusicBuffer_Alt   ; // 0x07c5
+    byte PauseModeFlag         ; // 0x07c6
+    byte GroundMusicHeaderOfs  ; // 0x07c7
+    byte AltRegContentFlag     ; // 0x07ca
+
+    // Bookkeeping, none of this was in the NES' RAM
+    // APU register writes made during the current frame, in order.
+    // The sound synthesizer picks them up at the end of the frame, see writeAPU()
+    #define APU_WriteLogSize 64
+    byte apuWriteCount;
+    byte apuWriteLog[APU_WriteLogSize][2];
+
+    // Counts up every frame
+    uint32_t frameNumber;
+    // Changes whenever the state gets replaced wholesale (reset, loading a save state),
+    // so anything following along frame by frame knows to start over
+    uint32_t timeline;
+    // One bit per name table tile changed during the last frame, [table][row], bit = column
+    uint32_t dirtyTiles[2][30];
+    // What every metatile column of the whole area is made of, see Area collision map
+    word collisionMap[CollisionLayers][AreaColumns];
+    // Which entry of the area cache the current area is, plus one. 0 if it isn't in there.
+    word cachedArea;
+    // Next spawn of the cached area to look at, see SpawnEnemies()
+    word spawnCursor;
+    // Emulates the NES' limit of 8 sprites per scanline, along with the sprite overflow flag.
+    // Off by default, it's only there for when things should look exactly like the real thing.
+    byte spriteLimit;
+};
+typedef struct GameState GameState;
+
+// The state the game is currently running on.
+// This is per thread, so several games can run side by side.
+GameState gameState;
+THREAD_LOCAL GameState * gs = &gameState;
+
+// Hands out the timeline numbers, see GameState
+uint32_t timelineCounter = 0;
+
+uint32_t newTimeline() {
+    return __atomic_add_fetch(&timelineCounter, 1, __ATOMIC_RELAXED);
+}
 
 //-------------------------------------------------------------------------------------
 // CONSTANTS
@@ -804,6 +903,98 @@ int writeToPPUAddress(unsigned int address, PPU * _ppu) {
     return 0;
 }
 
+// Name table, attribute and palette writes all go through here,
+// so the renderer knows which tiles actually changed this frame
+int writeVRAM(word address, byte value) {
+    int table, offset;
+    address &= 0x3fff;
+    if (address >= 0x3f00) {
+        // 0x3f10/0x3f14/0x3f18/0x3f1c are mirrors of 0x3f00/0x3f04/0x3f08/0x3f0c
+        byte index = address & 0x1f;
+        if ((index & 0x13) == 0x10) {
+            index &= 0x0f;
+        }
+        gs->ppu.PPU_PALETTE[index] = value;
+        return 0;
+    }
+    if (address < 0x2000) {
+        // Pattern tables are ROM
+        return -1;
+    }
+    // Vertical mirroring, 0x2800 is 0x2000 again and 0x2c00 is 0x2400
+    table = (address >> 10) & 1;
+    offset = address & 0x3ff;
+    if (offset < 960) {
+        if (gs->nameTable[table * 1024 + offset] != value) {
+            gs->nameTable[table * 1024 + offset] = value;
+            gs->dirtyTiles[table][offset >> 5] |= 1u << (offset & 31);
+        }
+    } else {
+        offset -= 960;
+        if (gs->attributeTable[table * 64 + offset] != value) {
+            // Every attribute byte covers a 4x4 block of tiles
+            int row = (offset >> 3) * 4;
+            gs->attributeTable[table * 64 + offset] = value;
+            for (int blockRow = row; blockRow < row + 4 && blockRow < 30; blockRow++) {
+                gs->dirtyTiles[table][blockRow] |= 0xfu << ((offset & 7) * 4);
+            }
+        }
+    }
+    return 0;
+}
+
+// Writes a whole run of bytes to VRAM, like writing PPU_DATA length times.
+// stride is the address increment, 1 across or 32 down.
+// With repeat set, data is a single byte written length times.
+// Runs inside the name tables get copied in one go, anything else goes byte by byte.
+int writeVRAMRun(word address, const byte * data, int length, int stride, int repeat) {
+    while (length > 0) {
+        int table, offset, count;
+        byte * destination;
+        address &= 0x3fff;
+        table = (address >> 10) & 1;
+        offset = address & 0x3ff;
+        if (address < 0x2000 || address >= 0x3f00 || offset >= 960) {
+            writeVRAM(address, *data);
+            address += stride;
+            data += repeat ? 0 : 1;
+            length--;
+            continue;
+        }
+        destination = &gs->nameTable[table * 1024 + offset];
+        if (stride == 1) {
+            // Up to the end of the tiles
+            count = 960 - offset;
+            if (count > length) {
+                count = length;
+            }
+            if (repeat) {
+                memset(destination, *data, count);
+            } else {
+                memcpy(destination, data, count);
+            }
+            for (int tile = offset; tile < offset + count; tile++) {
+                gs->dirtyTiles[table][tile >> 5] |= 1u << (tile & 31);
+            }
+        } else {
+            // Down to the bottom row
+            count = 30 - (offset >> 5);
+            if (count > length) {
+                count = length;
+            }
+            for (int row = 0; row < count; row++) {
+                destination[row * 32] = repeat ? *data : data[row];
+                gs->dirtyTiles[table][(offset >> 5) + row] |= 1u << (offset & 31);
+            }
+        }
+        address += count * stride;
+        data += repeat ? 0 : count;
+        length -= count;
+    }
+    gs->ppu.PPU_ADDRESS = address;
+    return 0;
+}
+
 int writeToPPUScroll(int scrollX, int scrollY, PPU * _ppu) {
     _ppu->PPU_SCROLL_REG_X = scrollX;
     _ppu->PPU_SCROLL_REG_Y = scrollY;
@@ -811,89 +1002,2954 @@ int writeToPPUScroll(int scrollX, int scrollY, PPU * _ppu) {
 }
 
 
-// Game Functions
-// Hacks/Temps
-PPU ppu;
+// ROM
+// The graphics and such come from an original ROM the user has to provide
+byte prgRom[0x8000];
+byte chrRom[0x2000];
+byte romLoaded = 0;
 
-byte nonMaskableInterrupt = 0;
-byte running = 1;
+// Loads an iNES dump of Super Mario Bros.
+int loadROM(const char * path) {
+    byte header[16];
+    size_t prgSize;
+    FILE * file = fopen(path, "rb");
+    if (!file) {
+        return -1;
+    }
+    if (fread(header, 1, 16, file) != 16 || memcmp(header, "NES\x1a", 4)) {
+        fclose(file);
+        return -1;
+    }
+    // Skip the trainer if there is one
+    if (header[6] & 0b00000100) {
+        fseek(file, 512, SEEK_CUR);
+    }
+    prgSize = (size_t)header[4] * 0x4000;
+    if (prgSize != sizeof(prgRom) || header[5] != 1
+        || fread(prgRom, 1, sizeof(prgRom), file) != sizeof(prgRom)
+        || fread(chrRom, 1, sizeof(chrRom), file) != sizeof(chrRom)) {
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    romLoaded = 1;
+    return 0;
+}
 
-struct Sprite {
-	unsigned int x;
-	unsigned int y;
+// Memory mapped files
+struct MappedFile {
+    void * data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
 };
-typedef struct Sprite Sprite;
-
-#define numberOfSprites 8
-Sprite spriteArray[numberOfSprites];
-byte nameTable[1024];
-byte attributeTable[1024];
+typedef struct MappedFile MappedFile;
 
-int InitalizeMemory() {
-    // TODO
+// Maps a whole file read-only
+int mapFile(const char * path, MappedFile * _mapped) {
+    memset(_mapped, 0, sizeof(MappedFile));
+#ifdef _WIN32
+    LARGE_INTEGER size;
+    _mapped->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (_mapped->file == INVALID_HANDLE_VALUE) {
+        return -1;
+    }
+    if (!GetFileSizeEx(_mapped->file, &size) || !size.QuadPart) {
+        CloseHandle(_mapped->file);
+        return -1;
+    }
+    _mapped->size = (size_t)size.QuadPart;
+    _mapped->mapping = CreateFileMappingA(_mapped->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!_mapped->mapping) {
+        CloseHandle(_mapped->file);
+        return -1;
+    }
+    _mapped->data = MapViewOfFile(_mapped->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!_mapped->data) {
+        CloseHandle(_mapped->mapping);
+        CloseHandle(_mapped->file);
+        return -1;
+    }
+#else
+    struct stat info;
+    int file = open(path, O_RDONLY);
+    if (file < 0) {
+        return -1;
+    }
+    if (fstat(file, &info) || !info.st_size) {
+        close(file);
+        return -1;
+    }
+    _mapped->size = (size_t)info.st_size;
+    _mapped->data = mmap(NULL, _mapped->size, PROT_READ, MAP_SHARED, file, 0);
+    // The mapping stays valid after closing
+    close(file);
+    if (_mapped->data == MAP_FAILED) {
+        _mapped->data = NULL;
+        return -1;
+    }
+#endif
     return 0;
 }
 
-// this routine moves all sprites off the screen
-int MoveAllSpritesOffscreen() {
-    // this routine moves all but sprite 0 off the screen
-    for (int currentSprite = 1; currentSprite < numberOfSprites; currentSprite++) {
-        spriteArray[currentSprite].y = 0xf8;
+int unmapFile(MappedFile * _mapped) {
+    if (!_mapped->data) {
+        return 0;
     }
+#ifdef _WIN32
+    UnmapViewOfFile(_mapped->data);
+    CloseHandle(_mapped->mapping);
+    CloseHandle(_mapped->file);
+#else
+    munmap(_mapped->data, _mapped->size);
+#endif
+    memset(_mapped, 0, sizeof(MappedFile));
     return 0;
 }
 
-int WritePPUReg1(byte input) {
-    ppu.PPU_CTRL_REG1 = input;
-    Mirror_PPU_CTRL_REG1 = input;
+// Writes a whole file next to path first and then renames it over path,
+// so a crash halfway through never leaves a cut off file to be mapped in later
+int writeFileReplacing(const char * path, const void * data, size_t size) {
+    char temporary[1024];
+    FILE * file;
+    int written;
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    file = fopen(temporary, "wb");
+    if (!file) {
+        return -1;
+    }
+    written = fwrite(data, size, 1, file) == 1;
+    if (fclose(file) || !written) {
+        remove(temporary);
+        return -1;
+    }
+#ifdef _WIN32
+    if (!MoveFileExA(temporary, path, MOVEFILE_REPLACE_EXISTING)) {
+#else
+    if (rename(temporary, path)) {
+#endif
+        remove(temporary);
+        return -1;
+    }
     return 0;
 }
 
-int InitScroll(byte input) {
-    ppu.PPU_SCROLL_REG_X = input;
-    ppu.PPU_SCROLL_REG_Y = input;
+// FNV-1a, good enough to tell if a file still matches the ROM
+uint32_t checksum32(const byte * data, size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
 }
 
-int WriteNTAddr(byte input) {
-    for (int currentNT = 0; currentNT < 768; currentNT++) {
-        nameTable[currentNT] = 0x24;
+// Tile cache
+// The NES stores tiles as two bit planes, which is a pain to pull pixels out of.
+// So all 512 tiles of both pattern tables get decoded once into one byte per pixel (0-3),
+// along with the horizontally, vertically and doubly flipped versions the sprites need.
+//
+// The cache is also saved to a file next to the game, later starts just map that in.
+// File layout: TileCacheHeader, then the tiles, flip major: [flip][tile][row][column]
+#define TileCacheMagic "SMBCHR"
+#define TileCacheVersion 1
+#define TileCacheTiles 512
+#define TileCacheSize (4 * TileCacheTiles * 64)
+#define TileFlipHorizontal 0b01
+#define TileFlipVertical 0b10
+
+// Padded to a whole cache line so the tiles after it stay aligned for vector loads
+struct TileCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t chrChecksum;
+    byte padding[48];
+};
+typedef struct TileCacheHeader TileCacheHeader;
+
+const byte * tileCache = NULL;
+byte * tileCacheMemory = NULL;
+MappedFile tileCacheFile;
+
+#define tileCacheRow(flip, tile, row) (tileCache + (((flip) * TileCacheTiles + (tile)) * 64) + (row) * 8)
+
+int freeTileCache() {
+    unmapFile(&tileCacheFile);
+    free(tileCacheMemory);
+    tileCacheMemory = NULL;
+    tileCache = NULL;
+    return 0;
+}
+
+// Decodes one row of count tiles into palette indices, 8 pixels per tile.
+// Pixel value 0 stays 0 (transparent), everything else becomes palette * 4 + pixel.
+// low/high are the two bit planes of the row, palette the attribute of the tile.
+void decodeTileRows(const byte * low, const byte * high, const byte * palette, int count, byte * _out) {
+    int tile = 0;
+#if defined(__AVX2__)
+    const __m256i bitMask = _mm256_set1_epi64x((long long)0x0102040810204080ull);
+    const __m256i zero = _mm256_setzero_si256();
+    for (; tile + 4 <= count; tile += 4) {
+        __m256i lowBits = _mm256_set_epi64x(low[tile + 3] * 0x0101010101010101ll, low[tile + 2] * 0x0101010101010101ll,
+                                            low[tile + 1] * 0x0101010101010101ll, low[tile] * 0x0101010101010101ll);
+        __m256i highBits = _mm256_set_epi64x(high[tile + 3] * 0x0101010101010101ll, high[tile + 2] * 0x0101010101010101ll,
+                                             high[tile + 1] * 0x0101010101010101ll, high[tile] * 0x0101010101010101ll);
+        __m256i palettes = _mm256_set_epi64x((palette[tile + 3] << 2) * 0x0101010101010101ll, (palette[tile + 2] << 2) * 0x0101010101010101ll,
+                                             (palette[tile + 1] << 2) * 0x0101010101010101ll, (palette[tile] << 2) * 0x0101010101010101ll);
+        __m256i pixels;
+        lowBits = _mm256_cmpeq_epi8(_mm256_and_si256(lowBits, bitMask), bitMask);
+        highBits = _mm256_cmpeq_epi8(_mm256_and_si256(highBits, bitMask), bitMask);
+        pixels = _mm256_or_si256(_mm256_and_si256(lowBits, _mm256_set1_epi8(1)), _mm256_and_si256(highBits, _mm256_set1_epi8(2)));
+        pixels = _mm256_or_si256(pixels, _mm256_andnot_si256(_mm256_cmpeq_epi8(pixels, zero), palettes));
+        _mm256_storeu_si256((__m256i *)(_out + tile * 8), pixels);
+    }
+#endif
+#if defined(__SSE2__)
+    {
+        const __m128i bitMask = _mm_set1_epi64x((long long)0x0102040810204080ull);
+        const __m128i zero = _mm_setzero_si128();
+        for (; tile + 2 <= count; tile += 2) {
+            __m128i lowBits = _mm_set_epi64x(low[tile + 1] * 0x0101010101010101ll, low[tile] * 0x0101010101010101ll);
+            __m128i highBits = _mm_set_epi64x(high[tile + 1] * 0x0101010101010101ll, high[tile] * 0x0101010101010101ll);
+            __m128i palettes = _mm_set_epi64x((palette[tile + 1] << 2) * 0x0101010101010101ll, (palette[tile] << 2) * 0x0101010101010101ll);
+            __m128i pixels;
+            lowBits = _mm_cmpeq_epi8(_mm_and_si128(lowBits, bitMask), bitMask);
+            highBits = _mm_cmpeq_epi8(_mm_and_si128(highBits, bitMask), bitMask);
+            pixels = _mm_or_si128(_mm_and_si128(lowBits, _mm_set1_epi8(1)), _mm_and_si128(highBits, _mm_set1_epi8(2)));
+            pixels = _mm_or_si128(pixels, _mm_andnot_si128(_mm_cmpeq_epi8(pixels, zero), palettes));
+            _mm_storeu_si128((__m128i *)(_out + tile * 8), pixels);
+        }
     }
-    VRAM_Buffer1_Offset = 0;
-    VRAM_Buffer1 = 0;
-    for (int currentAT = 0; currentAT < 0x64; currentAT++) {
-        attributeTable[currentAT] = 0;
+#endif
+    for (; tile < count; tile++) {
+        for (int bit = 0; bit < 8; bit++) {
+            byte pixel = ((low[tile] >> (7 - bit)) & 1) | (((high[tile] >> (7 - bit)) & 1) << 1);
+            _out[tile * 8 + bit] = pixel ? (byte)(pixel | (palette[tile] << 2)) : 0;
+        }
     }
-    HorizontalScroll = 0;
-    VerticalScroll = 0;
-    InitScroll(0);
-    return 0;
 }
 
-int InitializeNameTables() {
-    byte temp = ppu.PPU_STATUS;
-    temp = Mirror_PPU_CTRL_REG1;
-    temp |= 0b00010000;
-    temp &= 0b11110000;
-    WritePPUReg1(temp);
-    WriteNTAddr(0x24);
-    WriteNTAddr(0x20);
+// Decodes chrRom into _tiles, flip major like in the file
+int decodeTileCache(byte * _tiles) {
+    const byte noPalette[TileCacheTiles] = { 0 };
+    byte low[TileCacheTiles], high[TileCacheTiles];
+    for (int row = 0; row < 8; row++) {
+        byte decoded[TileCacheTiles * 8];
+        for (int tile = 0; tile < TileCacheTiles; tile++) {
+            low[tile] = chrRom[tile * 16 + row];
+            high[tile] = chrRom[tile * 16 + row + 8];
+        }
+        decodeTileRows(low, high, noPalette, TileCacheTiles, decoded);
+        for (int tile = 0; tile < TileCacheTiles; tile++) {
+            for (int flip = 0; flip < 4; flip++) {
+                int flippedRow = (flip & TileFlipVertical) ? 7 - row : row;
+                byte * out = _tiles + ((flip * TileCacheTiles + tile) * 64) + flippedRow * 8;
+                for (int column = 0; column < 8; column++) {
+                    out[(flip & TileFlipHorizontal) ? 7 - column : column] = decoded[tile * 8 + column];
+                }
+            }
+        }
+    }
     return 0;
 }
 
-int NonMaskableInterrupt() {
-    byte temp = ppu.PPU_CTRL_REG1;
-
-    // Disable interrupts
-    if (DisableScreenFlag) {
-        goto ScreenOff;
+// Gets the tile cache ready for the currently loaded ROM.
+// Maps cachePath if it exists and matches, otherwise decodes and tries to save it there.
+// cachePath can be NULL to only keep it in memory.
+int loadTileCache(const char * cachePath) {
+    uint32_t checksum = checksum32(chrRom, sizeof(chrRom));
+    TileCacheHeader header;
+    FILE * file;
+    freeTileCache();
+    if (cachePath && !mapFile(cachePath, &tileCacheFile)) {
+        const TileCacheHeader * mapped = tileCacheFile.data;
+        if (tileCacheFile.size == sizeof(TileCacheHeader) + TileCacheSize
+            && !memcmp(mapped->magic, TileCacheMagic, sizeof(TileCacheMagic))
+            && mapped->version == TileCacheVersion
+            && mapped->chrChecksum == checksum) {
+            tileCache = (const byte *)tileCacheFile.data + sizeof(TileCacheHeader);
+            return 0;
+        }
+        // Stale or broken, make a new one
+        unmapFile(&tileCacheFile);
+    }
+    // Over-allocate so the tiles can start on a cache line
+    tileCacheMemory = malloc(TileCacheSize + CACHE_LINE_SIZE);
+    if (!tileCacheMemory) {
+        return -1;
+    }
+    tileCache = (const byte *)(((uintptr_t)tileCacheMemory + CACHE_LINE_SIZE - 1) & ~(uintptr_t)(CACHE_LINE_SIZE - 1));
+    decodeTileCache((byte *)tileCache);
+    if (!cachePath) {
+        return 0;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TileCacheMagic, sizeof(TileCacheMagic));
+    header.version = TileCacheVersion;
+    header.chrChecksum = checksum;
+    file = fopen(cachePath, "wb");
+    if (file) {
+        fwrite(&header, sizeof(header), 1, file);
+        fwrite(tileCache, TileCacheSize, 1, file);
+        fclose(file);
     }
-    ScreenOff:
-
     return 0;
 }
 
-int Start() {
-    // Init PPU Control Register
+// PPU Rendering
+// Turns the name tables, attributes and sprites into an actual picture.
+// Nothing in here touches gs, everything comes from the state passed in,
+// so a frame can be rendered from a copy while the game moves on.
+#define ScreenWidth 256
+#define ScreenHeight 240
+
+// The picture is indexed, every pixel is one of the 64 NES colors
+struct Framebuffer {
+    byte pixels[ScreenHeight][ScreenWidth];
+    // Emphasis bits of PPU_CTRL_REG2, they apply to the whole picture
+    byte emphasis;
+};
+typedef struct Framebuffer Framebuffer;
+
+// What the 64 NES colors look like, as 0xRRGGBB
+const uint32_t NESPalette[64] = {
+    0x626262, 0x001fb2, 0x2404c8, 0x5200b2, 0x730076, 0x800024, 0x730b00, 0x522800,
+    0x244400, 0x005700, 0x005c00, 0x005324, 0x003c76, 0x000000, 0x000000, 0x000000,
+    0xababab, 0x0d57ff, 0x4b30ff, 0x8a13ff, 0xbc08d6, 0xd21269, 0xc72e00, 0x9d5400,
+    0x607b00, 0x209800, 0x00a300, 0x009942, 0x007db4, 0x000000, 0x000000, 0x000000,
+    0xffffff, 0x53aeff, 0x9085ff, 0xd365ff, 0xff57ff, 0xff5dcf, 0xff7757, 0xfa9e00,
+    0xbdc700, 0x7ae700, 0x43f611, 0x26ef7e, 0x2cd5f6, 0x4e4e4e, 0x000000, 0x000000,
+    0xffffff, 0xb6e1ff, 0xced1ff, 0xe9c3ff, 0xffbcff, 0xffbdf4, 0xffc6c3, 0xffd59a,
+    0xe9e681, 0xcef481, 0xb6fb9a, 0xa9fac3, 0xa9f0f4, 0xb8b8b8, 0x000000, 0x000000
+};
+
+// Looks up palette indices 0-31 in palette RAM, giving the final NES colors
+void lookupPalette(const byte * palette, const byte * indices, int count, byte greyscaleMask, byte * _out) {
+    int pixel = 0;
+#if defined(__AVX2__)
+    {
+        const __m256i lowHalf = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)palette));
+        const __m256i highHalf = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(palette + 16)));
+        const __m256i mask = _mm256_set1_epi8((char)greyscaleMask);
+        for (; pixel + 32 <= count; pixel += 32) {
+            __m256i index = _mm256_loadu_si256((const __m256i *)(indices + pixel));
+            __m256i useHigh = _mm256_cmpeq_epi8(_mm256_and_si256(index, _mm256_set1_epi8(0x10)), _mm256_set1_epi8(0x10));
+            __m256i low = _mm256_shuffle_epi8(lowHalf, _mm256_and_si256(index, _mm256_set1_epi8(0x0f)));
+            __m256i high = _mm256_shuffle_epi8(highHalf, _mm256_and_si256(index, _mm256_set1_epi8(0x0f)));
+            __m256i color = _mm256_blendv_epi8(low, high, useHigh);
+            _mm256_storeu_si256((__m256i *)(_out + pixel), _mm256_and_si256(color, mask));
+        }
+    }
+#elif defined(__SSSE3__)
+    {
+        const __m128i lowHalf = _mm_loadu_si128((const __m128i *)palette);
+        const __m128i highHalf = _mm_loadu_si128((const __m128i *)(palette + 16));
+        const __m128i mask = _mm_set1_epi8((char)greyscaleMask);
+        for (; pixel + 16 <= count; pixel += 16) {
+            __m128i index = _mm_loadu_si128((const __m128i *)(indices + pixel));
+            __m128i useHigh = _mm_cmpeq_epi8(_mm_and_si128(index, _mm_set1_epi8(0x10)), _mm_set1_epi8(0x10));
+            __m128i low = _mm_shuffle_epi8(lowHalf, _mm_and_si128(index, _mm_set1_epi8(0x0f)));
+            __m128i high = _mm_shuffle_epi8(highHalf, _mm_and_si128(index, _mm_set1_epi8(0x0f)));
+            __m128i color = _mm_or_si128(_mm_and_si128(useHigh, high), _mm_andnot_si128(useHigh, low));
+            _mm_storeu_si128((__m128i *)(_out + pixel), _mm_and_si128(color, mask));
+        }
+    }
+#endif
+    // Plain SSE2 has no byte shuffle, so it does the lookup this way too
+    for (; pixel < count; pixel++) {
+        _out[pixel] = palette[indices[pixel] & 0x1f] & greyscaleMask;
+    }
+}
+
+// Picks between background and sprite pixels.
+// Sprite pixels have the priority bit in bit 7, 0 means there is no sprite pixel.
+void combineLine(const byte * background, const byte * sprites, int count, byte * _out) {
+    int pixel = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i priorityBit = _mm_set1_epi8((char)0x80);
+    for (; pixel + 16 <= count; pixel += 16) {
+        __m128i bg = _mm_loadu_si128((const __m128i *)(background + pixel));
+        __m128i spr = _mm_loadu_si128((const __m128i *)(sprites + pixel));
+        __m128i noSprite = _mm_cmpeq_epi8(spr, zero);
+        __m128i behind = _mm_cmpeq_epi8(_mm_and_si128(spr, priorityBit), priorityBit);
+        __m128i bgOpaque = _mm_xor_si128(_mm_cmpeq_epi8(bg, zero), _mm_set1_epi8(-1));
+        __m128i useBackground = _mm_or_si128(noSprite, _mm_and_si128(behind, bgOpaque));
+        __m128i result = _mm_or_si128(_mm_and_si128(useBackground, bg), _mm_andnot_si128(useBackground, _mm_andnot_si128(priorityBit, spr)));
+        _mm_storeu_si128((__m128i *)(_out + pixel), result);
+    }
+#endif
+    for (; pixel < count; pixel++) {
+        byte sprite = sprites[pixel];
+        if (!sprite || ((sprite & 0x80) && background[pixel])) {
+            _out[pixel] = background[pixel];
+        } else {
+            _out[pixel] = sprite & 0x7f;
+        }
+    }
+}
+
+// Adds the palette bits onto count rows of 8 cached tile pixels, leaving transparent ones alone
+void applyTilePalettes(const byte ** rows, const byte * palette, int count, byte * _out) {
+    int tile = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; tile + 2 <= count; tile += 2) {
+        __m128i pixels = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)rows[tile]), _mm_loadl_epi64((const __m128i *)rows[tile + 1]));
+        __m128i palettes = _mm_set_epi64x((palette[tile + 1] << 2) * 0x0101010101010101ll, (palette[tile] << 2) * 0x0101010101010101ll);
+        pixels = _mm_or_si128(pixels, _mm_andnot_si128(_mm_cmpeq_epi8(pixels, zero), palettes));
+        _mm_storeu_si128((__m128i *)(_out + tile * 8), pixels);
+    }
+#endif
+    for (; tile < count; tile++) {
+        for (int bit = 0; bit < 8; bit++) {
+            byte pixel = rows[tile][bit];
+            _out[tile * 8 + bit] = pixel ? (byte)(pixel | (palette[tile] << 2)) : 0;
+        }
+    }
+}
+
+// Background layer
+// Both name tables rasterized side by side into one 512x240 picture of palette indices.
+// It sticks around between frames and only the tiles that changed get drawn again,
+// scrolling is then just reading from a different spot in it.
+struct BackgroundLayer {
+    byte pixels[ScreenHeight][ScreenWidth * 2];
+    // What the layer currently shows, if any of this doesn't match up it gets redrawn completely
+    byte valid;
+    byte patternTable;
+    uint32_t timeline;
+    uint32_t frameNumber;
+    // Tiles drawn last time, just for keeping an eye on it
+    int tilesDrawn;
+};
+typedef struct BackgroundLayer BackgroundLayer;
+
+// Draws a single name table tile into the layer
+void rasterizeTile(BackgroundLayer * _layer, const GameState * _state, int table, int row, int column) {
+    const byte * rows[8];
+    byte palette[8];
+    byte decoded[64];
+    byte tile = _state->nameTable[table * 1024 + row * 32 + column];
+    byte attribute = _state->attributeTable[table * 64 + (row >> 2) * 8 + (column >> 2)];
+    // Each attribute byte covers 4x4 tiles, 2 bits per 2x2 quadrant
+    memset(palette, (attribute >> (((row & 2) << 1) | (column & 2))) & 0b11, sizeof(palette));
+    for (int fineY = 0; fineY < 8; fineY++) {
+        rows[fineY] = tileCacheRow(0, _layer->patternTable * 256 + tile, fineY);
+    }
+    applyTilePalettes(rows, palette, 8, decoded);
+    for (int fineY = 0; fineY < 8; fineY++) {
+        memcpy(&_layer->pixels[row * 8 + fineY][table * ScreenWidth + column * 8], decoded + fineY * 8, 8);
+    }
+    _layer->tilesDrawn++;
+}
+
+// Brings the layer up to date with the given state.
+// If it saw the frame right before this one, only the dirty tiles get drawn.
+int updateBackgroundLayer(BackgroundLayer * _layer, const GameState * _state, int patternTable) {
+    int full = !_layer->valid
+        || _layer->patternTable != patternTable
+        || _layer->timeline != _state->timeline
+        || _layer->frameNumber + 1 != _state->frameNumber;
+    _layer->tilesDrawn = 0;
+    if (_layer->valid && _layer->timeline == _state->timeline && _layer->frameNumber == _state->frameNumber
+        && _layer->patternTable == patternTable) {
+        // Already seen this one
+        return 0;
+    }
+    _layer->patternTable = patternTable;
+    for (int table = 0; table < 2; table++) {
+        for (int row = 0; row < 30; row++) {
+            uint32_t dirty = full ? 0xffffffffu : _state->dirtyTiles[table][row];
+            while (dirty) {
+                int column = 0;
+                while (!(dirty & (1u << column))) {
+                    column++;
+                }
+                dirty &= dirty - 1;
+                rasterizeTile(_layer, _state, table, row, column);
+            }
+        }
+    }
+    _layer->valid = 1;
+    _layer->timeline = _state->timeline;
+    _layer->frameNumber = _state->frameNumber;
+    return 0;
+}
+
+// Background palette indices for one scanline, scrolled.
+// scrollX covers both tables, 0-511.
+void renderBackgroundLine(const BackgroundLayer * _layer, int scanline, int scrollX, int scrollY, byte * _line) {
+    const byte * row = _layer->pixels[(scanline + scrollY) % ScreenHeight];
+    int firstPart;
+    scrollX &= ScreenWidth * 2 - 1;
+    firstPart = ScreenWidth * 2 - scrollX;
+    if (firstPart >= ScreenWidth) {
+        memcpy(_line, row + scrollX, ScreenWidth);
+    } else {
+        // Wraps around back into the first table
+        memcpy(_line, row + scrollX, firstPart);
+        memcpy(_line + firstPart, row, ScreenWidth - firstPart);
+    }
+}
+
+// Which scanlines a sprite covers, clipped to the screen.
+// Returns the amount of lines, _first gets the first one.
+int spriteLines(const Sprite * _sprite, int height, int * _first) {
+    int first = (int)_sprite->y + 1;
+    if (_sprite->y >= ScreenHeight) {
+        return 0;
+    }
+    *_first = first;
+    return first + height > ScreenHeight ? ScreenHeight - first : height;
+}
+
+// Counts the sprites on every scanline into _counts
+int countSpritesPerLine(const GameState * _state, int * _counts) {
+    int height = (_state->ppu.PPU_CTRL_REG1 & 0b00100000) ? 16 : 8;
+    memset(_counts, 0, ScreenHeight * sizeof(int));
+    for (int index = 0; index < _state->spriteCount; index++) {
+        int first;
+        int lines = spriteLines(&_state->spriteArray[index], height, &first);
+        for (int line = first; line < first + lines; line++) {
+            _counts[line]++;
+        }
+    }
+    return 0;
+}
+
+// Whether some scanline has more sprites than the NES could show
+int spriteOverflow(const GameState * _state) {
+    int counts[ScreenHeight];
+    countSpritesPerLine(_state, counts);
+    for (int line = 0; line < ScreenHeight; line++) {
+        if (counts[line] > SpritesPerLineLimit) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Sprites sorted by scanline, so drawing a line only looks at the sprites actually on it.
+// It's a counting sort: count the sprites per line, turn that into where every line
+// starts in one shared list, then drop every sprite into the lines it covers.
+// The sprites on a line stay in pool order, which is also their priority.
+struct SpriteBins {
+    // The sprites on line y are lines[lineStart[y]] up to lines[lineStart[y + 1]]
+    int lineStart[ScreenHeight + 1];
+    word lines[SpritePoolSize * 16];
+};
+typedef struct SpriteBins SpriteBins;
+
+int binSprites(SpriteBins * _bins, const GameState * _state) {
+    int height = (_state->ppu.PPU_CTRL_REG1 & 0b00100000) ? 16 : 8;
+    int counts[ScreenHeight];
+    countSpritesPerLine(_state, counts);
+    _bins->lineStart[0] = 0;
+    for (int line = 0; line < ScreenHeight; line++) {
+        // Past the limit the NES just drops the rest, lowest priority first
+        if (_state->spriteLimit && counts[line] > SpritesPerLineLimit) {
+            counts[line] = SpritesPerLineLimit;
+        }
+        _bins->lineStart[line + 1] = _bins->lineStart[line] + counts[line];
+        // From here on counts is where the next sprite on the line goes
+        counts[line] = _bins->lineStart[line];
+    }
+    for (int index = 0; index < _state->spriteCount; index++) {
+        int first;
+        int lines = spriteLines(&_state->spriteArray[index], height, &first);
+        for (int line = first; line < first + lines; line++) {
+            if (counts[line] < _bins->lineStart[line + 1]) {
+                _bins->lines[counts[line]++] = (word)index;
+            }
+        }
+    }
+    return 0;
+}
+
+// Sprite pixels for one scanline, see combineLine() for the format
+void renderSpriteLine(const GameState * _state, const SpriteBins * _bins, int scanline, byte * _line) {
+    byte ctrl = _state->ppu.PPU_CTRL_REG1;
+    int height = (ctrl & 0b00100000) ? 16 : 8;
+    memset(_line, 0, ScreenWidth);
+    for (int bin = _bins->lineStart[scanline]; bin < _bins->lineStart[scanline + 1]; bin++) {
+        const Sprite * sprite = &_state->spriteArray[_bins->lines[bin]];
+        int row = scanline - (int)sprite->y - 1;
+        int tile, flip;
+        const byte * pixels;
+        byte flags;
+        // The cache has every flipped version, so flipping is just picking the right one
+        flip = (sprite->attributes >> 6) & 0b11;
+        if (height == 16) {
+            // 8x16 sprites pick their pattern table with bit 0 of the tile number,
+            // and flipping vertically also swaps the two halves
+            int bottomHalf = (row >= 8) ^ ((flip & TileFlipVertical) ? 1 : 0);
+            tile = ((sprite->tile & 1) ? 256 : 0) + (sprite->tile & 0xfe) + bottomHalf;
+        } else {
+            tile = ((ctrl & 0b00001000) ? 256 : 0) + sprite->tile;
+        }
+        pixels = tileCacheRow(flip, tile, row & 7);
+        flags = 0x10 | ((sprite->attributes & 0b11) << 2) | ((sprite->attributes & 0b00100000) << 2);
+        for (int bit = 0; bit < 8; bit++) {
+            int x = (int)sprite->x + bit;
+            // Lower sprites win, even if they end up behind the background
+            if (x < ScreenWidth && pixels[bit] && !_line[x]) {
+                _line[x] = flags | pixels[bit];
+            }
+        }
+    }
+}
+
+// Everything the renderer keeps around between frames
+struct Renderer {
+    BackgroundLayer background;
+    SpriteBins sprites;
+};
+typedef struct Renderer Renderer;
+
+// Gets the background layer and the sprites ready for drawing lines of the given state
+int prepareFrame(Renderer * _renderer, const GameState * _state) {
+    byte mask = _state->ppu.PPU_CTRL_REG2;
+    if (!tileCache) {
+        return -1;
+    }
+    if (mask & 0b00001000) {
+        updateBackgroundLayer(&_renderer->background, _state, (_state->ppu.PPU_CTRL_REG1 & 0b00010000) ? 1 : 0);
+    }
+    if (mask & 0b00010000) {
+        binSprites(&_renderer->sprites, _state);
+    }
+    return 0;
+}
+
+// Draws one scanline in NES colors, after prepareFrame().
+// Lines don't depend on each other, so only the ones needed have to be drawn.
+int renderScanline(const Renderer * _renderer, const GameState * _state, int scanline, byte * _line) {
+    const PPU * ppu = &_state->ppu;
+    byte mask = ppu->PPU_CTRL_REG2;
+    byte greyscaleMask = (mask & 0b00000001) ? 0x30 : 0x3f;
+    byte background[ScreenWidth], sprites[ScreenWidth], combined[ScreenWidth];
+    int scrollX = ppu->PPU_SCROLL_REG_X + ((ppu->PPU_CTRL_REG1 & 0b00000001) ? 256 : 0);
+    int splitLine = 0;
+    // The status bar doesn't scroll. The game waits for sprite 0 to hit and only
+    // sets the scroll after that, so everything above it uses no scroll at all.
+    if (_state->Sprite0HitDetectFlag) {
+        splitLine = (int)_state->spriteArray[0].y + 1 + 8;
+    }
+    if (mask & 0b00001000) {
+        if (scanline < splitLine) {
+            renderBackgroundLine(&_renderer->background, scanline, 0, 0, background);
+        } else {
+            renderBackgroundLine(&_renderer->background, scanline, scrollX, ppu->PPU_SCROLL_REG_Y, background);
+        }
+        if (!(mask & 0b00000010)) {
+            memset(background, 0, 8);
+        }
+    } else {
+        memset(background, 0, ScreenWidth);
+    }
+    if (mask & 0b00010000) {
+        renderSpriteLine(_state, &_renderer->sprites, scanline, sprites);
+        if (!(mask & 0b00000100)) {
+            memset(sprites, 0, 8);
+        }
+    } else {
+        memset(sprites, 0, ScreenWidth);
+    }
+    combineLine(background, sprites, ScreenWidth, combined);
+    lookupPalette(ppu->PPU_PALETTE, combined, ScreenWidth, greyscaleMask, _line);
+    return 0;
+}
+
+// Renders a whole frame of the given state into _frame
+int renderFrame(Renderer * _renderer, const GameState * _state, Framebuffer * _frame) {
+    if (prepareFrame(_renderer, _state)) {
+        return -1;
+    }
+    _frame->emphasis = _state->ppu.PPU_CTRL_REG2 & 0b11100000;
+    for (int scanline = 0; scanline < ScreenHeight; scanline++) {
+        renderScanline(_renderer, _state, scanline, _frame->pixels[scanline]);
+    }
+    return 0;
+}
+
+// APU Functions
+// Sound register writes go through here. The register values are kept like before,
+// and every write also gets logged for the synthesizer, since writes to some registers
+// do more than just set a value (restarting notes and such).
+int writeAPU(word address, byte value) {
+    byte reg = address - 0x4000;
+    if (reg >= 0x18) {
+        return -1;
+    }
+    switch (address) {
+        case 0x4000: gs->SND_SQUARE1_REG = value; break;
+        case 0x4004: gs->SND_SQUARE2_REG = value; break;
+        case 0x4008: gs->SND_TRIANGLE_REG = value; break;
+        case 0x400c: gs->SND_NOISE_REG = value; break;
+        case 0x4010: gs->SND_DELTA_REG = value; break;
+        case 0x4015: gs->SND_MASTERCTRL_REG = value; break;
+    }
+    // The sound engine only writes a couple dozen registers a frame, this never fills up
+    if (gs->apuWriteCount < APU_WriteLogSize) {
+        gs->apuWriteLog[gs->apuWriteCount][0] = reg;
+        gs->apuWriteLog[gs->apuWriteCount][1] = value;
+        gs->apuWriteCount++;
+    }
+    return 0;
+}
+
+// APU synthesis
+// Turns the sound register writes into actual samples, one frame at a time.
+// None of this is part of GameState: the game never reads anything back from the APU,
+// so runs without sound (or with it) play out exactly the same.
+//
+// Instead of working out every sample, every channel only says when its output changes.
+// Each change is added into the buffer as a band-limited step (a windowed sinc, integrated
+// when reading out), which is a lot less work and doesn't alias like naive square waves.
+//
+// For more info, visit https://www.nesdev.org/wiki/APU
+#define APU_CPUClock 1789773.0
+#define APU_SampleRate 48000
+#define APU_KernelTaps 16
+#define APU_KernelPhases 32
+// Enough for a whole PAL frame plus the kernel spilling over
+#define APU_BufferSize (1024 + APU_KernelTaps)
+
+const byte apuLengthTable[32] = {
+    10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14,
+    12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+};
+
+const byte apuDutyTable[4] = { 0b01000000, 0b01100000, 0b01111000, 0b10011111 };
+
+const word apuNoisePeriodTable[16] = {
+    4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068
+};
+
+struct APUEnvelope {
+    byte start;
+    byte loop;
+    byte constantVolume;
+    byte volume;
+    byte divider;
+    byte decay;
+};
+typedef struct APUEnvelope APUEnvelope;
+
+struct APUPulse {
+    APUEnvelope envelope;
+    byte duty;
+    byte sequence;
+    byte length;
+    word period;
+    int timer;
+    byte sweepEnabled;
+    byte sweepPeriod;
+    byte sweepNegate;
+    byte sweepShift;
+    byte sweepReload;
+    byte sweepDivider;
+    // Square 1 negates with ones' complement, square 2 with twos'
+    byte onesComplement;
+    int output;
+};
+typedef struct APUPulse APUPulse;
+
+struct APUTriangle {
+    byte control;
+    byte linearReload;
+    byte linearCounter;
+    byte linearReloadFlag;
+    byte sequence;
+    byte length;
+    word period;
+    int timer;
+    int output;
+};
+typedef struct APUTriangle APUTriangle;
+
+struct APUNoise {
+    APUEnvelope envelope;
+    byte mode;
+    byte length;
+    word period;
+    word shiftRegister;
+    int timer;
+    int output;
+};
+typedef struct APUNoise APUNoise;
+
+struct AudioSynth {
+    APUPulse pulse[2];
+    APUTriangle triangle;
+    APUNoise noise;
+    byte enabled;
+
+    double cyclesPerFrame;
+    double samplesPerCycle;
+    // Where in the current sample the frame starts
+    double fraction;
+    float buffer[APU_BufferSize];
+    float integrator;
+    float highPassIn;
+    float highPassOut;
+};
+typedef struct AudioSynth AudioSynth;
+
+// Windowed sinc impulses, one per fractional sample position, each summing up to 1
+float apuKernel[APU_KernelPhases][APU_KernelTaps];
+byte apuKernelReady = 0;
+
+int initAPUKernel() {
+    const double pi = 3.14159265358979323846;
+    // A bit under Nyquist so the transition band doesn't fold back
+    const double cutoff = 0.45;
+    for (int phase = 0; phase < APU_KernelPhases; phase++) {
+        double sum = 0;
+        for (int tap = 0; tap < APU_KernelTaps; tap++) {
+            double x = tap - APU_KernelTaps / 2 + 1 - (double)phase / APU_KernelPhases;
+            double sinc = x == 0 ? 2 * cutoff : sin(2 * pi * cutoff * x) / (pi * x);
+            // Blackman window
+            double w = (x + APU_KernelTaps / 2.0) / APU_KernelTaps;
+            double window = 0.42 - 0.5 * cos(2 * pi * w) + 0.08 * cos(4 * pi * w);
+            apuKernel[phase][tap] = (float)(sinc * window);
+            sum += sinc * window;
+        }
+        for (int tap = 0; tap < APU_KernelTaps; tap++) {
+            apuKernel[phase][tap] = (float)(apuKernel[phase][tap] / sum);
+        }
+    }
+    apuKernelReady = 1;
+    return 0;
+}
+
+int initAudioSynth(AudioSynth * _synth, double frameRate) {
+    memset(_synth, 0, sizeof(AudioSynth));
+    if (!apuKernelReady) {
+        initAPUKernel();
+    }
+    _synth->cyclesPerFrame = APU_CPUClock / frameRate;
+    _synth->samplesPerCycle = APU_SampleRate / APU_CPUClock;
+    _synth->pulse[0].onesComplement = 1;
+    _synth->noise.shiftRegister = 1;
+    return 0;
+}
+
+// Adds a change in output of delta at the given CPU cycle of this frame
+void addStep(AudioSynth * _synth, double cycle, float delta) {
+    double position = _synth->fraction + cycle * _synth->samplesPerCycle;
+    int sample = (int)position;
+    int phase = (int)((position - sample) * APU_KernelPhases);
+    float * out = _synth->buffer + sample;
+    const float * kernel = apuKernel[phase];
+    for (int tap = 0; tap < APU_KernelTaps; tap++) {
+        out[tap] += kernel[tap] * delta;
+    }
+}
+
+// Linear approximation of the NES mixer, so every channel can be stepped on its own
+#define APU_PulseLevel 0.00752f
+#define APU_TriangleLevel 0.00851f
+#define APU_NoiseLevel 0.00494f
+
+int envelopeVolume(const APUEnvelope * _envelope) {
+    return _envelope->constantVolume ? _envelope->volume : _envelope->decay;
+}
+
+void clockEnvelope(APUEnvelope * _envelope) {
+    if (_envelope->start) {
+        _envelope->start = 0;
+        _envelope->decay = 15;
+        _envelope->divider = _envelope->volume;
+    } else if (_envelope->divider) {
+        _envelope->divider--;
+    } else {
+        _envelope->divider = _envelope->volume;
+        if (_envelope->decay) {
+            _envelope->decay--;
+        } else if (_envelope->loop) {
+            _envelope->decay = 15;
+        }
+    }
+}
+
+int sweepTarget(const APUPulse * _pulse) {
+    int change = _pulse->period >> _pulse->sweepShift;
+    if (_pulse->sweepNegate) {
+        return _pulse->period - change - _pulse->onesComplement;
+    }
+    return _pulse->period + change;
+}
+
+int pulseMuted(const APUPulse * _pulse) {
+    return _pulse->period < 8 || sweepTarget(_pulse) > 0x7ff;
+}
+
+// Feeds one logged register write into the channels
+void applyAPUWrite(AudioSynth * _synth, byte reg, byte value) {
+    if (reg < 0x08) {
+        APUPulse * pulse = &_synth->pulse[reg >> 2];
+        switch (reg & 3) {
+            case 0:
+                pulse->duty = value >> 6;
+                pulse->envelope.loop = (value >> 5) & 1;
+                pulse->envelope.constantVolume = (value >> 4) & 1;
+                pulse->envelope.volume = value & 0x0f;
+                break;
+            case 1:
+                pulse->sweepEnabled = value >> 7;
+                pulse->sweepPeriod = (value >> 4) & 7;
+                pulse->sweepNegate = (value >> 3) & 1;
+                pulse->sweepShift = value & 7;
+                pulse->sweepReload = 1;
+                break;
+            case 2:
+                pulse->period = (pulse->period & 0x700) | value;
+                break;
+            case 3:
+                pulse->period = (pulse->period & 0xff) | ((value & 7) << 8);
+                if (_synth->enabled & (1 << (reg >> 2))) {
+                    pulse->length = apuLengthTable[value >> 3];
+                }
+                pulse->sequence = 0;
+                pulse->envelope.start = 1;
+                break;
+        }
+        return;
+    }
+    switch (reg) {
+        case 0x08:
+            _synth->triangle.control = value >> 7;
+            _synth->triangle.linearReload = value & 0x7f;
+            break;
+        case 0x0a:
+            _synth->triangle.period = (_synth->triangle.period & 0x700) | value;
+            break;
+        case 0x0b:
+            _synth->triangle.period = (_synth->triangle.period & 0xff) | ((value & 7) << 8);
+            if (_synth->enabled & 0b0100) {
+                _synth->triangle.length = apuLengthTable[value >> 3];
+            }
+            _synth->triangle.linearReloadFlag = 1;
+            break;
+        case 0x0c:
+            _synth->noise.envelope.loop = (value >> 5) & 1;
+            _synth->noise.envelope.constantVolume = (value >> 4) & 1;
+            _synth->noise.envelope.volume = value & 0x0f;
+            break;
+        case 0x0e:
+            _synth->noise.mode = value >> 7;
+            _synth->noise.period = apuNoisePeriodTable[value & 0x0f];
+            break;
+        case 0x0f:
+            if (_synth->enabled & 0b1000) {
+                _synth->noise.length = apuLengthTable[value >> 3];
+            }
+            _synth->noise.envelope.start = 1;
+            break;
+        case 0x15:
+            // TODO: DMC, the game doesn't use it for anything
+            _synth->enabled = value & 0x0f;
+            if (!(value & 0b0001)) _synth->pulse[0].length = 0;
+            if (!(value & 0b0010)) _synth->pulse[1].length = 0;
+            if (!(value & 0b0100)) _synth->triangle.length = 0;
+            if (!(value & 0b1000)) _synth->noise.length = 0;
+            break;
+    }
+}
+
+// Runs a pulse channel from cycle start to end, adding a step wherever its output changes
+void synthesizePulse(AudioSynth * _synth, APUPulse * _pulse, double start, double end) {
+    int silent = !_pulse->length || pulseMuted(_pulse);
+    int volume = silent ? 0 : envelopeVolume(&_pulse->envelope);
+    int step = (_pulse->period + 1) * 2;
+    double time = start + _pulse->timer;
+    int output = ((apuDutyTable[_pulse->duty] << _pulse->sequence) & 0x80) ? volume : 0;
+    if (output != _pulse->output) {
+        addStep(_synth, start, (output - _pulse->output) * APU_PulseLevel);
+        _pulse->output = output;
+    }
+    if (!volume) {
+        // Nothing to hear, just keep the phase moving
+        int steps = (int)((end - time) / step) + 1;
+        if (time < end) {
+            _pulse->sequence = (_pulse->sequence + steps) & 7;
+            time += (double)steps * step;
+        }
+        _pulse->timer = (int)(time - end);
+        return;
+    }
+    for (; time < end; time += step) {
+        _pulse->sequence = (_pulse->sequence + 1) & 7;
+        output = ((apuDutyTable[_pulse->duty] << _pulse->sequence) & 0x80) ? volume : 0;
+        if (output != _pulse->output) {
+            addStep(_synth, time, (output - _pulse->output) * APU_PulseLevel);
+            _pulse->output = output;
+        }
+    }
+    _pulse->timer = (int)(time - end);
+}
+
+void synthesizeTriangle(AudioSynth * _synth, APUTriangle * _triangle, double start, double end) {
+    int step = _triangle->period + 1;
+    double time = start + _triangle->timer;
+    // Stopped triangles (and ultrasonic ones) just hold where they are
+    if (!_triangle->length || !_triangle->linearCounter || _triangle->period < 2) {
+        _triangle->timer = 0;
+        return;
+    }
+    for (; time < end; time += step) {
+        int output;
+        _triangle->sequence = (_triangle->sequence + 1) & 31;
+        output = _triangle->sequence < 16 ? 15 - _triangle->sequence : _triangle->sequence - 16;
+        addStep(_synth, time, (output - _triangle->output) * APU_TriangleLevel);
+        _triangle->output = output;
+    }
+    _triangle->timer = (int)(time - end);
+}
+
+void synthesizeNoise(AudioSynth * _synth, APUNoise * _noise, double start, double end) {
+    int volume = _noise->length ? envelopeVolume(&_noise->envelope) : 0;
+    int step = _noise->period ? _noise->period : apuNoisePeriodTable[0];
+    double time = start + _noise->timer;
+    for (; time < end; time += step) {
+        int output;
+        word feedback = (_noise->shiftRegister ^ (_noise->shiftRegister >> (_noise->mode ? 6 : 1))) & 1;
+        _noise->shiftRegister = (_noise->shiftRegister >> 1) | (feedback << 14);
+        output = (_noise->shiftRegister & 1) ? 0 : volume;
+        if (output != _noise->output) {
+            addStep(_synth, time, (output - _noise->output) * APU_NoiseLevel);
+            _noise->output = output;
+        }
+    }
+    if (!volume && _noise->output) {
+        addStep(_synth, end, -_noise->output * APU_NoiseLevel);
+        _noise->output = 0;
+    }
+    _noise->timer = (int)(time - end);
+}
+
+// Envelopes and the triangles linear counter
+void clockQuarterFrame(AudioSynth * _synth) {
+    APUTriangle * triangle = &_synth->triangle;
+    clockEnvelope(&_synth->pulse[0].envelope);
+    clockEnvelope(&_synth->pulse[1].envelope);
+    clockEnvelope(&_synth->noise.envelope);
+    if (triangle->linearReloadFlag) {
+        triangle->linearCounter = triangle->linearReload;
+    } else if (triangle->linearCounter) {
+        triangle->linearCounter--;
+    }
+    if (!triangle->control) {
+        triangle->linearReloadFlag = 0;
+    }
+}
+
+// Length counters and sweeps
+void clockHalfFrame(AudioSynth * _synth) {
+    for (int channel = 0; channel < 2; channel++) {
+        APUPulse * pulse = &_synth->pulse[channel];
+        if (!pulse->envelope.loop && pulse->length) {
+            pulse->length--;
+        }
+        if (!pulse->sweepDivider && pulse->sweepEnabled && pulse->sweepShift && !pulseMuted(pulse)) {
+            pulse->period = sweepTarget(pulse);
+        }
+        if (!pulse->sweepDivider || pulse->sweepReload) {
+            pulse->sweepDivider = pulse->sweepPeriod;
+            pulse->sweepReload = 0;
+        } else {
+            pulse->sweepDivider--;
+        }
+    }
+    if (!_synth->triangle.control && _synth->triangle.length) {
+        _synth->triangle.length--;
+    }
+    if (!_synth->noise.envelope.loop && _synth->noise.length) {
+        _synth->noise.length--;
+    }
+}
+
+// Synthesizes one frame of audio for the given state into _samples.
+// Returns the amount of samples written, around 800 at 48kHz.
+int synthesizeFrame(AudioSynth * _synth, const GameState * _state, int16_t * _samples) {
+    double quarter = _synth->cyclesPerFrame / 4;
+    double end = _synth->fraction + _synth->cyclesPerFrame * _synth->samplesPerCycle;
+    int count = (int)end;
+    for (int write = 0; write < _state->apuWriteCount; write++) {
+        applyAPUWrite(_synth, _state->apuWriteLog[write][0], _state->apuWriteLog[write][1]);
+    }
+    // The frame sequencer, 4 step mode
+    for (int step = 0; step < 4; step++) {
+        double start = quarter * step;
+        synthesizePulse(_synth, &_synth->pulse[0], start, start + quarter);
+        synthesizePulse(_synth, &_synth->pulse[1], start, start + quarter);
+        synthesizeTriangle(_synth, &_synth->triangle, start, start + quarter);
+        synthesizeNoise(_synth, &_synth->noise, start, start + quarter);
+        clockQuarterFrame(_synth);
+        if (step & 1) {
+            clockHalfFrame(_synth);
+        }
+    }
+    for (int sample = 0; sample < count; sample++) {
+        float value;
+        _synth->integrator += _synth->buffer[sample];
+        // Take out the DC offset
+        _synth->highPassOut = _synth->integrator - _synth->highPassIn + 0.9995f * _synth->highPassOut;
+        _synth->highPassIn = _synth->integrator;
+        value = _synth->highPassOut * 1.5f * 32767.0f;
+        _samples[sample] = (int16_t)(value > 32767.0f ? 32767 : value < -32768.0f ? -32768 : value);
+    }
+    // Whatever the kernel spilled past the end belongs to the next frame
+    memmove(_synth->buffer, _synth->buffer + count, APU_KernelTaps * sizeof(float));
+    memset(_synth->buffer + APU_KernelTaps, 0, (APU_BufferSize - APU_KernelTaps) * sizeof(float));
+    _synth->fraction = end - count;
+    return count;
+}
+
+// Audio ring buffer
+// Samples go from the game to whatever plays them through a single-producer/single-consumer ring.
+// Neither side ever waits on the other: if the ring is full the newest samples get dropped,
+// and if it runs dry the player gets silence.
+#define AudioRingSize 8192 // Has to be a power of two
+
+struct AudioRing {
+    int16_t samples[AudioRingSize];
+    // Written by the game only
+    uint32_t head;
+    byte headPadding[CACHE_LINE_SIZE - sizeof(uint32_t)];
+    // Written by the player only
+    uint32_t tail;
+    byte tailPadding[CACHE_LINE_SIZE - sizeof(uint32_t)];
+    uint32_t dropped;
+};
+typedef struct AudioRing AudioRing;
+
+// Returns the amount of samples that actually fit
+int pushAudio(AudioRing * _ring, const int16_t * samples, int count) {
+    uint32_t head = __atomic_load_n(&_ring->head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&_ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t space = AudioRingSize - (head - tail);
+    int first;
+    if ((uint32_t)count > space) {
+        _ring->dropped += count - space;
+        count = (int)space;
+    }
+    first = AudioRingSize - (head & (AudioRingSize - 1));
+    if (first > count) {
+        first = count;
+    }
+    memcpy(_ring->samples + (head & (AudioRingSize - 1)), samples, first * sizeof(int16_t));
+    memcpy(_ring->samples, samples + first, (count - first) * sizeof(int16_t));
+    __atomic_store_n(&_ring->head, head + count, __ATOMIC_RELEASE);
+    return count;
+}
+
+// Always fills all of _samples, with silence if there isn't enough.
+// Returns the amount of real samples.
+int popAudio(AudioRing * _ring, int16_t * _samples, int count) {
+    uint32_t tail = __atomic_load_n(&_ring->tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&_ring->head, __ATOMIC_ACQUIRE);
+    int available = (int)(head - tail);
+    int first;
+    if (available > count) {
+        available = count;
+    }
+    first = AudioRingSize - (tail & (AudioRingSize - 1));
+    if (first > available) {
+        first = available;
+    }
+    memcpy(_samples, _ring->samples + (tail & (AudioRingSize - 1)), first * sizeof(int16_t));
+    memcpy(_samples + first, _ring->samples, (available - first) * sizeof(int16_t));
+    memset(_samples + available, 0, (count - available) * sizeof(int16_t));
+    __atomic_store_n(&_ring->tail, tail + available, __ATOMIC_RELEASE);
+    return available;
+}
+
+// Game Functions
+// Hacks/Temps
+byte nonMaskableInterrupt = 0;
+// Cleared by Ctrl+C, see stopOnInterrupt()
+volatile sig_atomic_t running = 1;
+
+int InitalizeMemory() {
+    // TODO
+    return 0;
+}
+
+// Hands out the next free sprite from the pool, or NULL if it's completely full
+Sprite * allocateSprite() {
+    Sprite * sprite;
+    if (gs->spriteCount >= SpritePoolSize) {
+        return NULL;
+    }
+    sprite = &gs->spriteArray[gs->spriteCount++];
+    memset(sprite, 0, sizeof(Sprite));
+    return sprite;
+}
+
+// this routine moves all sprites off the screen
+int MoveAllSpritesOffscreen() {
+    // this routine moves all but sprite 0 off the screen.
+    // With the pool that's just handing all the others back.
+    if (gs->spriteCount > 1) {
+        gs->spriteCount = 1;
+    }
+    return 0;
+}
+
+int WritePPUReg1(byte input) {
+    gs->ppu.PPU_CTRL_REG1 = input;
+    gs->Mirror_PPU_CTRL_REG1 = input;
+    return 0;
+}
+
+int InitScroll(byte input) {
+    gs->ppu.PPU_SCROLL_REG_X = input;
+    gs->ppu.PPU_SCROLL_REG_Y = input;
+}
+
+// input is the high byte of the name table address, 0x20 or 0x24
+int WriteNTAddr(byte input) {
+    byte blank = 0x24;
+    byte zero = 0;
+    // clear name table with blank tile #24
+    writeVRAMRun(input << 8, &blank, 960, 1, 1);
+    gs->VRAM_Buffer1_Offset = 0;
+    // now to clear the attribute table (with zero this time)
+    writeVRAMRun((input << 8) + 960, &zero, 64, 1, 1);
+    gs->HorizontalScroll = 0;
+    gs->VerticalScroll = 0;
+    InitScroll(0);
+    return 0;
+}
+
+int InitializeNameTables() {
+    byte temp = gs->ppu.PPU_STATUS;
+    temp = gs->Mirror_PPU_CTRL_REG1;
+    temp |= 0b00010000;
+    temp &= 0b11110000;
+    WritePPUReg1(temp);
+    WriteNTAddr(0x24);
+    WriteNTAddr(0x20);
+    return 0;
+}
+
+// Objects
+// The NES handled objects one at a time through ObjectOffset. With the object tables
+// these run over a whole range of slots in one go, like FirstEnemySlot and EnemySlots.
+
+// Moves objects along by their horizontal speed.
+// Speed is 4.4 fixed point, the fraction goes into X_MoveForce and whole pixels carry
+// over into the page, so page, position and move force are really one 24 bit number.
+int MoveObjectsHorizontally(int first, int count) {
+    for (int slot = first; slot < first + count; slot++) {
+        uint32_t position = ((uint32_t)gs->SprObject_PageLoc[slot] << 16)
+            | ((uint32_t)gs->SprObject_X_Position[slot] << 8)
+            | gs->SprObject_X_MoveForce[slot];
+        position += (uint32_t)((int8_t)gs->SprObject_X_Speed[slot] * 16);
+        gs->SprObject_PageLoc[slot] = (byte)(position >> 16);
+        gs->SprObject_X_Position[slot] = (byte)(position >> 8);
+        gs->SprObject_X_MoveForce[slot] = (byte)position;
+    }
+    return 0;
+}
+
+// Where objects are on screen, GetObjRelativePosition in the original
+int UpdateRelativePositions(int first, int count) {
+    byte screenLeft = gs->ScreenLeft_X_Pos;
+    for (int slot = first; slot < first + count; slot++) {
+        gs->SprObject_Rel_XPos[slot] = gs->SprObject_X_Position[slot] - screenLeft;
+        gs->SprObject_Rel_YPos[slot] = gs->SprObject_Y_Position[slot];
+    }
+    return 0;
+}
+
+const byte XOffscreenBitsData[16] = {
+    0x7f, 0x3f, 0x1f, 0x0f, 0x07, 0x03, 0x01, 0x00,
+    0x80, 0xc0, 0xe0, 0xf0, 0xf8, 0xfc, 0xfe, 0xff
+};
+const byte DefaultXOnscreenOfs[3] = { 0x07, 0x0f, 0x07 };
+const byte YOffscreenBitsData[9] = { 0x00, 0x08, 0x0c, 0x0e, 0x0f, 0x07, 0x03, 0x01, 0x00 };
+const byte DefaultYOnscreenOfs[3] = { 0x04, 0x00, 0x04 };
+const byte HighPosUnitData[2] = { 0xff, 0x00 };
+
+// Picks the bits for an object that's partly past an edge, by how far in it is in 8 pixel steps.
+// edge is 0 for the left/bottom one, 1 for the right/top one.
+int dividePixelDifference(byte difference, byte limit, byte adder, int edge, int offset) {
+    if (difference >= limit) {
+        return offset;
+    }
+    offset = (difference >> 3) & 0b111;
+    if (edge < 1) {
+        offset += adder;
+    }
+    return offset;
+}
+
+// Which 8 pixel columns of an object are off the screen, one bit each
+byte xOffscreenBits(int slot) {
+    for (int edge = 1; edge >= 0; edge--) {
+        byte edgeX = edge ? gs->ScreenRight_X_Pos : gs->ScreenLeft_X_Pos;
+        byte edgePage = edge ? gs->ScreenRight_PageLoc : gs->ScreenLeft_PageLoc;
+        byte difference = edgeX - gs->SprObject_X_Position[slot];
+        byte borrow = edgeX < gs->SprObject_X_Position[slot];
+        int8_t pages = (int8_t)(edgePage - gs->SprObject_PageLoc[slot] - borrow);
+        int offset = DefaultXOnscreenOfs[edge];
+        byte bits;
+        if (pages >= 0) {
+            offset = DefaultXOnscreenOfs[edge + 1];
+            if (pages < 1) {
+                offset = dividePixelDifference(difference, 0x38, 0x08, edge, offset);
+            }
+        }
+        bits = XOffscreenBitsData[offset];
+        if (bits) {
+            return bits;
+        }
+    }
+    return 0;
+}
+
+// Same for the rows, going by the vertical high byte
+byte yOffscreenBits(int slot) {
+    for (int edge = 1; edge >= 0; edge--) {
+        byte difference = HighPosUnitData[edge] - gs->SprObject_Y_Position[slot];
+        byte borrow = HighPosUnitData[edge] < gs->SprObject_Y_Position[slot];
+        int8_t units = (int8_t)(1 - gs->SprObject_Y_HighPos[slot] - borrow);
+        int offset = DefaultYOnscreenOfs[edge];
+        byte bits;
+        if (units >= 0) {
+            offset = DefaultYOnscreenOfs[edge + 1];
+            if (units < 1) {
+                offset = dividePixelDifference(difference, 0x20, 0x04, edge, offset);
+            }
+        }
+        bits = YOffscreenBitsData[offset];
+        if (bits) {
+            return bits;
+        }
+    }
+    return 0;
+}
+
+// GetOffScreenBitsSet in the original: rows in the high nybble, columns in the low one
+int UpdateOffscreenBits(int first, int count) {
+    for (int slot = first; slot < first + count; slot++) {
+        gs->SprObject_OffscrBits[slot] = (byte)((yOffscreenBits(slot) << 4) | (xOffscreenBits(slot) >> 4));
+    }
+    return 0;
+}
+
+// Collision
+// Bounding box checks between objects. The original check has some odd rules for boxes that
+// wrap around the edge of the screen (right of the left edge or bottom above the top), and
+// glitches like wall jumping depend on them, so every check here gives exactly the same answer.
+//
+// The boxes live in GameState as one array per edge, so one box can be checked against
+// 16 others at once. For lots of objects there's a sort and sweep that only
+// looks at boxes that are actually next to each other horizontally.
+struct CollisionPair {
+    word first;
+    word second;
+};
+typedef struct CollisionPair CollisionPair;
+
+// Above this many objects findCollisionPairs() sorts and sweeps instead of checking every pair
+#define CollisionSweepThreshold 32
+
+// One axis of SprObjectCollisionCore. a is the first box, b the second.
+// 1/2 are the left/right or top/bottom edges.
+int boxesOverlapOnAxis(byte a1, byte a2, byte b1, byte b2) {
+    if (a1 >= b1) {
+        if (a1 == b1 || a1 <= b2) {
+            return 1;
+        }
+        // The first box wrapping around still reaches the second one
+        return a1 > a2 && a2 >= b1;
+    }
+    if (a1 < b2) {
+        // The second box wrapping around counts as a hit, whatever the first one does
+        return b2 < b1 || a2 >= b1;
+    }
+    return a1 == b2 || a2 < a1 || a2 >= b1;
+}
+
+// Whether the bounding boxes of two object slots overlap, like SprObjectCollisionCore
+int CheckObjectCollision(int first, int second) {
+    return boxesOverlapOnAxis(gs->BoundingBox_UL_XPos[first], gs->BoundingBox_DR_XPos[first],
+                              gs->BoundingBox_UL_XPos[second], gs->BoundingBox_DR_XPos[second])
+        && boxesOverlapOnAxis(gs->BoundingBox_UL_YPos[first], gs->BoundingBox_DR_YPos[first],
+                              gs->BoundingBox_UL_YPos[second], gs->BoundingBox_DR_YPos[second]);
+}
+
+#if defined(__SSE2__)
+// >= for unsigned bytes, SSE2 only knows signed compares
+#define cmpgeU8(x, y) _mm_cmpeq_epi8(_mm_max_epu8((x), (y)), (x))
+
+// boxesOverlapOnAxis() for 16 second boxes at once, 0xff in every lane that overlaps
+__m128i boxesOverlapOnAxis16(byte a1, byte a2, __m128i b1, __m128i b2) {
+    __m128i first1 = _mm_set1_epi8((char)a1);
+    __m128i first2 = _mm_set1_epi8((char)a2);
+    __m128i firstWraps = _mm_set1_epi8(a1 > a2 ? -1 : 0);
+    __m128i reachesB1 = cmpgeU8(first2, b1);
+    __m128i firstGreater = cmpgeU8(first1, b1);
+    __m128i belowB2 = _mm_andnot_si128(cmpgeU8(first1, b2), _mm_set1_epi8(-1));
+    __m128i greaterHit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(first1, b1), cmpgeU8(b2, first1)),
+                                      _mm_and_si128(firstWraps, reachesB1));
+    __m128i belowHit = _mm_or_si128(_mm_andnot_si128(cmpgeU8(b2, b1), _mm_set1_epi8(-1)), reachesB1);
+    __m128i otherHit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(first1, b2), firstWraps), reachesB1);
+    __m128i lessHit = _mm_or_si128(_mm_and_si128(belowB2, belowHit), _mm_andnot_si128(belowB2, otherHit));
+    return _mm_or_si128(_mm_and_si128(firstGreater, greaterHit), _mm_andnot_si128(firstGreater, lessHit));
+}
+#endif
+
+// Checks one object against count others starting at slot first.
+// _hits gets 1 for every one it collides with, 0 otherwise. Returns the amount of hits.
+int CheckObjectCollisions(int slot, int first, int count, byte * _hits) {
+    int index = 0, hits = 0;
+    byte left = gs->BoundingBox_UL_XPos[slot], top = gs->BoundingBox_UL_YPos[slot];
+    byte right = gs->BoundingBox_DR_XPos[slot], bottom = gs->BoundingBox_DR_YPos[slot];
+#if defined(__SSE2__)
+    for (; index + 16 <= count; index += 16) {
+        __m128i x = boxesOverlapOnAxis16(left, right,
+            _mm_loadu_si128((const __m128i *)&gs->BoundingBox_UL_XPos[first + index]),
+            _mm_loadu_si128((const __m128i *)&gs->BoundingBox_DR_XPos[first + index]));
+        __m128i y = boxesOverlapOnAxis16(top, bottom,
+            _mm_loadu_si128((const __m128i *)&gs->BoundingBox_UL_YPos[first + index]),
+            _mm_loadu_si128((const __m128i *)&gs->BoundingBox_DR_YPos[first + index]));
+        __m128i hit = _mm_and_si128(_mm_and_si128(x, y), _mm_set1_epi8(1));
+        _mm_storeu_si128((__m128i *)(_hits + index), hit);
+        hits += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(hit, _mm_set1_epi8(1))));
+    }
+#endif
+    for (; index < count; index++) {
+        _hits[index] = (byte)CheckObjectCollision(slot, first + index);
+        hits += _hits[index];
+    }
+    return hits;
+}
+
+// Finds every pair of colliding objects among count slots starting at first.
+// Pairs always have first < second, and get checked in that order.
+// Returns the amount of pairs found, only up to maxPairs get stored.
+int findCollisionPairs(int first, int count, CollisionPair * _pairs, int maxPairs) {
+    byte hits[SprObjectSlots];
+    word order[SprObjectSlots];
+    word wrapped[SprObjectSlots];
+    int starts[257];
+    int found = 0, wrappedCount = 0, sortedCount = 0;
+    #define addCollisionPair(a, b) \
+        do { \
+            if (found < maxPairs) { \
+                _pairs[found].first = (word)(a); \
+                _pairs[found].second = (word)(b); \
+            } \
+            found++; \
+        } while (0)
+    if (count <= CollisionSweepThreshold) {
+        for (int index = 0; index + 1 < count; index++) {
+            int slot = first + index;
+            if (!CheckObjectCollisions(slot, slot + 1, count - index - 1, hits)) {
+                continue;
+            }
+            for (int other = 0; other < count - index - 1; other++) {
+                if (hits[other]) {
+                    addCollisionPair(slot, slot + 1 + other);
+                }
+            }
+        }
+        return found;
+    }
+    // Boxes that don't wrap horizontally only collide if their x ranges overlap the normal way,
+    // so sorting those by their left edge means only neighbours need checking.
+    // The wrapping ones are rare enough to just get checked against everything.
+    memset(starts, 0, sizeof(starts));
+    for (int slot = first; slot < first + count; slot++) {
+        if (gs->BoundingBox_DR_XPos[slot] < gs->BoundingBox_UL_XPos[slot]) {
+            wrapped[wrappedCount++] = (word)slot;
+        } else {
+            starts[gs->BoundingBox_UL_XPos[slot] + 1]++;
+        }
+    }
+    for (int left = 0; left < 256; left++) {
+        starts[left + 1] += starts[left];
+    }
+    for (int slot = first; slot < first + count; slot++) {
+        if (gs->BoundingBox_DR_XPos[slot] >= gs->BoundingBox_UL_XPos[slot]) {
+            order[starts[gs->BoundingBox_UL_XPos[slot]]++] = (word)slot;
+            sortedCount++;
+        }
+    }
+    for (int index = 0; index < sortedCount; index++) {
+        int slot = order[index];
+        byte right = gs->BoundingBox_DR_XPos[slot];
+        for (int next = index + 1; next < sortedCount && gs->BoundingBox_UL_XPos[order[next]] <= right; next++) {
+            int a = slot < order[next] ? slot : order[next];
+            int b = slot < order[next] ? order[next] : slot;
+            if (CheckObjectCollision(a, b)) {
+                addCollisionPair(a, b);
+            }
+        }
+    }
+    for (int index = 0; index < wrappedCount; index++) {
+        int slot = wrapped[index];
+        for (int other = first; other < first + count; other++) {
+            // Pairs of two wrapping boxes only get checked once
+            if (other == slot || (other < slot && gs->BoundingBox_DR_XPos[other] < gs->BoundingBox_UL_XPos[other])) {
+                continue;
+            }
+            if (other < slot ? CheckObjectCollision(other, slot) : CheckObjectCollision(slot, other)) {
+                addCollisionPair(other < slot ? other : slot, other < slot ? slot : other);
+            }
+        }
+    }
+    #undef addCollisionPair
+    return found;
+}
+
+// Area collision map
+// The block buffers only ever hold the two pages around the player, as metatile numbers
+// that need a table lookup before you know if you can stand on them.
+// Next to them the whole area is kept as bitmaps: one 16 bit word per column per layer,
+// bit n set if the metatile in row n is solid/climbable/a coin. Any lookup is then a shift
+// and a mask, and finding the ground under something is counting trailing zeros.
+// The NES has no hazard metatiles (lava kills by height), so the third layer is coins.
+#define CollisionLayer_Solid 0
+#define CollisionLayer_Climb 1
+#define CollisionLayer_Coin 2
+
+// Metatiles at or above these are solid/climbable, per attribute group (top 2 bits)
+const byte SolidMTileUpperExt[4] = { 0x10, 0x61, 0x88, 0xc4 };
+const byte ClimbMTileUpperExt[4] = { 0x24, 0x6d, 0x8a, 0xc6 };
+
+// Which layers a metatile belongs to, one bit per layer
+int classifyMetatile(byte metatile) {
+    int group = metatile >> 6;
+    int layers = 0;
+    if (metatile >= SolidMTileUpperExt[group]) {
+        layers |= 1 << CollisionLayer_Solid;
+    }
+    if (metatile >= ClimbMTileUpperExt[group]) {
+        layers |= 1 << CollisionLayer_Climb;
+    }
+    if (metatile == 0xc2 || metatile == 0xc3) {
+        layers |= 1 << CollisionLayer_Coin;
+    }
+    return layers;
+}
+
+// Forgets the whole area, for when a new one gets loaded
+int clearCollisionMap() {
+    memset(gs->collisionMap, 0, sizeof(gs->collisionMap));
+    return 0;
+}
+
+// Whether the block buffers currently hold the given area column.
+// They have the 32 columns right before where the area parser is, BlockBufferColumnPos
+// is that same spot within them. Anything else would land on a column still in use.
+int blockBufferHasColumn(int column) {
+    int next = gs->CurrentPageLoc * 16 + gs->CurrentColumnPos;
+    return column < next && column >= next - 32;
+}
+
+// Updates a single metatile, whenever a block gets broken, bumped or collected
+int setAreaMetatile(int column, int row, byte metatile) {
+    int layers = classifyMetatile(metatile);
+    word bit = (word)(1 << row);
+    // Keep the block buffer matching, if the column is in it
+    if (blockBufferHasColumn(column)) {
+        (((column >> 4) & 1) ? gs->Block_Buffer_2 : gs->Block_Buffer_1)[row * 16 + (column & 15)] = metatile;
+    }
+    column &= AreaColumns - 1;
+    for (int layer = 0; layer < CollisionLayers; layer++) {
+        if (layers & (1 << layer)) {
+            gs->collisionMap[layer][column] |= bit;
+        } else {
+            gs->collisionMap[layer][column] &= (word)~bit;
+        }
+    }
+    return 0;
+}
+
+// BlockObjMT_Updater in the original, part of GameEngine: once the VRAM buffer is free,
+// puts the metatile a hit block turned into (empty block, nothing, ...) into the area.
+// Block_Orig_YPos is the row of the block times 16, Block_BBuf_Low has the column
+// added to the low byte of the block buffer it's in (0x00 or 0xd0), so the column is its low nybble.
+int BlockObjMT_Updater() {
+    for (int block = BlockObjects - 1; block >= 0; block--) {
+        int column = gs->Block_PageLoc2[block] * 16 + (gs->Block_BBuf_Low[block] & 0x0f);
+        if (gs->VRAM_Buffer1_Offset || !gs->Block_RepFlag[block]) {
+            continue;
+        }
+        setAreaMetatile(column, gs->Block_Orig_YPos[block] >> 4, gs->Block_Metatile[block]);
+        // TODO: ReplaceBlockMetatile, once the metatile graphics are transpiled
+        gs->Block_RepFlag[block] = 0;
+    }
+    return 0;
+}
+
+// Puts the column the area parser just built in MetatileBuffer into
+// the block buffer and the collision map. column counts from the start of the area.
+int storeMetatileColumn(int column) {
+    byte * blockBuffer = ((column >> 4) & 1) ? gs->Block_Buffer_2 : gs->Block_Buffer_1;
+    word bits[CollisionLayers] = { 0 };
+    column &= AreaColumns - 1;
+    for (int row = 0; row < MetatileRows; row++) {
+        int layers = classifyMetatile(gs->MetatileBuffer[row]);
+        blockBuffer[row * 16 + (column & 15)] = gs->MetatileBuffer[row];
+        for (int layer = 0; layer < CollisionLayers; layer++) {
+            bits[layer] |= (word)(((layers >> layer) & 1) << row);
+        }
+    }
+    for (int layer = 0; layer < CollisionLayers; layer++) {
+        gs->collisionMap[layer][column] = bits[layer];
+    }
+    return 0;
+}
+
+// Whether the metatile at column/row is in the given layer
+int collisionAt(int layer, int column, int row) {
+    return (gs->collisionMap[layer][column & (AreaColumns - 1)] >> row) & 1;
+}
+
+// Landing check: the first row at or below row that's solid in this column, -1 if there is none
+int findGround(int column, int row) {
+    word below = (word)(gs->collisionMap[CollisionLayer_Solid][column & (AreaColumns - 1)] >> row);
+    return below ? row + __builtin_ctz(below) : -1;
+}
+
+// Checks a whole stretch of one row at once, like under the feet of something wide.
+// Returns the first column from first to last (inclusive) that's in the layer, -1 if none.
+int scanCollisionRow(int layer, int row, int first, int last) {
+    for (int column = first; column <= last; column++) {
+        if ((gs->collisionMap[layer][column & (AreaColumns - 1)] >> row) & 1) {
+            return column;
+        }
+    }
+    return -1;
+}
+
+// Area cache
+// Every area of the game, fully decoded ahead of time: the metatile columns, their collision
+// bitmaps and attributes, and the enemy spawns. It gets built from the ROM once and saved next to the game,
+// later starts just map it in. Entering an area is then looking it up and copying its
+// collision map, nothing gets parsed while playing.
+// The enemy spawns come straight from EnemyData, so those are always there. The columns,
+// collision and attributes need the area parser and are left out while there isn't one.
+//
+// File layout: AreaCacheHeader, CachedArea[areaCount], then the data the entries point at.
+// Bump the version whenever anything in here changes what comes out.
+#define AreaCacheMagic "SMBAREA"
+#define AreaCacheVersion 5
+// Bump this with every change to what AreaParserCore() builds, caches from an older
+// parser get rebuilt then. 0 means there is no parser yet, every column would come out empty.
+#define AreaParserRevision 0
+#define AreaCacheColumnSize 16 // 13 metatiles, padded
+
+// Pointer tables in the ROM, found by looking for EnemyAddrHOffsets and AreaDataHOffsets.
+// Each is followed by the low and high bytes of every areas data address.
+#define AreaTableEntries 34
+const byte EnemyAddrHOffsets[4] = { 0x1f, 0x06, 0x1c, 0x00 };
+const byte AreaDataHOffsets[4] = { 0x00, 0x03, 0x19, 0x1c };
+
+// Padded to a whole cache line
+struct AreaCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t prgChecksum;
+    uint32_t parserRevision;
+    uint32_t areaCount;
+    byte padding[40];
+};
+typedef struct AreaCacheHeader AreaCacheHeader;
+
+// Offsets are from the start of the file
+struct CachedArea {
+    byte areaPointer;
+    word pages;
+    // [pages * 16][AreaCacheColumnSize] metatiles, 0 along with collision and attributes
+    // if there's no area parser
+    uint32_t columns;
+    // [CollisionLayers][pages * 16], like GameState.collisionMap
+    uint32_t collision;
+    // [pages][8][8], name table attribute bytes of every screen
+    uint32_t attributes;
+    // EnemySpawn[spawnCount], every record of EnemyData but the page skips, in order
+    uint32_t spawns;
+    uint32_t spawnCount;
+    // word[pages + 1], the spawns on page n are spawns[pageIndex[n]] up to spawns[pageIndex[n + 1]]
+    uint32_t pageIndex;
+};
+typedef struct CachedArea CachedArea;
+
+// Only spawns with SecondaryHardMode, it still takes its turn otherwise
+#define EnemySpawn_HardModeOnly 0b00000001
+#define EnemySpawn_AreaChange 0b00000010
+
+// One enemy object record of EnemyData
+struct EnemySpawn {
+    byte page;
+    byte column;
+    byte row;
+    // Enemy ID, or the area pointer for area changes
+    byte id;
+    // World and page to enter for area changes
+    byte extra;
+    byte flags;
+    // Where the record is in EnemyData, so EnemyDataOffset can be kept in sync
+    word offset;
+};
+typedef struct EnemySpawn EnemySpawn;
+
+const byte * areaCache = NULL;
+byte * areaCacheMemory = NULL;
+MappedFile areaCacheFile;
+
+#define areaCacheHeader() ((const AreaCacheHeader *)areaCache)
+#define areaCacheEntry(index) ((const CachedArea *)(areaCache + sizeof(AreaCacheHeader)) + (index))
+
+// TODO: Needs to be transpiled. Builds the next column of the area into MetatileBuffer.
+int AreaParserCore() { return 0; }
+
+int freeAreaCache() {
+    unmapFile(&areaCacheFile);
+    free(areaCacheMemory);
+    areaCacheMemory = NULL;
+    areaCache = NULL;
+    return 0;
+}
+
+// Finds the low byte table that comes right after the given offsets in the ROM, -1 if it's not there
+int findAreaTable(const byte * offsets) {
+    for (int address = 0; address + 4 + AreaTableEntries * 2 <= (int)sizeof(prgRom); address++) {
+        if (!memcmp(prgRom + address, offsets, 4)) {
+            return address + 4;
+        }
+    }
+    return -1;
+}
+
+// Turns a CPU address from one of the tables into the data in prgRom, NULL if it's not in there
+const byte * areaTableData(int table, int entry) {
+    word address = (word)(prgRom[table + entry] | (prgRom[table + AreaTableEntries + entry] << 8));
+    return address >= 0x8000 ? prgRom + (address - 0x8000) : NULL;
+}
+
+// Decodes EnemyData into spawns. _spawns can be NULL to just count them.
+// Returns the amount of spawns, _pages gets the last page anything is on.
+int decodeEnemyData(const byte * data, size_t available, EnemySpawn * _spawns, int * _pages) {
+    size_t offset = 0;
+    int page = 0, count = 0;
+    // EnemyObjectPageSel: set by a page skip or the page bit, only cleared once an object
+    // is done with. Until then the page bit of the next record doesn't count.
+    int pageSelected = 0;
+    while (offset < available && data[offset] != 0xff) {
+        byte first = data[offset];
+        byte second = offset + 1 < available ? data[offset + 1] : 0;
+        int row = first & 0x0f;
+        int size = row == 0x0e ? 3 : 2;
+        if ((second & 0b10000000) && !pageSelected) {
+            page++;
+            pageSelected = 1;
+        }
+        if (row == 0x0f && !pageSelected) {
+            // Skips ahead to the given page
+            page = second & 0b00111111;
+            pageSelected = 1;
+        } else {
+            if (_spawns) {
+                EnemySpawn * spawn = &_spawns[count];
+                spawn->page = (byte)page;
+                spawn->column = first >> 4;
+                spawn->row = (byte)row;
+                spawn->id = row == 0x0e ? second : (second & 0b00111111);
+                spawn->extra = row == 0x0e && offset + 2 < available ? data[offset + 2] : 0;
+                spawn->flags = (row == 0x0e ? EnemySpawn_AreaChange : 0) | ((row != 0x0e && (second & 0b01000000)) ? EnemySpawn_HardModeOnly : 0);
+                spawn->offset = (word)offset;
+            }
+            count++;
+            pageSelected = 0;
+        }
+        if (page > *_pages) {
+            *_pages = page;
+        }
+        offset += size;
+    }
+    return count;
+}
+
+// Builds the page index of a spawn table. Spawns further out than pages end up on the last page.
+int indexEnemySpawns(const EnemySpawn * spawns, uint32_t count, int pages, word * _index) {
+    uint32_t spawn = 0;
+    for (int page = 0; page < pages; page++) {
+        _index[page] = (word)spawn;
+        while (spawn < count && (spawns[spawn].page <= page || page == pages - 1)) {
+            spawn++;
+        }
+    }
+    _index[pages] = (word)count;
+    return 0;
+}
+
+// Last page with an object on it in AreaData
+int areaDataPages(const byte * data, size_t available) {
+    size_t offset = 2; // Header
+    int page = 0, last = 0;
+    // AreaObjectPageSel: set by the page bit or a page skip, but unlike the one for enemies
+    // it only lasts for that one record. IncAreaObjOffset clears it after every object,
+    // including a page skip, so a page bit on the record right after one still counts.
+    int pageSelected = 0;
+    while (offset + 1 < available && data[offset] != 0xfd) {
+        byte second = data[offset + 1];
+        if ((second & 0b10000000) && !pageSelected) {
+            page++;
+            pageSelected = 1;
+        }
+        if ((data[offset] & 0x0f) == 0x0d && !(second & 0b01000000) && !pageSelected) {
+            page = second & 0b00011111;
+        }
+        pageSelected = 0;
+        if (page > last) {
+            last = page;
+        }
+        offset += 2;
+    }
+    return last;
+}
+
+// Attribute bytes for one screen, from the palette bits of its metatiles.
+// Metatile rows start 32 pixels down, below the status bar.
+int areaAttributes(const byte * columns, byte * _attributes) {
+    memset(_attributes, 0, 64);
+    for (int column = 0; column < 16; column++) {
+        for (int row = 0; row < MetatileRows; row++) {
+            byte palette = columns[column * AreaCacheColumnSize + row] >> 6;
+            int attributeRow = 1 + (row >> 1);
+            int shift = ((row & 1) << 2) | ((column & 1) << 1);
+            _attributes[attributeRow * 8 + (column >> 1)] |= (byte)(palette << shift);
+        }
+    }
+    return 0;
+}
+
+// Runs the area parser over the whole area, filling in columns, collision and attributes
+int decodeAreaColumns(byte areaPointer, int pages, byte * _columns, word * _collision, byte * _attributes) {
+    GameState * state = calloc(1, sizeof(GameState));
+    GameState * previous = gs;
+    int columns = pages * 16;
+    if (!state) {
+        return -1;
+    }
+    gs = state;
+    gs->AreaPointer = areaPointer;
+    for (int column = 0; column < columns; column++) {
+        memset(gs->MetatileBuffer, 0, sizeof(gs->MetatileBuffer));
+        AreaParserCore();
+        storeMetatileColumn(column);
+        memcpy(_columns + column * AreaCacheColumnSize, gs->MetatileBuffer, MetatileRows);
+    }
+    for (int layer = 0; layer < CollisionLayers; layer++) {
+        memcpy(_collision + layer * columns, gs->collisionMap[layer], columns * sizeof(word));
+    }
+    for (int page = 0; page < pages; page++) {
+        areaAttributes(_columns + page * 16 * AreaCacheColumnSize, _attributes + page * 64);
+    }
+    gs = previous;
+    free(state);
+    return 0;
+}
+
+// Builds the whole cache from prgRom into a fresh allocation
+int compileAreaCache(byte ** _cache, size_t * _size) {
+    int enemyTable = findAreaTable(EnemyAddrHOffsets);
+    int areaTable = findAreaTable(AreaDataHOffsets);
+    const int areasPerType[4] = { 3, 22, 3, 6 };
+    int areaCount = 0;
+    size_t size = sizeof(AreaCacheHeader), offset;
+    byte * cache;
+    AreaCacheHeader * header;
+    if (enemyTable < 0 || areaTable < 0) {
+        return -1;
+    }
+    // First just work out how big everything is
+    for (int type = 0; type < 4; type++) {
+        for (int index = 0; index < areasPerType[type]; index++) {
+            const byte * enemies = areaTableData(enemyTable, EnemyAddrHOffsets[type] + index);
+            const byte * area = areaTableData(areaTable, AreaDataHOffsets[type] + index);
+            int pages = 0;
+            if (!enemies || !area) {
+                return -1;
+            }
+            int spawnCount = decodeEnemyData(enemies, prgRom + sizeof(prgRom) - enemies, NULL, &pages);
+            pages = pages > areaDataPages(area, prgRom + sizeof(prgRom) - area) ? pages : areaDataPages(area, prgRom + sizeof(prgRom) - area);
+            // One more for whatever the last objects spill into
+            pages = pages + 2 > AreaMaxPages ? AreaMaxPages : pages + 2;
+            size += sizeof(CachedArea) + spawnCount * sizeof(EnemySpawn) + (size_t)(pages + 1) * sizeof(word);
+            if (AreaParserRevision) {
+                size += (size_t)pages * 16 * (AreaCacheColumnSize + CollisionLayers * sizeof(word)) + (size_t)pages * 64;
+            }
+            areaCount++;
+        }
+    }
+    cache = calloc(1, size);
+    if (!cache) {
+        return -1;
+    }
+    header = (AreaCacheHeader *)cache;
+    memcpy(header->magic, AreaCacheMagic, sizeof(AreaCacheMagic));
+    header->version = AreaCacheVersion;
+    header->parserRevision = AreaParserRevision;
+    header->prgChecksum = checksum32(prgRom, sizeof(prgRom));
+    header->areaCount = (uint32_t)areaCount;
+    offset = sizeof(AreaCacheHeader) + areaCount * sizeof(CachedArea);
+    areaCount = 0;
+    for (int type = 0; type < 4; type++) {
+        for (int index = 0; index < areasPerType[type]; index++) {
+            const byte * enemies = areaTableData(enemyTable, EnemyAddrHOffsets[type] + index);
+            const byte * area = areaTableData(areaTable, AreaDataHOffsets[type] + index);
+            CachedArea * entry = (CachedArea *)(cache + sizeof(AreaCacheHeader)) + areaCount;
+            int pages = 0;
+            decodeEnemyData(enemies, prgRom + sizeof(prgRom) - enemies, NULL, &pages);
+            pages = pages > areaDataPages(area, prgRom + sizeof(prgRom) - area) ? pages : areaDataPages(area, prgRom + sizeof(prgRom) - area);
+            pages = pages + 2 > AreaMaxPages ? AreaMaxPages : pages + 2;
+            entry->areaPointer = (byte)((type << 5) | index);
+            entry->pages = (word)pages;
+            if (AreaParserRevision) {
+                entry->columns = (uint32_t)offset;
+                offset += (size_t)pages * 16 * AreaCacheColumnSize;
+                entry->collision = (uint32_t)offset;
+                offset += (size_t)pages * 16 * CollisionLayers * sizeof(word);
+                entry->attributes = (uint32_t)offset;
+                offset += (size_t)pages * 64;
+                if (decodeAreaColumns(entry->areaPointer, pages, cache + entry->columns,
+                                      (word *)(cache + entry->collision), cache + entry->attributes)) {
+                    free(cache);
+                    return -1;
+                }
+            }
+            entry->spawns = (uint32_t)offset;
+            entry->spawnCount = (uint32_t)decodeEnemyData(enemies, prgRom + sizeof(prgRom) - enemies,
+                                                          (EnemySpawn *)(cache + offset), &pages);
+            offset += entry->spawnCount * sizeof(EnemySpawn);
+            entry->pageIndex = (uint32_t)offset;
+            indexEnemySpawns((const EnemySpawn *)(cache + entry->spawns), entry->spawnCount, pages, (word *)(cache + offset));
+            offset += (size_t)(pages + 1) * sizeof(word);
+            areaCount++;
+        }
+    }
+    *_cache = cache;
+    *_size = size;
+    return 0;
+}
+
+// Whether everything the entry points at is inside a file of the given size
+int areaCacheEntryFits(const CachedArea * entry, size_t size) {
+    uint64_t columns = (uint64_t)entry->pages * 16;
+    return entry->pages > 0 && entry->pages <= AreaMaxPages
+        && (!entry->columns
+            || (entry->columns + columns * AreaCacheColumnSize <= size
+                && entry->collision + columns * CollisionLayers * sizeof(word) <= size
+                && entry->attributes + (uint64_t)entry->pages * 64 <= size))
+        && entry->spawns + (uint64_t)entry->spawnCount * sizeof(EnemySpawn) <= size
+        && entry->pageIndex + ((uint64_t)entry->pages + 1) * sizeof(word) <= size;
+}
+
+// Whether a mapped cache file is complete and made from this ROM and parser
+int areaCacheFileValid(const MappedFile * file, uint32_t checksum) {
+    const AreaCacheHeader * mapped = file->data;
+    if (file->size < sizeof(AreaCacheHeader)
+        || memcmp(mapped->magic, AreaCacheMagic, sizeof(AreaCacheMagic))
+        || mapped->version != AreaCacheVersion
+        || mapped->parserRevision != AreaParserRevision
+        || mapped->prgChecksum != checksum
+        || file->size < sizeof(AreaCacheHeader) + (uint64_t)mapped->areaCount * sizeof(CachedArea)) {
+        return 0;
+    }
+    for (uint32_t index = 0; index < mapped->areaCount; index++) {
+        if (!areaCacheEntryFits((const CachedArea *)(mapped + 1) + index, file->size)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Gets the area cache ready for the currently loaded ROM.
+// Maps cachePath if it exists and matches, otherwise compiles and tries to save it there.
+// cachePath can be NULL to only keep it in memory.
+int loadAreaCache(const char * cachePath) {
+    uint32_t checksum = checksum32(prgRom, sizeof(prgRom));
+    size_t size;
+    freeAreaCache();
+    if (cachePath && !mapFile(cachePath, &areaCacheFile)) {
+        if (areaCacheFileValid(&areaCacheFile, checksum)) {
+            areaCache = areaCacheFile.data;
+            return 0;
+        }
+        // Stale or broken, make a new one
+        unmapFile(&areaCacheFile);
+    }
+    if (compileAreaCache(&areaCacheMemory, &size)) {
+        return -1;
+    }
+    areaCache = areaCacheMemory;
+    if (cachePath) {
+        writeFileReplacing(cachePath, areaCacheMemory, size);
+    }
+    return 0;
+}
+
+// Index of the given area in the cache, -1 if it's not in there
+int findCachedArea(byte areaPointer) {
+    if (!areaCache) {
+        return -1;
+    }
+    for (uint32_t index = 0; index < areaCacheHeader()->areaCount; index++) {
+        const CachedArea * entry = areaCacheEntry(index);
+        if (entry->areaPointer == areaPointer) {
+            return (int)index;
+        }
+    }
+    return -1;
+}
+
+// The cache entry of the current area, NULL if it isn't in the cache
+const CachedArea * currentCachedArea() {
+    return areaCache && gs->cachedArea ? areaCacheEntry(gs->cachedArea - 1) : NULL;
+}
+
+// Switches to the area in AreaPointer straight from the cache.
+// Returns -1 if it isn't cached or the cache has no columns for it, the area parser
+// will have to build them then. Its enemy spawns still come from the cache if it's in there.
+int enterCachedArea() {
+    int index = findCachedArea(gs->AreaPointer);
+    const CachedArea * entry;
+    int columns;
+    if (index < 0) {
+        gs->cachedArea = 0;
+        return -1;
+    }
+    entry = areaCacheEntry(index);
+    columns = entry->pages * 16;
+    gs->cachedArea = (word)(index + 1);
+    gs->spawnCursor = 0;
+    if (!entry->columns) {
+        return -1;
+    }
+    clearCollisionMap();
+    for (int layer = 0; layer < CollisionLayers; layer++) {
+        memcpy(gs->collisionMap[layer], (const word *)(areaCache + entry->collision) + layer * columns, columns * sizeof(word));
+    }
+    return 0;
+}
+
+// Puts a column of the current cached area into the block buffer, instead of parsing it.
+// The collision map already has the whole area.
+int loadCachedColumn(int column) {
+    const CachedArea * entry = currentCachedArea();
+    const byte * metatiles;
+    byte * blockBuffer = ((column >> 4) & 1) ? gs->Block_Buffer_2 : gs->Block_Buffer_1;
+    if (!entry || !entry->columns || column >= entry->pages * 16) {
+        return -1;
+    }
+    metatiles = areaCache + entry->columns + column * AreaCacheColumnSize;
+    memcpy(gs->MetatileBuffer, metatiles, MetatileRows);
+    for (int row = 0; row < MetatileRows; row++) {
+        blockBuffer[row * 16 + (column & 15)] = metatiles[row];
+    }
+    return 0;
+}
+
+// Enemy spawning
+// With the page index, where spawning picks up is a lookup, however long the area is,
+// and every frame only looks at the spawns right at the edge of the screen.
+// Objects are spawned and erased at exactly the same spots as ProcessEnemyData and
+// OffscreenBoundsCheck do it.
+
+// Area changes (row 0x0e) only count in the world they're meant for
+int ParseRow0e(const EnemySpawn * spawn) {
+    if ((spawn->extra >> 5) == gs->WorldNumber) {
+        gs->AreaPointer = spawn->id;
+        gs->EntrancePage = spawn->extra & 0b00011111;
+    }
+    return 0;
+}
+
+// Spawning continues from the first spawn on the given page, like when starting halfway.
+// ProcessEnemyData would still go through the area changes before it, so those get applied.
+int seekEnemySpawns(int page) {
+    const CachedArea * entry = currentCachedArea();
+    const EnemySpawn * spawns;
+    if (!entry) {
+        return -1;
+    }
+    if (page >= entry->pages) {
+        page = entry->pages - 1;
+    }
+    spawns = (const EnemySpawn *)(areaCache + entry->spawns);
+    gs->spawnCursor = ((const word *)(areaCache + entry->pageIndex))[page];
+    for (int spawn = 0; spawn < gs->spawnCursor; spawn++) {
+        if (spawns[spawn].flags & EnemySpawn_AreaChange) {
+            ParseRow0e(&spawns[spawn]);
+        }
+    }
+    return 0;
+}
+
+// Free enemy slot, the last one is kept for special objects like on the NES. -1 if they're all taken.
+int FindEmptyEnemySlot() {
+    for (int enemy = 0; enemy < EnemySlots - 1; enemy++) {
+        if (!gs->Enemy_Flag[enemy]) {
+            return enemy;
+        }
+    }
+    return -1;
+}
+
+int EraseEnemyObject(int enemy) {
+    gs->Enemy_Flag[enemy] = 0;
+    gs->Enemy_ID[enemy] = 0;
+    gs->SprObject_State[FirstEnemySlot + enemy] = 0;
+    gs->FloateyNum_Control[enemy] = 0;
+    gs->EnemyIntervalTimer[enemy] = 0;
+    gs->ShellChainCounter[enemy] = 0;
+    gs->SprObject_SprAttrib[FirstEnemySlot + enemy] = 0;
+    gs->EnemyFrameTimer[enemy] = 0;
+    return 0;
+}
+
+// Enemy init
+// The per enemy setup InitEnemyObject does through its jump table. Some variables the
+// disassembly names per enemy are just other object tables under another name
+// (BlooperMoveSpeed is Enemy_X_Speed and so on), those write to the table they really are.
+typedef int (*EnemyInitFunction)(int enemy);
+
+int InitVStf(int enemy) {
+    gs->SprObject_Y_Speed[FirstEnemySlot + enemy] = 0;
+    gs->SprObject_Y_MoveForce[FirstEnemySlot + enemy] = 0;
+    return 0;
+}
+
+int SetBBox(int enemy, byte control) {
+    gs->SprObj_BoundBoxCtrl[FirstEnemySlot + enemy] = control;
+    // set moving direction for left
+    gs->SprObject_MovingDir[FirstEnemySlot + enemy] = 2;
+    return InitVStf(enemy);
+}
+
+int SmallBBox(int enemy) { return SetBBox(enemy, 0x09); }
+int TallBBox(int enemy) { return SetBBox(enemy, 0x03); }
+
+// Only the bounding box, nothing else
+int SetBBox2(int enemy, byte control) {
+    gs->SprObj_BoundBoxCtrl[FirstEnemySlot + enemy] = control;
+    return 0;
+}
+
+const byte NormalXSpdData[2] = { 0xf8, 0xf4 };
+const byte HBroWalkingTimerData[2] = { 0x80, 0x50 };
+
+int NoInitCode(int enemy) { (void)enemy; return 0; }
+
+int InitNormalEnemy(int enemy) {
+    gs->SprObject_X_Speed[FirstEnemySlot + enemy] = NormalXSpdData[gs->PrimaryHardMode ? 1 : 0];
+    return TallBBox(enemy);
+}
+
+int InitRedKoopa(int enemy) {
+    InitNormalEnemy(enemy);
+    gs->SprObject_State[FirstEnemySlot + enemy] = 1;
+    return 0;
+}
+
+int InitHammerBro(int enemy) {
+    gs->HammerThrowingTimer[enemy] = 0;
+    gs->SprObject_X_Speed[FirstEnemySlot + enemy] = 0;
+    // delay before walking left
+    gs->EnemyIntervalTimer[enemy] = HBroWalkingTimerData[gs->SecondaryHardMode ? 1 : 0];
+    return SetBBox(enemy, 0x0b);
+}
+
+int InitGoomba(int enemy) {
+    InitNormalEnemy(enemy);
+    return SmallBBox(enemy);
+}
+
+int InitBloober(int enemy) {
+    // BlooperMoveSpeed
+    gs->SprObject_X_Speed[FirstEnemySlot + enemy] = 0;
+    return SmallBBox(enemy);
+}
+
+int InitBulletBill(int enemy) {
+    gs->SprObject_MovingDir[FirstEnemySlot + enemy] = 2;
+    gs->SprObj_BoundBoxCtrl[FirstEnemySlot + enemy] = 0x09;
+    return 0;
+}
+
+int InitCheepCheep(int enemy) {
+    int slot = FirstEnemySlot + enemy;
+    SmallBBox(enemy);
+    // CheepCheepMoveMFlag, d4 of the random bits
+    gs->SprObject_X_Speed[slot] = gs->PseudoRandomBitReg[enemy % 7] & 0b00010000;
+    // CheepCheepOrigYPos
+    gs->SprObject_Y_MoveForce[slot] = gs->SprObject_Y_Position[slot];
+    return 0;
+}
+
+int InitPodoboo(int enemy) {
+    int slot = FirstEnemySlot + enemy;
+    // below the bottom of the screen
+    gs->SprObject_Y_HighPos[slot] = 2;
+    gs->SprObject_Y_Position[slot] = 2;
+    gs->EnemyIntervalTimer[enemy] = 1;
+    gs->SprObject_State[slot] = 0;
+    return SmallBBox(enemy);
+}
+
+int InitPiranhaPlant(int enemy) {
+    int slot = FirstEnemySlot + enemy;
+    // PiranhaPlant_Y_Speed
+    gs->SprObject_X_Speed[slot] = 1;
+    gs->SprObject_State[slot] = 0;
+    // PiranhaPlant_MoveFlag
+    gs->SprObject_Y_Speed[slot] = 0;
+    // PiranhaPlantDownYPos and PiranhaPlantUpYPos, 24 pixels higher
+    gs->SprObject_Y_MoveForce[slot] = gs->SprObject_Y_Position[slot];
+    gs->SprObject_YMF_Dummy[slot] = gs->SprObject_Y_Position[slot] - 0x18;
+    return SetBBox2(enemy, 0x09);
+}
+
+int InitJumpGPTroopa(int enemy) {
+    gs->SprObject_MovingDir[FirstEnemySlot + enemy] = 2;
+    gs->SprObject_X_Speed[FirstEnemySlot + enemy] = 0xf8;
+    return SetBBox2(enemy, 0x03);
+}
+
+int InitRedPTroopa(int enemy) {
+    int slot = FirstEnemySlot + enemy;
+    byte y = gs->SprObject_Y_Position[slot];
+    // RedPTroopaOrigXPos, which really is the original vertical coordinate
+    gs->SprObject_X_MoveForce[slot] = y;
+    // RedPTroopaCenterYPos, 48 pixels down in the upper half, 32 up in the lower one
+    gs->SprObject_X_Speed[slot] = (byte)(y + (y & 0x80 ? 0xe0 : 0x30));
+    return TallBBox(enemy);
+}
+
+int InitHorizFlySwimEnemy(int enemy) {
+    gs->SprObject_X_Speed[FirstEnemySlot + enemy] = 0;
+    return TallBBox(enemy);
+}
+
+// Lakitus don't come back while their spinies are still around
+int InitLakitu(int enemy) {
+    if (gs->EnemyFrenzyBuffer) {
+        return EraseEnemyObject(enemy);
+    }
+    gs->LakituReappearTimer = 0;
+    InitHorizFlySwimEnemy(enemy);
+    return SetBBox2(enemy, 0x03);
+}
+
+// Stops whatever frenzy is going on, lakitus leave
+int EndFrenzy(int enemy) {
+    for (int other = EnemySlots - 1; other >= 0; other--) {
+        if (gs->Enemy_ID[other] == Lakitu) {
+            gs->SprObject_State[FirstEnemySlot + other] = 1;
+        }
+    }
+    gs->EnemyFrenzyBuffer = 0;
+    gs->Enemy_Flag[enemy] = 0;
+    return 0;
+}
+
+int InitRetainerObj(int enemy) {
+    gs->SprObject_Y_Position[FirstEnemySlot + enemy] = 0xb8;
+    return 0;
+}
+
+// TODO: The frenzies, firebars, platforms, Bowser, power-ups and vines need their objects
+// transpiled first, until then their spawns get the common setup only
+#define InitEnemyFrenzy NoInitCode
+#define InitShortFirebar NoInitCode
+#define InitLongFirebar NoInitCode
+#define InitBalPlatform NoInitCode
+#define InitVertPlatform NoInitCode
+#define LargeLiftUp NoInitCode
+#define LargeLiftDown NoInitCode
+#define InitHoriPlatform NoInitCode
+#define InitDropPlatform NoInitCode
+#define PlatLiftUp NoInitCode
+#define PlatLiftDown NoInitCode
+#define InitBowser NoInitCode
+#define PwrUpJmp NoInitCode
+#define Setup_Vine NoInitCode
+
+// Indexed by Enemy_ID
+const EnemyInitFunction InitEnemyRoutines[] = {
+    InitNormalEnemy, InitNormalEnemy, InitNormalEnemy, InitRedKoopa,
+    NoInitCode, InitHammerBro, InitGoomba, InitBloober,
+    InitBulletBill, NoInitCode, InitCheepCheep, InitCheepCheep,
+    InitPodoboo, InitPiranhaPlant, InitJumpGPTroopa, InitRedPTroopa,
+    InitHorizFlySwimEnemy, InitLakitu, InitEnemyFrenzy, NoInitCode,
+    InitEnemyFrenzy, InitEnemyFrenzy, InitEnemyFrenzy, InitEnemyFrenzy,
+    EndFrenzy, NoInitCode, NoInitCode, InitShortFirebar,
+    InitShortFirebar, InitShortFirebar, InitShortFirebar, InitLongFirebar,
+    NoInitCode, NoInitCode, NoInitCode, NoInitCode,
+    InitBalPlatform, InitVertPlatform, LargeLiftUp, LargeLiftDown,
+    InitHoriPlatform, InitDropPlatform, InitHoriPlatform, PlatLiftUp,
+    PlatLiftDown, InitBowser, PwrUpJmp, Setup_Vine,
+    NoInitCode, NoInitCode, NoInitCode, NoInitCode,
+    NoInitCode, InitRetainerObj, NoInitCode,
+};
+
+// Enemies below 0x15 sit 8 pixels lower and start with their offscreen bits masked
+int CheckpointEnemyID(int enemy) {
+    byte id = gs->Enemy_ID[enemy];
+    if (id < 0x15) {
+        gs->SprObject_Y_Position[FirstEnemySlot + enemy] += 8;
+        gs->EnemyOffscrBitsMasked[enemy] = 1;
+    }
+    if (id < sizeof(InitEnemyRoutines) / sizeof(InitEnemyRoutines[0])) {
+        InitEnemyRoutines[id](enemy);
+    }
+    return 0;
+}
+
+int InitEnemyObject(int enemy) {
+    gs->SprObject_State[FirstEnemySlot + enemy] = 0;
+    return CheckpointEnemyID(enemy);
+}
+
+// Enemy IDs 0x37-0x3e put two or three goombas or koopas in a row at the right edge,
+// 24 pixels apart, low or high up
+int HandleGroupEnemies(byte id) {
+    int group = id - 0x37;
+    byte enemyID = GreenKoopa;
+    byte y = (group & 0b10) ? 0x70 : 0xb0;
+    byte x = gs->ScreenRight_X_Pos;
+    byte page = gs->ScreenRight_PageLoc;
+    int count = (group & 0b01) ? 3 : 2;
+    if (group < 4) {
+        enemyID = gs->PrimaryHardMode ? BuzzyBeetle : Goomba;
+    }
+    for (; count > 0; count--) {
+        int enemy = FindEmptyEnemySlot();
+        int slot;
+        if (enemy < 0) {
+            break;
+        }
+        slot = FirstEnemySlot + enemy;
+        gs->Enemy_ID[enemy] = enemyID;
+        gs->SprObject_PageLoc[slot] = page;
+        gs->SprObject_X_Position[slot] = x;
+        page += (byte)(x + 0x18 > 0xff);
+        x += 0x18;
+        gs->SprObject_Y_Position[slot] = y;
+        gs->SprObject_Y_HighPos[slot] = 1;
+        gs->Enemy_Flag[enemy] = 1;
+        CheckpointEnemyID(enemy);
+    }
+    return 0;
+}
+
+// Puts a spawn into the given free enemy slot, the end of ProcessEnemyData.
+// Returns -1 if the init code got rid of it right away (lakitus during a frenzy, frenzy stops),
+// the record isn't used up then and the next free slot tries it again, like on the NES.
+int SpawnEnemy(const EnemySpawn * spawn, int enemy) {
+    int slot = FirstEnemySlot + enemy;
+    byte id = spawn->id;
+    if (id >= 0x37 && id < 0x3f) {
+        return HandleGroupEnemies(id);
+    }
+    if (id == Goomba && gs->PrimaryHardMode) {
+        id = BuzzyBeetle;
+    }
+    gs->SprObject_PageLoc[slot] = spawn->page;
+    gs->SprObject_X_Position[slot] = (byte)(spawn->column << 4);
+    gs->SprObject_Y_HighPos[slot] = 1;
+    gs->SprObject_Y_Position[slot] = (byte)(spawn->row << 4);
+    gs->Enemy_ID[enemy] = id;
+    gs->Enemy_Flag[enemy] = 1;
+    InitEnemyObject(enemy);
+    return gs->Enemy_Flag[enemy] ? 0 : -1;
+}
+
+// ProcessEnemyData for every free enemy slot in turn, run once a frame.
+// Each free slot gets to take one record: it spawns if it's past the right edge but no more
+// than 48 pixels, and gets skipped if it's already left of it or hard mode only without
+// hard mode. Records further out have to wait, and so does everything after them.
+// The last slot only takes area changes and power-ups.
+int SpawnEnemies() {
+    const CachedArea * entry = currentCachedArea();
+    const EnemySpawn * spawns;
+    // Right edge plus 48 pixels, down to the column
+    int right = gs->ScreenRight_PageLoc * 256 + gs->ScreenRight_X_Pos;
+    int extended = (right + 0x30) & ~0x0f;
+    if (!entry) {
+        return -1;
+    }
+    spawns = (const EnemySpawn *)(areaCache + entry->spawns);
+    for (int enemy = 0; enemy < EnemySlots && gs->spawnCursor < entry->spawnCount; enemy++) {
+        const EnemySpawn * spawn = &spawns[gs->spawnCursor];
+        int position = spawn->page * 256 + spawn->column * 16;
+        if (gs->Enemy_Flag[enemy]) {
+            continue;
+        }
+        if (enemy == EnemySlots - 1 && !(spawn->flags & EnemySpawn_AreaChange) && spawn->id != PowerUpObject) {
+            continue;
+        }
+        if (position > extended) {
+            break;
+        }
+        if (spawn->flags & EnemySpawn_AreaChange) {
+            ParseRow0e(spawn);
+        } else if (position >= right && (gs->SecondaryHardMode || !(spawn->flags & EnemySpawn_HardModeOnly))
+                   && SpawnEnemy(spawn, enemy)) {
+            // The init code got rid of it, the next free slot tries again
+            continue;
+        }
+        gs->spawnCursor++;
+    }
+    return 0;
+}
+
+// Erases an enemy that's gone too far off screen, 72 pixels past the left or right edge.
+// Hammer bros and piranha plants go 57 pixels sooner on the left, some objects never go on the right.
+// All the odd carries are the same as on the NES.
+int OffscreenBoundsCheck(int enemy) {
+    int slot = FirstEnemySlot + enemy;
+    byte id = gs->Enemy_ID[enemy];
+    int carry, value;
+    byte leftX, leftPage, rightX, rightPage;
+    if (id == FlyingCheepCheep) {
+        return 0;
+    }
+    value = gs->ScreenLeft_X_Pos;
+    if (id == HammerBro || id == PiranhaPlant) {
+        value += 0x38 + 1;
+        carry = value > 0xff;
+        value &= 0xff;
+    } else {
+        carry = id >= PiranhaPlant;
+    }
+    value = value - 0x48 - !carry;
+    carry = value >= 0;
+    leftX = (byte)value;
+    value = gs->ScreenLeft_PageLoc - !carry;
+    carry = value >= 0;
+    leftPage = (byte)value;
+    value = gs->ScreenRight_X_Pos + 0x48 + carry;
+    carry = value > 0xff;
+    rightX = (byte)value;
+    rightPage = (byte)(gs->ScreenRight_PageLoc + carry);
+    if ((byte)(gs->SprObject_PageLoc[slot] - leftPage - !(gs->SprObject_X_Position[slot] >= leftX)) & 0x80) {
+        return EraseEnemyObject(enemy);
+    }
+    if ((byte)(gs->SprObject_PageLoc[slot] - rightPage - !(gs->SprObject_X_Position[slot] >= rightX)) & 0x80) {
+        return 0;
+    }
+    if (gs->SprObject_State[slot] == HammerBro || id == PiranhaPlant || id == FlagpoleFlagObject
+        || id == StarFlagObject || id == JumpspringObject) {
+        return 0;
+    }
+    return EraseEnemyObject(enemy);
+}
+
+// Erases every enemy that left the window around the screen
+int DespawnEnemies() {
+    for (int enemy = 0; enemy < EnemySlots; enemy++) {
+        if (gs->Enemy_Flag[enemy]) {
+            OffscreenBoundsCheck(enemy);
+        }
+    }
+    return 0;
+}
+
+// Sound engine
+// TODO: The handlers still need to be transpiled, they play the music and
+// sound effect data from the ROM on their channels
+int PauseSoundHandler() { return 0; }
+int Square1SfxHandler() { return 0; }
+int Square2SfxHandler() { return 0; }
+int NoiseSfxHandler() { return 0; }
+int MusicHandler() { return 0; }
+// Set these as the handlers get transpiled. Until then the offline renderer leaves out
+// the tracks they play, those would only come out silent.
+#define MusicHandlerTranspiled 0
+#define Square1SfxHandlerTranspiled 0
+#define Square2SfxHandlerTranspiled 0
+#define NoiseSfxHandlerTranspiled 0
+
+// Runs once a frame, takes whatever got queued up this frame and plays it
+int SoundEngine() {
+    byte counter;
+    // are we in title screen mode? if so, disable sound and leave
+    if (gs->OperMode == TitleScreenModeValue) {
+        writeAPU(0x4015, 0);
+        return 0;
+    }
+    // disable irqs and set frame counter mode
+    writeAPU(0x4017, 0xff);
+    // enable first four channels
+    writeAPU(0x4015, 0b00001111);
+    // is sound already in pause mode, or about to be?
+    if (gs->PauseModeFlag || gs->PauseSoundQueue == 1) {
+        PauseSoundHandler();
+        goto SkipSoundSubroutines;
+    }
+    Square1SfxHandler();
+    Square2SfxHandler();
+    NoiseSfxHandler();
+    MusicHandler();
+    // clear the music queues
+    gs->AreaMusicQueue = 0;
+    gs->EventMusicQueue = 0;
+
+    SkipSoundSubroutines:
+    // clear the sound effects queues
+    gs->Square1SoundQueue = 0;
+    gs->Square2SoundQueue = 0;
+    gs->NoiseSoundQueue = 0;
+    gs->PauseSoundQueue = 0;
+
+    // Ramps the DMC's output level up while ground or water music plays and back down after.
+    // Both checks look at the level from before the increment, Y in the original.
+    counter = gs->DAC_Counter;
+    if (gs->AreaMusicBuffer & 0b00000011) {
+        gs->DAC_Counter++;
+        if (counter < 0x30) {
+            goto StrWave;
+        }
+    }
+    if (counter) {
+        gs->DAC_Counter--;
+    }
+    StrWave:
+    writeAPU(0x4011, counter);
+    return 0;
+}
+
+// Masks Select and Start of one controller (0 or 1) like ReadPortBits does.
+// They only get through if they weren't already held last frame,
+// so holding Start doesn't keep toggling pause.
+byte maskJoypadBits(int port, byte bits) {
+    if ((bits & (Select_Button | Start_Button)) & gs->JoypadBitMask[port]) {
+        return bits & 0b11001111;
+    }
+    gs->JoypadBitMask[port] = bits;
+    return bits;
+}
+
+// Reads both controllers into SavedJoypad1Bits and SavedJoypad2Bits.
+int ReadJoypads() {
+    gs->SavedJoypad1Bits = maskJoypadBits(0, gs->JOYPAD_PORT1);
+    gs->SavedJoypad2Bits = maskJoypadBits(1, gs->JOYPAD_PORT2);
+    gs->SavedJoypadBits = gs->SavedJoypad1Bits;
+    return 0;
+}
+
+// VRAM update buffers
+// Everything the game wants changed on screen gets queued up in VRAM_Buffer1/VRAM_Buffer2
+// during the frame, and UpdateScreen() writes it all out at the next NMI.
+// The buffers are just a byte array and an offset, so nothing is ever allocated
+// and starting over each frame is setting the offset back to 0.
+//
+// Every command looks like this, payload follows right after:
+// 0-1: VRAM address, high byte first
+// 2-3: length, high byte first
+// 4: 7: add 32 per byte instead of 1 (going down)
+//    6: repeat the single payload byte length times
+#define VRAMCommandHeaderSize 5
+#define VRAMCommand_Down 0b10000000
+#define VRAMCommand_Repeat 0b01000000
+
+// Reserves a command in the given buffer (1 or 2) and returns where its payload goes.
+// Returns NULL if the buffer is full.
+byte * queueVRAMCommand(int buffer, word address, word length, byte flags) {
+    byte * data = buffer == 2 ? gs->VRAM_Buffer2 : gs->VRAM_Buffer1;
+    word * offset = buffer == 2 ? &gs->VRAM_Buffer2_Offset : &gs->VRAM_Buffer1_Offset;
+    int payload = (flags & VRAMCommand_Repeat) ? 1 : length;
+    byte * command = data + *offset;
+    if (*offset + VRAMCommandHeaderSize + payload > VRAM_BufferSize) {
+        return NULL;
+    }
+    command[0] = address >> 8;
+    command[1] = address & 0xff;
+    command[2] = length >> 8;
+    command[3] = length & 0xff;
+    command[4] = flags;
+    *offset += VRAMCommandHeaderSize + payload;
+    return command + VRAMCommandHeaderSize;
+}
+
+// Queues length bytes of data to be written starting at address
+int queueVRAMData(int buffer, word address, const byte * data, word length, byte flags) {
+    byte * payload = queueVRAMCommand(buffer, address, length, flags & ~VRAMCommand_Repeat);
+    if (!payload) {
+        return -1;
+    }
+    memcpy(payload, data, length);
+    return 0;
+}
+
+// Writes out every command in a buffer
+int writeVRAMBuffer(const byte * data, word length) {
+    word offset = 0;
+    while (offset + VRAMCommandHeaderSize <= length) {
+        word address = (data[offset] << 8) | data[offset + 1];
+        word count = (data[offset + 2] << 8) | data[offset + 3];
+        byte flags = data[offset + 4];
+        offset += VRAMCommandHeaderSize;
+        writeVRAMRun(address, data + offset, count, (flags & VRAMCommand_Down) ? 32 : 1, flags & VRAMCommand_Repeat);
+        offset += (flags & VRAMCommand_Repeat) ? 1 : count;
+    }
+    return 0;
+}
+
+int UpdateScreen() {
+    // VRAM_Buffer_AddrCtrl picks what to draw, 6 is the second buffer
+    // TODO: The rest of the values point at data in ROM (title screen and such)
+    if (gs->VRAM_Buffer_AddrCtrl == 6) {
+        writeVRAMBuffer(gs->VRAM_Buffer2, gs->VRAM_Buffer2_Offset);
+        gs->VRAM_Buffer2_Offset = 0;
+    } else {
+        writeVRAMBuffer(gs->VRAM_Buffer1, gs->VRAM_Buffer1_Offset);
+        gs->VRAM_Buffer1_Offset = 0;
+    }
+    gs->VRAM_Buffer_AddrCtrl = 0;
+    return 0;
+}
+
+// Timing
+// Monotonic clock in nanoseconds, only meant for measuring differences
+uint64_t getTimeNanoseconds() {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((double)counter.QuadPart * 1000000000.0 / (double)frequency.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+#endif
+}
+
+// Cheapest counter there is for timing short stretches of code.
+// CPU cycles on x86, nanoseconds everywhere else.
+uint64_t readTicks() {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    return __rdtsc();
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_ia32_rdtsc();
+#else
+    return getTimeNanoseconds();
+#endif
+}
+
+// Task tables
+// The original picks what to run with JumpEngine, a jump table indexed by a task number
+// like OperMode or GameEngineSubroutine. Here those are const tables of functions,
+// and runTask() checks the index before calling anything.
+//
+// Every task also keeps track of how often it ran and how long it took (see printTaskStats()),
+// define SMB_NO_TASK_TIMING to leave that out completely.
+typedef int (*TaskFunction)();
+
+struct Task {
+    const char * name;
+    TaskFunction function;
+};
+typedef struct Task Task;
+
+struct TaskStats {
+    uint64_t calls;
+    uint64_t ticks;
+    uint64_t maxTicks;
+};
+typedef struct TaskStats TaskStats;
+
+#define task(function) { #function, function }
+#define taskCount(tasks) (int)(sizeof(tasks) / sizeof(tasks[0]))
+
+// Runs tasks[index]. Returns -1 without running anything if index is out of range.
+// stats has one entry per task, it's ignored without task timing.
+int runTask(const Task * tasks, int count, int index, TaskStats * _stats) {
+    int result;
+#ifndef SMB_NO_TASK_TIMING
+    uint64_t start, ticks;
+#endif
+    if (index < 0 || index >= count) {
+        return -1;
+    }
+#ifdef SMB_NO_TASK_TIMING
+    (void)_stats;
+    result = tasks[index].function();
+#else
+    start = readTicks();
+    result = tasks[index].function();
+    ticks = readTicks() - start;
+    _stats[index].calls++;
+    _stats[index].ticks += ticks;
+    if (ticks > _stats[index].maxTicks) {
+        _stats[index].maxTicks = ticks;
+    }
+#endif
+    return result;
+}
+
+// TODO: All of these still need to be transpiled
+int InitScreen() { return 0; }
+int SetupIntermediate() { return 0; }
+int WriteTopStatusLine() { return 0; }
+int WriteBottomStatusLine() { return 0; }
+int DisplayTimeUp() { return 0; }
+int ResetSpritesAndScreenTimer() { return 0; }
+int DisplayIntermediate() { return 0; }
+int AreaParserTaskControl() { return 0; }
+int GetAreaPalette() { return 0; }
+int GetBackgroundColor() { return 0; }
+int GetAlternatePalette1() { return 0; }
+int DrawTitleScreen() { return 0; }
+int ClearBuffersDrawIcon() { return 0; }
+int WriteTopScore() { return 0; }
+
+int Entrance_GameTimerSetup() { return 0; }
+int Vine_AutoClimb() { return 0; }
+int SideExitPipeEntry() { return 0; }
+int VerticalPipeEntry() { return 0; }
+int FlagpoleSlide() { return 0; }
+int PlayerEndLevel() { return 0; }
+int PlayerLoseLife() { return 0; }
+int PlayerEntrance() { return 0; }
+int PlayerCtrlRoutine() { return 0; }
+int PlayerChangeSize() { return 0; }
+int PlayerInjuryBlink() { return 0; }
+int PlayerDeath() { return 0; }
+int PlayerFireFlower() { return 0; }
+
+int InitializeGame() { return 0; }
+int PrimaryGameSetup() { return 0; }
+int GameMenuRoutine() { return 0; }
+// TODO: Most of InitializeArea still needs to be transpiled (area variables, scroll and pages
+// from EntrancePage/HalfwayPage, the area parser), this is only the area cache part after it
+int InitializeArea() {
+    enterCachedArea();
+    seekEnemySpawns(gs->ScreenLeft_PageLoc);
+    return 0;
+}
+int SecondaryGameSetup() { return 0; }
+int BridgeCollapse() { return 0; }
+int SetupVictoryMode() { return 0; }
+int PlayerVictoryWalk() { return 0; }
+int PrintVictoryMessages() { return 0; }
+int PlayerEndWorld() { return 0; }
+int SetupGameOver() { return 0; }
+int RunGameOver() { return 0; }
+
+// Indexed by ScreenRoutineTask
+const Task ScreenRoutineTasks[] = {
+    task(InitScreen),
+    task(SetupIntermediate),
+    task(WriteTopStatusLine),
+    task(WriteBottomStatusLine),
+    task(DisplayTimeUp),
+    task(ResetSpritesAndScreenTimer),
+    task(DisplayIntermediate),
+    task(ResetSpritesAndScreenTimer),
+    task(AreaParserTaskControl),
+    task(GetAreaPalette),
+    task(GetBackgroundColor),
+    task(GetAlternatePalette1),
+    task(DrawTitleScreen),
+    task(ClearBuffersDrawIcon),
+    task(WriteTopScore),
+};
+THREAD_LOCAL TaskStats screenRoutineStats[taskCount(ScreenRoutineTasks)];
+
+int ScreenRoutines() {
+    return runTask(ScreenRoutineTasks, taskCount(ScreenRoutineTasks), gs->ScreenRoutineTask, screenRoutineStats);
+}
+
+// Indexed by GameEngineSubroutine
+const Task GameRoutineTasks[] = {
+    task(Entrance_GameTimerSetup),
+    task(Vine_AutoClimb),
+    task(SideExitPipeEntry),
+    task(VerticalPipeEntry),
+    task(FlagpoleSlide),
+    task(PlayerEndLevel),
+    task(PlayerLoseLife),
+    task(PlayerEntrance),
+    task(PlayerCtrlRoutine),
+    task(PlayerChangeSize),
+    task(PlayerInjuryBlink),
+    task(PlayerDeath),
+    task(PlayerFireFlower),
+};
+THREAD_LOCAL TaskStats gameRoutineStats[taskCount(GameRoutineTasks)];
+
+int GameRoutines() {
+    return runTask(GameRoutineTasks, taskCount(GameRoutineTasks), gs->GameEngineSubroutine, gameRoutineStats);
+}
+
+// Everything that moves while playing, in the order of the original.
+// TODO: Only some of it is transpiled so far, the rest goes in between
+int GameEngine() {
+    // EnemiesAndLoopsCore: free slots take the next enemies, the others run
+    // and go away once they're too far off screen
+    SpawnEnemies();
+    DespawnEnemies();
+    BlockObjMT_Updater();
+    return 0;
+}
+
+int GameCoreRoutine() {
+    // Use the controller of whoever is playing
+    gs->SavedJoypadBits = gs->CurrentPlayer ? gs->SavedJoypad2Bits : gs->SavedJoypad1Bits;
+    GameRoutines();
+    if (gs->OperMode_Task >= 3) {
+        GameEngine();
+    }
+    return 0;
+}
+
+// Indexed by OperMode_Task, one table per OperMode
+const Task TitleScreenTasks[] = {
+    task(InitializeGame),
+    task(ScreenRoutines),
+    task(PrimaryGameSetup),
+    task(GameMenuRoutine),
+};
+const Task GameModeTasks[] = {
+    task(InitializeArea),
+    task(ScreenRoutines),
+    task(SecondaryGameSetup),
+    task(GameCoreRoutine),
+};
+const Task VictoryModeTasks[] = {
+    task(BridgeCollapse),
+    task(SetupVictoryMode),
+    task(PlayerVictoryWalk),
+    task(PrintVictoryMessages),
+    task(PlayerEndWorld),
+};
+const Task GameOverModeTasks[] = {
+    task(SetupGameOver),
+    task(ScreenRoutines),
+    task(RunGameOver),
+};
+THREAD_LOCAL TaskStats titleScreenStats[taskCount(TitleScreenTasks)];
+THREAD_LOCAL TaskStats gameModeStats[taskCount(GameModeTasks)];
+THREAD_LOCAL TaskStats victoryModeStats[taskCount(VictoryModeTasks)];
+THREAD_LOCAL TaskStats gameOverModeStats[taskCount(GameOverModeTasks)];
+
+int TitleScreenMode() {
+    return runTask(TitleScreenTasks, taskCount(TitleScreenTasks), gs->OperMode_Task, titleScreenStats);
+}
+
+int GameMode() {
+    return runTask(GameModeTasks, taskCount(GameModeTasks), gs->OperMode_Task, gameModeStats);
+}
+
+int VictoryMode() {
+    // TODO: The victory mode also runs the enemies and draws the player after its task
+    return runTask(VictoryModeTasks, taskCount(VictoryModeTasks), gs->OperMode_Task, victoryModeStats);
+}
+
+int GameOverMode() {
+    return runTask(GameOverModeTasks, taskCount(GameOverModeTasks), gs->OperMode_Task, gameOverModeStats);
+}
+
+// Indexed by OperMode
+const Task OperModeTasks[] = {
+    task(TitleScreenMode),
+    task(GameMode),
+    task(VictoryMode),
+    task(GameOverMode),
+};
+THREAD_LOCAL TaskStats operModeStats[taskCount(OperModeTasks)];
+
+int OperModeExecutionTree() {
+    return runTask(OperModeTasks, taskCount(OperModeTasks), gs->OperMode, operModeStats);
+}
+
+int printTaskTable(const char * table, const Task * tasks, int count, const TaskStats * stats) {
+    for (int index = 0; index < count; index++) {
+        if (!stats[index].calls) {
+            continue;
+        }
+        printf("  %-14s %-28s %10llu calls %10.1f avg %10llu max\n", table, tasks[index].name,
+            (unsigned long long)stats[index].calls, (double)stats[index].ticks / (double)stats[index].calls,
+            (unsigned long long)stats[index].maxTicks);
+    }
+    return 0;
+}
+
+// Prints where the time went on this thread, in readTicks() units.
+// Nested tasks count towards the one they were called from too.
+int printTaskStats() {
+#ifndef SMB_NO_TASK_TIMING
+    printf("Task timings (ticks, tasks that ran):\n");
+    printTaskTable("OperMode", OperModeTasks, taskCount(OperModeTasks), operModeStats);
+    printTaskTable("TitleScreen", TitleScreenTasks, taskCount(TitleScreenTasks), titleScreenStats);
+    printTaskTable("GameMode", GameModeTasks, taskCount(GameModeTasks), gameModeStats);
+    printTaskTable("VictoryMode", VictoryModeTasks, taskCount(VictoryModeTasks), victoryModeStats);
+    printTaskTable("GameOverMode", GameOverModeTasks, taskCount(GameOverModeTasks), gameOverModeStats);
+    printTaskTable("ScreenRoutine", ScreenRoutineTasks, taskCount(ScreenRoutineTasks), screenRoutineStats);
+    printTaskTable("GameRoutine", GameRoutineTasks, taskCount(GameRoutineTasks), gameRoutineStats);
+#endif
+    return 0;
+}
+
+int NonMaskableInterrupt() {
+    // Disable NMIs in the mirror while we're busy
+    gs->Mirror_PPU_CTRL_REG1 &= 0b01111111;
+    gs->ppu.PPU_CTRL_REG1 = gs->Mirror_PPU_CTRL_REG1 & 0b01111110;
+
+    // Disable OAM and background display by default
+    byte temp = gs->Mirror_PPU_CTRL_REG2 & 0b11100110;
+    if (gs->DisableScreenFlag) {
+        goto ScreenOff;
+    }
+    // otherwise reenable them
+    temp = gs->Mirror_PPU_CTRL_REG2 | 0b00011110;
+    ScreenOff:
+    gs->Mirror_PPU_CTRL_REG2 = temp;
+    gs->ppu.PPU_CTRL_REG2 = temp & 0b11100111;
+    readFromPPUStatus(&gs->ppu);
+    InitScroll(0);
+
+    UpdateScreen();
+    SoundEngine();
+    gs->ppu.PPU_CTRL_REG2 = gs->Mirror_PPU_CTRL_REG2;
+    ReadJoypads();
+    // TODO: PauseRoutine, UpdateTopScore, Timers
+
+    // Skip all the game logic while paused
+    if (!(gs->GamePauseStatus & 1)) {
+        gs->FrameCounter++;
+    }
+
+    writeToPPUScroll(gs->HorizontalScroll, gs->VerticalScroll, &gs->ppu);
+    gs->ppu.PPU_CTRL_REG1 = gs->Mirror_PPU_CTRL_REG1;
+    if (!(gs->GamePauseStatus & 1)) {
+        OperModeExecutionTree();
+    }
+
+    // Reactivate NMIs
+    readFromPPUStatus(&gs->ppu);
+    gs->ppu.PPU_CTRL_REG1 |= 0b10000000;
+    return 0;
+}
+
+// Gets everything ready for the first frame
+int Reset() {
+    // Init PPU Control Register
     // Set PPU Background Address to 0x1000
     //ppu.PPU_CTRL_REG1 = 0b00010000;
     // Wait two frames
@@ -903,63 +3959,3327 @@ int Start() {
     // That's what the cold/warm offsets are for
     // Warm boot check
     for (int digit = 0; digit < TopScoreDisplayLength; digit++) {
-        if (TopScoreDisplay[digit] > 10) {
+        if (gs->TopScoreDisplay[digit] > 10) {
             goto ColdBoot;
             // Cold boot
         }
     }
-    // second checkpoint, check if this location has a specific value
-    if (WarmBootValidation != 0xa5) {
-        // Cold boot
-        goto ColdBoot;
+    // second checkpoint, check if this location has a specific value
+    if (gs->WarmBootValidation != 0xa5) {
+        // Cold boot
+        goto ColdBoot;
+    }
+
+    ColdBoot:
+    // Clear memory
+    // TODO: Tell memory from where until where to clear
+    InitalizeMemory();
+
+    // SND_DELTA_REG
+    gs->OperMode = 0;
+    // Set warm boot flag
+    gs->WarmBootValidation = 0xa5;
+    // Set seed for pseudorandom register
+    gs->PseudoRandomBitReg[0] = 0xa5;
+    // Enable sound except DMC
+    writeAPU(0x4015, 0b00001111);
+    // turn off clipping for OAM and background
+    gs->ppu.PPU_CTRL_REG2 = 0b00000110;
+    // initialize both name tables
+    MoveAllSpritesOffscreen();
+    InitializeNameTables();
+    // set flag to disable screen output
+    gs->DisableScreenFlag++;
+    // Enable NMIs
+    WritePPUReg1(gs->Mirror_PPU_CTRL_REG1 | 0b10000000);
+    gs->frameNumber = 0;
+    gs->timeline = newTimeline();
+    return 0;
+}
+
+// Frames per second counter
+// Gets updated at most once a second, so it's cheap to poke every frame
+struct FPSCounter {
+    uint64_t totalFrames;
+    uint64_t windowFrames;
+    uint64_t windowStart;
+    double fps;
+};
+typedef struct FPSCounter FPSCounter;
+
+THREAD_LOCAL FPSCounter fpsCounter;
+
+int updateFPSCounter(FPSCounter * _counter, int frames) {
+    uint64_t now = getTimeNanoseconds();
+    if (!_counter->windowStart) {
+        _counter->windowStart = now;
+    }
+    _counter->totalFrames += frames;
+    _counter->windowFrames += frames;
+    if (now - _counter->windowStart >= 1000000000ull) {
+        _counter->fps = (double)_counter->windowFrames * 1000000000.0 / (double)(now - _counter->windowStart);
+        _counter->windowFrames = 0;
+        _counter->windowStart = now;
+    }
+    return 0;
+}
+
+double smb_fps() {
+    return fpsCounter.fps;
+}
+
+// Headless frame stepping
+// Runs exactly n_frames frames as fast as the CPU allows, no window and no waiting on VBlank.
+// input is latched into the first controller port for every one of them.
+// Call Reset() once before the first step.
+int smb_step(int n_frames, byte input) {
+    int frame;
+    for (frame = 0; frame < n_frames; frame++) {
+        gs->JOYPAD_PORT1 = input;
+        gs->frameNumber++;
+        memset(gs->dirtyTiles, 0, sizeof(gs->dirtyTiles));
+        gs->apuWriteCount = 0;
+        // Pretend the PPU just entered VBlank
+        gs->ppu.PPU_STATUS |= 0b10000000;
+        if (gs->ppu.PPU_CTRL_REG1 & 0b10000000) {
+            NonMaskableInterrupt();
+        }
+        // The overflow flag comes from drawing this frame, so the game sees it during the next VBlank
+        if (gs->spriteLimit && spriteOverflow(gs)) {
+            gs->ppu.PPU_STATUS |= 0b00100000;
+        } else {
+            gs->ppu.PPU_STATUS &= 0b11011111;
+        }
+    }
+    updateFPSCounter(&fpsCounter, frame);
+    return frame;
+}
+
+// State hashing
+// A 64 bit fingerprint of everything the game keeps in RAM plus the PPU, both name tables,
+// the attributes and the sprites in use. The bookkeeping at the end of GameState is left out,
+// so two builds (or two machines) running the same inputs end up with the same hashes.
+//
+// The hash eats 32 bytes at a time into four independent 64 bit lanes using 32x32->64 bit
+// multiplies, which is exactly what SSE2's pmuludq does two lanes at a time.
+// The name tables get hashed row by row, so a hasher that saw the previous frame only needs
+// to redo the rows in dirtyTiles, see updateStateHash().
+#define HashStripeSize 32
+// Lanes get scrambled after this many stripes so the multiplies can't cancel each other out
+#define HashStripesPerBlock 16
+#define HashPrime32 0x9e3779b1u
+#define HashPrime64_1 0x9e3779b185ebca87ull
+#define HashPrime64_2 0xc2b2ae3d27d4eb4full
+#define HashPrime64_3 0x165667b19e3779f9ull
+
+const uint64_t HashKeys[4] = {
+    0xbe4ba423396cfeb8ull, 0x1cad21f72c81017cull, 0xdb979083e96dd4deull, 0x1f67b3b7a4a44072ull
+};
+
+// Bytes are read little endian, which is what every machine this runs on is
+uint64_t readLittle64(const byte * data) {
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+int hashStripe(uint64_t * _lanes, const byte * stripe) {
+#if defined(__SSE2__)
+    for (int lane = 0; lane < 4; lane += 2) {
+        __m128i data = _mm_loadu_si128((const __m128i *)(stripe + lane * 8));
+        __m128i keyed = _mm_xor_si128(data, _mm_loadu_si128((const __m128i *)&HashKeys[lane]));
+        __m128i product = _mm_mul_epu32(keyed, _mm_srli_epi64(keyed, 32));
+        __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+        __m128i lanes = _mm_loadu_si128((const __m128i *)&_lanes[lane]);
+        _mm_storeu_si128((__m128i *)&_lanes[lane], _mm_add_epi64(lanes, _mm_add_epi64(product, swapped)));
+    }
+#else
+    for (int lane = 0; lane < 4; lane++) {
+        uint64_t keyed = readLittle64(stripe + lane * 8) ^ HashKeys[lane];
+        // Every lane also gets its neighbours data, so nothing is lost when a multiply hits zero
+        _lanes[lane] += (keyed & 0xffffffffu) * (keyed >> 32) + readLittle64(stripe + (lane ^ 1) * 8);
+    }
+#endif
+    return 0;
+}
+
+int scrambleLanes(uint64_t * _lanes) {
+    for (int lane = 0; lane < 4; lane++) {
+        _lanes[lane] ^= _lanes[lane] >> 47;
+        _lanes[lane] ^= HashKeys[lane];
+        _lanes[lane] *= HashPrime32;
+    }
+    return 0;
+}
+
+uint64_t avalancheHash(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= HashPrime64_2;
+    hash ^= hash >> 29;
+    hash *= HashPrime64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// Hashes size bytes, starting from seed. Feeding one hash in as the next ones seed chains them.
+uint64_t hashBytes(uint64_t seed, const void * data, size_t size) {
+    const byte * bytes = (const byte *)data;
+    uint64_t lanes[4] = { seed + HashPrime64_1, seed ^ HashPrime64_2, seed - HashPrime64_3, ~seed };
+    byte tail[HashStripeSize] = { 0 };
+    size_t stripes = size / HashStripeSize;
+    uint64_t hash;
+    for (size_t stripe = 0; stripe < stripes; stripe++) {
+        hashStripe(lanes, bytes + stripe * HashStripeSize);
+        if (stripe % HashStripesPerBlock == HashStripesPerBlock - 1) {
+            scrambleLanes(lanes);
+        }
+    }
+    if (size % HashStripeSize) {
+        memcpy(tail, bytes + stripes * HashStripeSize, size % HashStripeSize);
+        hashStripe(lanes, tail);
+    }
+    hash = (uint64_t)size * HashPrime64_1;
+    for (int lane = 0; lane < 4; lane++) {
+        hash = (hash ^ avalancheHash(lanes[lane])) * HashPrime64_1 + HashPrime64_3;
+    }
+    return avalancheHash(hash);
+}
+
+// Keeps one hash per name table row around, so the next frame only has to rehash what changed
+struct StateHasher {
+    uint64_t rows[2][30];
+    // Which frame the rows belong to, like BackgroundLayer
+    byte valid;
+    uint32_t timeline;
+    uint32_t frameNumber;
+    // Rows hashed last time, just for keeping an eye on it
+    int rowsHashed;
+};
+typedef struct StateHasher StateHasher;
+
+// Hash of the given state. If the hasher saw the frame right before this one,
+// only the name table rows marked in dirtyTiles get hashed again.
+// Gives the exact same result as hashState() either way.
+uint64_t updateStateHash(StateHasher * _hasher, const GameState * _state) {
+    int full = !_hasher->valid
+        || _hasher->timeline != _state->timeline
+        || _hasher->frameNumber + 1 != _state->frameNumber;
+    size_t ramStart = offsetof(GameState, ObjectOffset);
+    size_t ramEnd = offsetof(GameState, AltRegContentFlag) + 1;
+    uint64_t hash;
+    _hasher->rowsHashed = 0;
+    if (!(_hasher->valid && _hasher->timeline == _state->timeline && _hasher->frameNumber == _state->frameNumber)) {
+        for (int table = 0; table < 2; table++) {
+            for (int row = 0; row < 30; row++) {
+                if (full || _state->dirtyTiles[table][row]) {
+                    _hasher->rows[table][row] = hashBytes(0, &_state->nameTable[table * 1024 + row * 32], 32);
+                    _hasher->rowsHashed++;
+                }
+            }
+        }
+        _hasher->valid = 1;
+        _hasher->timeline = _state->timeline;
+        _hasher->frameNumber = _state->frameNumber;
+    }
+    hash = hashBytes(0, (const byte *)_state + ramStart, ramEnd - ramStart);
+    hash = hashBytes(hash, &_state->ppu, sizeof(PPU));
+    hash = hashBytes(hash, _hasher->rows, sizeof(_hasher->rows));
+    hash = hashBytes(hash, _state->attributeTable, sizeof(_state->attributeTable));
+    hash = hashBytes(hash, &_state->spriteCount, sizeof(_state->spriteCount));
+    return hashBytes(hash, _state->spriteArray, _state->spriteCount * sizeof(Sprite));
+}
+
+// Hash of the given state from scratch
+uint64_t hashState(const GameState * _state) {
+    StateHasher hasher;
+    memset(&hasher, 0, sizeof(StateHasher));
+    return updateStateHash(&hasher, _state);
+}
+
+THREAD_LOCAL StateHasher stateHasher;
+
+// Hash of the current game, meant to be called once per frame after smb_step()
+uint64_t smb_hash() {
+    return updateStateHash(&stateHasher, gs);
+}
+
+// Controller input
+// Whatever thread watches the keyboard or gamepad pushes button changes into this queue,
+// and the frame loop drains it once at the start of every frame, so the buttons
+// never change halfway through one. There is exactly one producer and one consumer,
+// which means head and tail each only ever get written by one side and no locks are needed.
+#define InputQueueSize 256 // Has to be a power of two
+
+struct InputEvent {
+    byte player;
+    byte buttons;
+};
+typedef struct InputEvent InputEvent;
+
+struct InputQueue {
+    InputEvent events[InputQueueSize];
+    // Written by the producer only
+    uint32_t head;
+    byte headPadding[CACHE_LINE_SIZE - sizeof(uint32_t)];
+    // Written by the consumer only
+    uint32_t tail;
+    byte tailPadding[CACHE_LINE_SIZE - sizeof(uint32_t)];
+    // The latched buttons of both controllers, consumer only
+    byte buttons[2];
+};
+typedef struct InputQueue InputQueue;
+
+InputQueue inputQueue;
+
+// Producer side. Returns -1 if the frame loop has fallen so far behind that the queue is full.
+int pushInput(InputQueue * _queue, byte player, byte buttons) {
+    uint32_t head = __atomic_load_n(&_queue->head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&_queue->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= InputQueueSize) {
+        return -1;
+    }
+    _queue->events[head & (InputQueueSize - 1)].player = player & 1;
+    _queue->events[head & (InputQueueSize - 1)].buttons = buttons;
+    __atomic_store_n(&_queue->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Consumer side, drains everything queued up and puts the result on the controller ports
+int latchInput(InputQueue * _queue) {
+    uint32_t tail = __atomic_load_n(&_queue->tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&_queue->head, __ATOMIC_ACQUIRE);
+    for (; tail != head; tail++) {
+        InputEvent * event = &_queue->events[tail & (InputQueueSize - 1)];
+        _queue->buttons[event->player] = event->buttons;
+    }
+    __atomic_store_n(&_queue->tail, tail, __ATOMIC_RELEASE);
+    gs->JOYPAD_PORT1 = _queue->buttons[0];
+    gs->JOYPAD_PORT2 = _queue->buttons[1];
+    return 0;
+}
+
+// Movies
+// A recording of the controller inputs of a whole run, one byte per player per frame.
+// Inputs hardly ever change from one frame to the next, so they're stored as runs.
+//
+// File layout, all little endian:
+// 0-7: "SMBMOVIE"
+// 8: version
+// 9: number of players (1 or 2)
+// 10-11: unused
+// 12-15: number of frames
+// 16-: runs, each a frame count (1-255) followed by one input byte per player
+#define MovieMagic "SMBMOVIE"
+#define MovieVersion 1
+#define MovieHeaderSize 16
+
+struct Movie {
+    byte players;
+    uint32_t frames;
+    // Just the runs
+    byte * data;
+    size_t size;
+};
+typedef struct Movie Movie;
+
+struct MovieRecorder {
+    FILE * file;
+    byte players;
+    uint32_t frames;
+    // The run being recorded right now
+    byte inputs[2];
+    byte count;
+    // Set once a write failed, stopRecording() reports it
+    byte failed;
+};
+typedef struct MovieRecorder MovieRecorder;
+
+int writeMovieHeader(FILE * file, byte players, uint32_t frames) {
+    byte header[MovieHeaderSize] = { 0 };
+    memcpy(header, MovieMagic, 8);
+    header[8] = MovieVersion;
+    header[9] = players;
+    header[12] = frames & 0xff;
+    header[13] = (frames >> 8) & 0xff;
+    header[14] = (frames >> 16) & 0xff;
+    header[15] = (frames >> 24) & 0xff;
+    return fwrite(header, MovieHeaderSize, 1, file) == 1 ? 0 : -1;
+}
+
+int startRecording(MovieRecorder * _recorder, const char * path, byte players) {
+    memset(_recorder, 0, sizeof(MovieRecorder));
+    _recorder->players = players == 2 ? 2 : 1;
+    _recorder->file = fopen(path, "wb");
+    if (!_recorder->file) {
+        return -1;
+    }
+    // Frame count gets filled in at the end
+    if (writeMovieHeader(_recorder->file, _recorder->players, 0)) {
+        fclose(_recorder->file);
+        _recorder->file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Returns -1 if the run couldn't be written
+int flushMovieRun(MovieRecorder * _recorder) {
+    if (_recorder->count) {
+        if (fputc(_recorder->count, _recorder->file) == EOF
+            || fwrite(_recorder->inputs, 1, _recorder->players, _recorder->file) != _recorder->players) {
+            _recorder->failed = 1;
+        }
+        _recorder->count = 0;
+    }
+    return _recorder->failed ? -1 : 0;
+}
+
+// Records the inputs of one frame. Returns -1 once writing the movie failed.
+int recordFrame(MovieRecorder * _recorder, byte input1, byte input2) {
+    if (_recorder->players == 1) {
+        input2 = 0;
+    }
+    if (_recorder->count == 255 || (_recorder->count && (_recorder->inputs[0] != input1 || _recorder->inputs[1] != input2))) {
+        flushMovieRun(_recorder);
+    }
+    _recorder->inputs[0] = input1;
+    _recorder->inputs[1] = input2;
+    _recorder->count++;
+    _recorder->frames++;
+    return _recorder->failed ? -1 : 0;
+}
+
+// Finishes the movie and closes it either way.
+// Returns -1 if anything about it couldn't be written, the file is incomplete then.
+int stopRecording(MovieRecorder * _recorder) {
+    int result;
+    if (!_recorder->file) {
+        return -1;
+    }
+    flushMovieRun(_recorder);
+    result = _recorder->failed
+        || fseek(_recorder->file, 0, SEEK_SET)
+        || writeMovieHeader(_recorder->file, _recorder->players, _recorder->frames);
+    if (fclose(_recorder->file)) {
+        result = 1;
+    }
+    memset(_recorder, 0, sizeof(MovieRecorder));
+    return result ? -1 : 0;
+}
+
+int freeMovie(Movie * _movie) {
+    free(_movie->data);
+    memset(_movie, 0, sizeof(Movie));
+    return 0;
+}
+
+int loadMovie(Movie * _movie, const char * path) {
+    byte header[MovieHeaderSize];
+    long size;
+    FILE * file = fopen(path, "rb");
+    memset(_movie, 0, sizeof(Movie));
+    if (!file) {
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size < MovieHeaderSize || fread(header, MovieHeaderSize, 1, file) != 1
+        || memcmp(header, MovieMagic, 8) || header[8] != MovieVersion || (header[9] != 1 && header[9] != 2)) {
+        fclose(file);
+        return -1;
+    }
+    _movie->players = header[9];
+    _movie->frames = header[12] | (header[13] << 8) | (header[14] << 16) | ((uint32_t)header[15] << 24);
+    _movie->size = (size_t)size - MovieHeaderSize;
+    _movie->data = malloc(_movie->size ? _movie->size : 1);
+    if (!_movie->data || fread(_movie->data, 1, _movie->size, file) != _movie->size) {
+        fclose(file);
+        freeMovie(_movie);
+        return -1;
+    }
+    fclose(file);
+    return 0;
+}
+
+// Plays a whole movie back on the current game as fast as possible.
+// Every run is a single smb_step() call, so there's no per frame cost on top of the game itself.
+// With a hash stream the state hash of every frame gets written to it instead, one per line
+// in hex, so the streams of two builds can simply be diffed. Line n is frame n.
+// Returns the amount of frames played.
+long playMovie(const Movie * _movie, FILE * _hashStream) {
+    size_t offset = 0;
+    long frames = 0;
+    size_t runSize = 1 + _movie->players;
+    while (offset + runSize <= _movie->size) {
+        const byte * run = _movie->data + offset;
+        gs->JOYPAD_PORT2 = _movie->players == 2 ? run[2] : 0;
+        if (_hashStream) {
+            for (int frame = 0; frame < run[0]; frame++) {
+                frames += smb_step(1, run[1]);
+                fprintf(_hashStream, "%016llx\n", (unsigned long long)smb_hash());
+            }
+        } else {
+            frames += smb_step(run[0], run[1]);
+        }
+        offset += runSize;
+    }
+    return frames;
+}
+
+// Frame pacing
+// Keeps the game at the speed of a real NES without burning a whole core.
+// Every frame has an absolute deadline, we sleep until just before it and only
+// spin for the last little bit, since sleeps tend to oversleep a little.
+#define NTSC_FrameRate 60.0988
+#define PAL_FrameRate 50.0070
+#define PacerSpinNanoseconds 200000ull
+
+#if defined(_WIN32) && !defined(CREATE_WAITABLE_TIMER_HIGH_RESOLUTION)
+    #define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+struct FramePacer {
+    uint64_t frameNanoseconds;
+    uint64_t deadline;
+#ifdef _WIN32
+    HANDLE timer;
+#endif
+
+    // Jitter statistics, how late we woke up compared to the deadline
+    uint64_t frames;
+    uint64_t missedFrames;
+    double latenessSum;
+    double latenessSquaredSum;
+    int64_t latenessMin;
+    int64_t latenessMax;
+};
+typedef struct FramePacer FramePacer;
+
+int initFramePacer(FramePacer * _pacer, double frameRate) {
+    memset(_pacer, 0, sizeof(FramePacer));
+    _pacer->frameNanoseconds = (uint64_t)(1000000000.0 / frameRate);
+    _pacer->deadline = getTimeNanoseconds() + _pacer->frameNanoseconds;
+    _pacer->latenessMin = INT64_MAX;
+    _pacer->latenessMax = INT64_MIN;
+#ifdef _WIN32
+    _pacer->timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    if (!_pacer->timer) {
+        // Older Windows, the plain kind will have to do
+        _pacer->timer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
+    }
+#endif
+    return 0;
+}
+
+int freeFramePacer(FramePacer * _pacer) {
+#ifdef _WIN32
+    if (_pacer->timer) {
+        CloseHandle(_pacer->timer);
+    }
+#endif
+    memset(_pacer, 0, sizeof(FramePacer));
+    return 0;
+}
+
+// Sleeps until the given time, or a bit before it
+int sleepUntil(FramePacer * _pacer, uint64_t wakeUp) {
+#ifdef _WIN32
+    uint64_t now = getTimeNanoseconds();
+    LARGE_INTEGER dueTime;
+    if (wakeUp <= now) {
+        return 0;
+    }
+    // Negative means relative, in 100ns steps
+    dueTime.QuadPart = -(LONGLONG)((wakeUp - now) / 100);
+    if (_pacer->timer && SetWaitableTimer(_pacer->timer, &dueTime, 0, NULL, NULL, FALSE)) {
+        WaitForSingleObject(_pacer->timer, INFINITE);
+    } else {
+        Sleep((DWORD)((wakeUp - now) / 1000000));
+    }
+#else
+    struct timespec target;
+    (void)_pacer;
+    target.tv_sec = (time_t)(wakeUp / 1000000000ull);
+    target.tv_nsec = (long)(wakeUp % 1000000000ull);
+    // Absolute, so it doesn't matter how long it took us to get here
+    // It returns the error instead of setting errno. Only a signal is worth another try,
+    // anything else would just fail again.
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, NULL) == EINTR) {
+        // Interrupted by a signal, go back to sleep
+    }
+#endif
+    return 0;
+}
+
+// Waits for the next frame to begin, our stand in for VBlank
+int waitForNextFrame(FramePacer * _pacer) {
+    uint64_t now = getTimeNanoseconds();
+    int64_t lateness;
+    if (now + PacerSpinNanoseconds < _pacer->deadline) {
+        sleepUntil(_pacer, _pacer->deadline - PacerSpinNanoseconds);
+    }
+    do {
+        now = getTimeNanoseconds();
+    } while (now < _pacer->deadline);
+
+    lateness = (int64_t)(now - _pacer->deadline);
+    _pacer->frames++;
+    _pacer->latenessSum += (double)lateness;
+    _pacer->latenessSquaredSum += (double)lateness * (double)lateness;
+    if (lateness < _pacer->latenessMin) {
+        _pacer->latenessMin = lateness;
+    }
+    if (lateness > _pacer->latenessMax) {
+        _pacer->latenessMax = lateness;
+    }
+
+    _pacer->deadline += _pacer->frameNanoseconds;
+    // Fell more than a frame behind (debugger, laptop lid, ...), don't try to catch up
+    if (now > _pacer->deadline) {
+        _pacer->missedFrames += (now - _pacer->deadline) / _pacer->frameNanoseconds + 1;
+        _pacer->deadline = now + _pacer->frameNanoseconds;
+    }
+    return 0;
+}
+
+int printFramePacerStats(FramePacer * _pacer) {
+    double mean, variance;
+    if (!_pacer->frames) {
+        return 0;
+    }
+    mean = _pacer->latenessSum / (double)_pacer->frames;
+    variance = _pacer->latenessSquaredSum / (double)_pacer->frames - mean * mean;
+    printf("%llu frames at %.4f Hz, %llu missed\n", (unsigned long long)_pacer->frames,
+        1000000000.0 / (double)_pacer->frameNanoseconds, (unsigned long long)_pacer->missedFrames);
+    printf("Wake up lateness: mean %.2fus, stddev %.2fus, min %.2fus, max %.2fus\n", mean / 1000.0,
+        variance > 0 ? sqrt(variance) / 1000.0 : 0.0, (double)_pacer->latenessMin / 1000.0, (double)_pacer->latenessMax / 1000.0);
+    return 0;
+}
+
+// Save states
+// Since everything lives in GameState, a save state is just a copy of it
+int smb_save_state(GameState * _out) {
+    memcpy(_out, gs, sizeof(GameState));
+    return 0;
+}
+
+int smb_load_state(const GameState * _in) {
+    memcpy(gs, _in, sizeof(GameState));
+    gs->timeline = newTimeline();
+    return 0;
+}
+
+// Rewind
+// Keeps the last few seconds of frames around in a ring buffer.
+// Only the newest state is stored whole, every older frame is stored as the
+// XOR between it and the frame after it, with runs of zeroes squashed out.
+// Most of the state doesn't change from frame to frame, so those end up tiny.
+// Stepping back is just XORing the newest delta back onto the newest state.
+//
+// Delta format, repeated until the end of the entry:
+// word: amount of unchanged bytes to skip
+// word: amount of changed bytes following
+// byte[]: the changed bytes, XORed with the newer frame
+#define REWIND_FRAMES_PER_SECOND 60
+#define REWIND_MAX_DELTA_SIZE (sizeof(GameState) + (sizeof(GameState) / 2 + 1) * 2 * sizeof(word))
+
+struct RewindEntry {
+    size_t offset;
+    size_t length;
+};
+typedef struct RewindEntry RewindEntry;
+
+struct RewindBuffer {
+    GameState newest;
+    byte hasNewest;
+
+    // Compressed deltas live in here back to back, wrapping around at the end
+    byte * data;
+    size_t capacity;
+    size_t writePosition;
+
+    // One entry per stored frame, oldest at tail
+    RewindEntry * entries;
+    int maxEntries;
+    int tail;
+    int count;
+
+    byte * scratch;
+};
+typedef struct RewindBuffer RewindBuffer;
+
+int freeRewindBuffer(RewindBuffer * _rewind) {
+    free(_rewind->data);
+    free(_rewind->entries);
+    free(_rewind->scratch);
+    memset(_rewind, 0, sizeof(RewindBuffer));
+    return 0;
+}
+
+// Sets up a rewind buffer holding up to the given amount of seconds.
+// bytesPerFrame is a guess at the average compressed delta size, it only decides how big the data buffer gets.
+int initRewindBuffer(RewindBuffer * _rewind, int seconds, size_t bytesPerFrame) {
+    memset(_rewind, 0, sizeof(RewindBuffer));
+    _rewind->maxEntries = seconds * REWIND_FRAMES_PER_SECOND;
+    _rewind->capacity = (size_t)_rewind->maxEntries * bytesPerFrame;
+    if (_rewind->capacity < REWIND_MAX_DELTA_SIZE) {
+        _rewind->capacity = REWIND_MAX_DELTA_SIZE;
+    }
+    _rewind->data = malloc(_rewind->capacity);
+    _rewind->entries = malloc(sizeof(RewindEntry) * _rewind->maxEntries);
+    _rewind->scratch = malloc(REWIND_MAX_DELTA_SIZE);
+    if (!_rewind->data || !_rewind->entries || !_rewind->scratch) {
+        freeRewindBuffer(_rewind);
+        return -1;
+    }
+    return 0;
+}
+
+// XORs newer against older and run-length encodes the result into _out.
+// Returns the size of the encoded delta.
+size_t encodeStateDelta(const byte * older, const byte * newer, size_t size, byte * _out) {
+    size_t position = 0;
+    size_t outSize = 0;
+    while (position < size) {
+        size_t skip = position;
+        size_t changed;
+        word run;
+        while (skip < size && skip - position < 0xffff && older[skip] == newer[skip]) {
+            skip++;
+        }
+        changed = skip;
+        while (changed < size && changed - skip < 0xffff && older[changed] != newer[changed]) {
+            changed++;
+        }
+        run = (word)(skip - position);
+        memcpy(_out + outSize, &run, sizeof(word));
+        outSize += sizeof(word);
+        run = (word)(changed - skip);
+        memcpy(_out + outSize, &run, sizeof(word));
+        outSize += sizeof(word);
+        for (; skip < changed; skip++) {
+            _out[outSize++] = older[skip] ^ newer[skip];
+        }
+        position = changed;
+    }
+    return outSize;
+}
+
+// Applies a delta made by encodeStateDelta(). XOR goes both ways,
+// so this turns the newer state back into the older one.
+int applyStateDelta(byte * _state, const byte * delta, size_t length) {
+    size_t position = 0;
+    size_t offset = 0;
+    while (offset < length) {
+        word skip, changed;
+        memcpy(&skip, delta + offset, sizeof(word));
+        offset += sizeof(word);
+        memcpy(&changed, delta + offset, sizeof(word));
+        offset += sizeof(word);
+        position += skip;
+        while (changed--) {
+            _state[position++] ^= delta[offset++];
+        }
+    }
+    return 0;
+}
+
+int dropOldestRewindEntry(RewindBuffer * _rewind) {
+    _rewind->tail = (_rewind->tail + 1) % _rewind->maxEntries;
+    _rewind->count--;
+    return 0;
+}
+
+// Stores the current game state as the newest frame
+int pushRewindFrame(RewindBuffer * _rewind) {
+    size_t length;
+    RewindEntry * entry;
+    if (!_rewind->hasNewest) {
+        smb_save_state(&_rewind->newest);
+        _rewind->hasNewest = 1;
+        return 0;
+    }
+    length = encodeStateDelta((const byte *)gs, (const byte *)&_rewind->newest, sizeof(GameState), _rewind->scratch);
+    if (_rewind->count == _rewind->maxEntries) {
+        dropOldestRewindEntry(_rewind);
+    }
+    // Doesn't fit at the end, so wrap around.
+    // Whatever is still left at the end is the oldest stuff we have, so it goes.
+    if (_rewind->writePosition + length > _rewind->capacity) {
+        while (_rewind->count && _rewind->entries[_rewind->tail].offset >= _rewind->writePosition) {
+            dropOldestRewindEntry(_rewind);
+        }
+        _rewind->writePosition = 0;
+    }
+    // Make room by dropping the oldest frames we'd be writing over
+    while (_rewind->count
+        && _rewind->entries[_rewind->tail].offset >= _rewind->writePosition
+        && _rewind->entries[_rewind->tail].offset < _rewind->writePosition + length) {
+        dropOldestRewindEntry(_rewind);
+    }
+    memcpy(_rewind->data + _rewind->writePosition, _rewind->scratch, length);
+    entry = &_rewind->entries[(_rewind->tail + _rewind->count) % _rewind->maxEntries];
+    entry->offset = _rewind->writePosition;
+    entry->length = length;
+    _rewind->count++;
+    _rewind->writePosition += length;
+    smb_save_state(&_rewind->newest);
+    return 0;
+}
+
+// Goes back one frame and loads it into the game.
+// Returns -1 if there's nothing left to rewind to.
+int popRewindFrame(RewindBuffer * _rewind) {
+    RewindEntry * entry;
+    if (!_rewind->count) {
+        return -1;
+    }
+    _rewind->count--;
+    entry = &_rewind->entries[(_rewind->tail + _rewind->count) % _rewind->maxEntries];
+    applyStateDelta((byte *)&_rewind->newest, _rewind->data + entry->offset, entry->length);
+    // The space this frame used is free again
+    _rewind->writePosition = entry->offset;
+    smb_load_state(&_rewind->newest);
+    return 0;
+}
+
+// Threads
+// Just enough of a wrapper to get going on both Windows and Linux
+#ifdef _WIN32
+    typedef HANDLE Thread;
+#else
+    typedef pthread_t Thread;
+#endif
+typedef void (*ThreadFunction)(void * argument);
+
+struct ThreadStart {
+    ThreadFunction function;
+    void * argument;
+};
+typedef struct ThreadStart ThreadStart;
+
+#ifdef _WIN32
+DWORD WINAPI threadEntry(LPVOID _start) {
+    ThreadStart start = *(ThreadStart *)_start;
+    free(_start);
+    start.function(start.argument);
+    return 0;
+}
+#else
+void * threadEntry(void * _start) {
+    ThreadStart start = *(ThreadStart *)_start;
+    free(_start);
+    start.function(start.argument);
+    return NULL;
+}
+#endif
+
+int startThread(Thread * _thread, ThreadFunction function, void * argument) {
+    ThreadStart * start = malloc(sizeof(ThreadStart));
+    if (!start) {
+        return -1;
+    }
+    start->function = function;
+    start->argument = argument;
+#ifdef _WIN32
+    *_thread = CreateThread(NULL, 0, threadEntry, start, 0, NULL);
+    if (!*_thread) {
+        free(start);
+        return -1;
+    }
+#else
+    if (pthread_create(_thread, NULL, threadEntry, start)) {
+        free(start);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+int joinThread(Thread thread) {
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+    return 0;
+}
+
+int yieldThread() {
+#ifdef _WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+    return 0;
+}
+
+int getCoreCount() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (int)cores : 1;
+#endif
+}
+
+// Counting semaphore, for when a thread really has to sleep until another one is done
+struct Semaphore {
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_mutex_t mutex;
+    pthread_cond_t condition;
+    int count;
+#endif
+};
+typedef struct Semaphore Semaphore;
+
+int initSemaphore(Semaphore * _semaphore, int count) {
+#ifdef _WIN32
+    _semaphore->handle = CreateSemaphoreW(NULL, count, 0x7fffffff, NULL);
+    return _semaphore->handle ? 0 : -1;
+#else
+    _semaphore->count = count;
+    if (pthread_mutex_init(&_semaphore->mutex, NULL)) {
+        return -1;
+    }
+    if (pthread_cond_init(&_semaphore->condition, NULL)) {
+        pthread_mutex_destroy(&_semaphore->mutex);
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+int freeSemaphore(Semaphore * _semaphore) {
+#ifdef _WIN32
+    CloseHandle(_semaphore->handle);
+#else
+    pthread_cond_destroy(&_semaphore->condition);
+    pthread_mutex_destroy(&_semaphore->mutex);
+#endif
+    return 0;
+}
+
+int waitSemaphore(Semaphore * _semaphore) {
+#ifdef _WIN32
+    WaitForSingleObject(_semaphore->handle, INFINITE);
+#else
+    pthread_mutex_lock(&_semaphore->mutex);
+    while (!_semaphore->count) {
+        pthread_cond_wait(&_semaphore->condition, &_semaphore->mutex);
+    }
+    _semaphore->count--;
+    pthread_mutex_unlock(&_semaphore->mutex);
+#endif
+    return 0;
+}
+
+int postSemaphore(Semaphore * _semaphore) {
+#ifdef _WIN32
+    ReleaseSemaphore(_semaphore->handle, 1, NULL);
+#else
+    pthread_mutex_lock(&_semaphore->mutex);
+    _semaphore->count++;
+    pthread_cond_signal(&_semaphore->condition);
+    pthread_mutex_unlock(&_semaphore->mutex);
+#endif
+    return 0;
+}
+
+// UDP sockets
+// Just enough to send datagrams between ports on this machine, nothing ever blocks
+#ifdef _WIN32
+    typedef SOCKET SocketHandle;
+    #define InvalidSocket INVALID_SOCKET
+    #define closeSocketHandle closesocket
+#else
+    typedef int SocketHandle;
+    #define InvalidSocket -1
+    #define closeSocketHandle close
+#endif
+
+struct UDPSocket {
+    SocketHandle handle;
+    // The port we ended up on, handy when asking for port 0
+    word port;
+};
+typedef struct UDPSocket UDPSocket;
+
+// Opens a socket on the loopback address. Port 0 picks any free one.
+int openUDPSocket(UDPSocket * _socket, word port) {
+    struct sockaddr_in address;
+#ifdef _WIN32
+    WSADATA data;
+    u_long nonBlocking = 1;
+    int addressSize = sizeof(address);
+    if (WSAStartup(MAKEWORD(2, 2), &data)) {
+        return -1;
+    }
+#else
+    socklen_t addressSize = sizeof(address);
+#endif
+    _socket->handle = socket(AF_INET, SOCK_DGRAM, 0);
+    if (_socket->handle == InvalidSocket) {
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (bind(_socket->handle, (struct sockaddr *)&address, sizeof(address))
+        || getsockname(_socket->handle, (struct sockaddr *)&address, &addressSize)
+#ifdef _WIN32
+        || ioctlsocket(_socket->handle, FIONBIO, &nonBlocking)
+#else
+        || fcntl(_socket->handle, F_SETFL, fcntl(_socket->handle, F_GETFL) | O_NONBLOCK)
+#endif
+        ) {
+        closeSocketHandle(_socket->handle);
+        return -1;
+    }
+    _socket->port = ntohs(address.sin_port);
+    return 0;
+}
+
+int closeUDPSocket(UDPSocket * _socket) {
+    closeSocketHandle(_socket->handle);
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return 0;
+}
+
+// Sends size bytes to the given port on this machine
+int sendUDP(UDPSocket * _socket, word port, const byte * data, int size) {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    return sendto(_socket->handle, (const char *)data, size, 0, (struct sockaddr *)&address, sizeof(address)) == size ? 0 : -1;
+}
+
+// Returns the size of the next datagram waiting, or -1 if there isn't one
+int receiveUDP(UDPSocket * _socket, byte * _data, int capacity) {
+    int size = (int)recvfrom(_socket->handle, (char *)_data, capacity, 0, NULL, NULL);
+    return size < 0 ? -1 : size;
+}
+
+// Render pipeline
+// Game logic and rendering overlap: at the end of a frame the game publishes a snapshot
+// of its state and moves straight on to the next frame, while the render thread draws
+// the snapshot. There are two snapshot slots, so the game can fill one while the other
+// gets drawn, and it only ever has to wait if the renderer is a whole frame behind.
+// That keeps the picture at most one frame behind the game.
+//
+// A snapshot is a copy of the whole GameState. Only the name tables, attributes, sprites,
+// scroll, palette and the dirty tiles matter to the renderer, but the renderer already takes
+// a GameState. That's about 12KB (sizeof(GameState) is 12,164 bytes right now) copied
+// once a frame, a few microseconds next to drawing the 61,440 pixels of the frame.
+#define RenderPipelineSlots 2
+
+// Gets every finished frame, on the render thread
+typedef void (*FramePresenter)(const Framebuffer * frame, void * argument);
+
+struct RenderPipeline {
+    GameState snapshots[RenderPipelineSlots];
+    Renderer renderer;
+    Framebuffer frame;
+    FramePresenter present;
+    void * presentArgument;
+    // Slots the game can write into, and slots waiting to be drawn
+    Semaphore freeSlots;
+    Semaphore readySlots;
+    Thread thread;
+    byte threaded;
+    byte stopping;
+    // Only the game touches published, only the renderer touches rendered
+    uint64_t published;
+    uint64_t rendered;
+    uint64_t renderNanoseconds;
+};
+typedef struct RenderPipeline RenderPipeline;
+
+int renderSnapshot(RenderPipeline * _pipeline, const GameState * _snapshot) {
+    uint64_t start = getTimeNanoseconds();
+    renderFrame(&_pipeline->renderer, _snapshot, &_pipeline->frame);
+    if (_pipeline->present) {
+        _pipeline->present(&_pipeline->frame, _pipeline->presentArgument);
+    }
+    _pipeline->renderNanoseconds += getTimeNanoseconds() - start;
+    _pipeline->rendered++;
+    return 0;
+}
+
+void renderPipelineThread(void * _pipeline) {
+    RenderPipeline * pipeline = _pipeline;
+    for (;;) {
+        waitSemaphore(&pipeline->readySlots);
+        // Stopping posts one extra time once everything has been published
+        if (pipeline->stopping && pipeline->rendered == pipeline->published) {
+            break;
+        }
+        renderSnapshot(pipeline, &pipeline->snapshots[pipeline->rendered % RenderPipelineSlots]);
+        postSemaphore(&pipeline->freeSlots);
+    }
+}
+
+// present can be NULL if the frames don't need to go anywhere.
+// If there's no thread to be had everything still works, just without the overlap.
+RenderPipeline * startRenderPipeline(FramePresenter present, void * argument) {
+    RenderPipeline * pipeline = calloc(1, sizeof(RenderPipeline));
+    if (!pipeline) {
+        return NULL;
+    }
+    pipeline->present = present;
+    pipeline->presentArgument = argument;
+    if (initSemaphore(&pipeline->freeSlots, RenderPipelineSlots)) {
+        free(pipeline);
+        return NULL;
+    }
+    if (initSemaphore(&pipeline->readySlots, 0)) {
+        freeSemaphore(&pipeline->freeSlots);
+        free(pipeline);
+        return NULL;
+    }
+    pipeline->threaded = !startThread(&pipeline->thread, renderPipelineThread, pipeline);
+    return pipeline;
+}
+
+// Hands the current frame of gs over to be drawn
+int publishFrame(RenderPipeline * _pipeline) {
+    GameState * snapshot;
+    if (!_pipeline->threaded) {
+        renderSnapshot(_pipeline, gs);
+        _pipeline->published++;
+        return 0;
+    }
+    waitSemaphore(&_pipeline->freeSlots);
+    snapshot = &_pipeline->snapshots[_pipeline->published % RenderPipelineSlots];
+    memcpy(snapshot, gs, sizeof(GameState));
+    _pipeline->published++;
+    postSemaphore(&_pipeline->readySlots);
+    return 0;
+}
+
+// Draws whatever is still waiting, then shuts the render thread down
+int stopRenderPipeline(RenderPipeline * _pipeline) {
+    if (_pipeline->threaded) {
+        _pipeline->stopping = 1;
+        postSemaphore(&_pipeline->readySlots);
+        joinThread(_pipeline->thread);
+    }
+    freeSemaphore(&_pipeline->freeSlots);
+    freeSemaphore(&_pipeline->readySlots);
+    free(_pipeline);
+    return 0;
+}
+
+// Scaled output
+// Turns the indexed NES picture into RGBA at whatever size the window wants, in one go:
+// every target row is scaled straight out of the source row it comes from, so there's never
+// a full size picture in between. Neighbouring target rows that come from the same source row
+// (most of them when scaling up) are just copies of the row above.
+//
+// The target gets split into horizontal strips, which a small pool of threads take turns on.
+//
+// Modes:
+// - Stretch fills the whole target, nearest neighbour
+// - Integer scales by the biggest whole factor that fits and centers the picture, crisp pixels
+// - Bilinear fills the whole target, smoothed
+// Pixels are R, G, B, A in memory. Emphasis bits aren't applied yet.
+#define ScalerMaxThreads 16
+// Strips per thread, so threads that finish early can help out with the rest
+#define ScalerStripsPerThread 4
+#define OpaqueBlack 0xff000000u
+
+enum ScaleMode {
+    ScaleMode_Stretch,
+    ScaleMode_Integer,
+    ScaleMode_Bilinear
+};
+
+struct Scaler {
+    int width;
+    int height;
+    enum ScaleMode mode;
+    // Where the picture goes inside the target, the rest is black
+    int left;
+    int top;
+    int scaledWidth;
+    int scaledHeight;
+    // Integer mode only
+    int factor;
+    // Source column/row of every target column/row. sourceY is 8.8 fixed point for bilinear,
+    // sourceX is the left neighbour then and its fraction goes into weightX.
+    int32_t * sourceX;
+    int32_t * sourceY;
+    // Bilinear only, weight (0-255) of the right neighbour of every target column,
+    // in both 16 bit halves so it lines up with the channels once unpacked
+    uint32_t * weightX;
+    // NESPalette as RGBA
+    uint32_t rgba[64];
+
+    // Current job
+    const Framebuffer * frame;
+    uint32_t * target;
+    int pitch;
+    uint32_t nextStrip;
+    int stripCount;
+
+    // Thread pool, the thread calling scaleFrame() helps out too
+    Thread threads[ScalerMaxThreads];
+    int threadCount;
+    Semaphore work;
+    Semaphore finished;
+    byte stopping;
+};
+typedef struct Scaler Scaler;
+
+// Looks up count source pixels in RGBA
+void indexedToRGBA(const Scaler * _scaler, const byte * source, int count, uint32_t * _out) {
+    for (int pixel = 0; pixel < count; pixel++) {
+        _out[pixel] = _scaler->rgba[source[pixel] & 0x3f];
+    }
+}
+
+int fillRow(uint32_t * _row, int count, uint32_t color) {
+    for (int pixel = 0; pixel < count; pixel++) {
+        _row[pixel] = color;
+    }
+    return 0;
+}
+
+// Nearest neighbour scaling of one RGBA line into count pixels
+void scaleLineNearest(const uint32_t * line, const int32_t * sourceX, int count, uint32_t * _out) {
+    int pixel = 0;
+#if defined(__AVX2__)
+    // The line is only 1KB, so gathering from it stays in L1
+    for (; pixel + 8 <= count; pixel += 8) {
+        __m256i indices = _mm256_loadu_si256((const __m256i *)(sourceX + pixel));
+        _mm256_storeu_si256((__m256i *)(_out + pixel), _mm256_i32gather_epi32((const int *)line, indices, 4));
+    }
+#endif
+    for (; pixel < count; pixel++) {
+        _out[pixel] = line[sourceX[pixel]];
+    }
+}
+
+// Every pixel of a ScreenWidth line repeated factor times
+void scaleLineInteger(const uint32_t * line, int factor, uint32_t * _out) {
+    int pixel = 0;
+#if defined(__SSE2__)
+    if (factor == 2) {
+        for (; pixel + 4 <= ScreenWidth; pixel += 4) {
+            __m128i colors = _mm_loadu_si128((const __m128i *)(line + pixel));
+            _mm_storeu_si128((__m128i *)(_out + pixel * 2), _mm_unpacklo_epi32(colors, colors));
+            _mm_storeu_si128((__m128i *)(_out + pixel * 2 + 4), _mm_unpackhi_epi32(colors, colors));
+        }
+    } else if (factor >= 4) {
+        for (; pixel < ScreenWidth; pixel++) {
+            __m128i color = _mm_set1_epi32((int)line[pixel]);
+            uint32_t * out = _out + pixel * factor;
+            int copy = 0;
+            for (; copy + 4 <= factor; copy += 4) {
+                _mm_storeu_si128((__m128i *)(out + copy), color);
+            }
+            for (; copy < factor; copy++) {
+                out[copy] = line[pixel];
+            }
+        }
+    }
+#endif
+    for (; pixel < ScreenWidth; pixel++) {
+        for (int copy = 0; copy < factor; copy++) {
+            _out[pixel * factor + copy] = line[pixel];
+        }
+    }
+}
+
+// Mixes two RGBA lines, weight (0-256) of the second one
+void blendLines(const uint32_t * first, const uint32_t * second, int weight, int count, uint32_t * _out) {
+    int pixel = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i firstWeight = _mm_set1_epi16((short)(256 - weight));
+    const __m128i secondWeight = _mm_set1_epi16((short)weight);
+    for (; pixel + 4 <= count; pixel += 4) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(first + pixel));
+        __m128i b = _mm_loadu_si128((const __m128i *)(second + pixel));
+        // 255 * 256 still fits into 16 bits, so the channels can't overflow
+        __m128i low = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), firstWeight),
+                                    _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), secondWeight));
+        __m128i high = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), firstWeight),
+                                     _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), secondWeight));
+        _mm_storeu_si128((__m128i *)(_out + pixel), _mm_packus_epi16(_mm_srli_epi16(low, 8), _mm_srli_epi16(high, 8)));
+    }
+#endif
+    for (; pixel < count; pixel++) {
+        uint32_t result = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+            uint32_t channel = (((first[pixel] >> shift) & 0xff) * (256 - weight) + ((second[pixel] >> shift) & 0xff) * weight) >> 8;
+            result |= channel << shift;
+        }
+        _out[pixel] = result;
+    }
+}
+
+// Mixes two RGBA pixels of each of 4 target pixels with the weights of the right ones,
+// as unpacked by scaleLineBilinear(). The low half has the first two pixels, the high one the others.
+#if defined(__AVX2__)
+__m256i blendPixelPairs256(__m256i left, __m256i right, __m256i weights) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i whole = _mm256_set1_epi16(256);
+    __m256i lowWeights = _mm256_unpacklo_epi32(weights, weights);
+    __m256i highWeights = _mm256_unpackhi_epi32(weights, weights);
+    // Same as blendLines(), 255 * 256 still fits into 16 bits
+    __m256i low = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(left, zero), _mm256_sub_epi16(whole, lowWeights)),
+                                   _mm256_mullo_epi16(_mm256_unpacklo_epi8(right, zero), lowWeights));
+    __m256i high = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(left, zero), _mm256_sub_epi16(whole, highWeights)),
+                                    _mm256_mullo_epi16(_mm256_unpackhi_epi8(right, zero), highWeights));
+    return _mm256_packus_epi16(_mm256_srli_epi16(low, 8), _mm256_srli_epi16(high, 8));
+}
+#endif
+#if defined(__SSE2__)
+__m128i blendPixelPairs128(__m128i left, __m128i right, __m128i weights) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i whole = _mm_set1_epi16(256);
+    __m128i lowWeights = _mm_unpacklo_epi32(weights, weights);
+    __m128i highWeights = _mm_unpackhi_epi32(weights, weights);
+    __m128i low = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(left, zero), _mm_sub_epi16(whole, lowWeights)),
+                                _mm_mullo_epi16(_mm_unpacklo_epi8(right, zero), lowWeights));
+    __m128i high = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(left, zero), _mm_sub_epi16(whole, highWeights)),
+                                 _mm_mullo_epi16(_mm_unpackhi_epi8(right, zero), highWeights));
+    return _mm_packus_epi16(_mm_srli_epi16(low, 8), _mm_srli_epi16(high, 8));
+}
+#endif
+
+// Bilinear scaling of one RGBA line into count pixels, sourceX has the left neighbours
+// and weightX the weights of the right ones. line needs one extra pixel at the end, a copy of the last one.
+void scaleLineBilinear(const uint32_t * line, const int32_t * sourceX, const uint32_t * weightX, int count, uint32_t * _out) {
+    int pixel = 0;
+#if defined(__AVX2__)
+    // 8 target pixels at a time, both neighbours gathered from the line in L1
+    for (; pixel + 8 <= count; pixel += 8) {
+        __m256i indices = _mm256_loadu_si256((const __m256i *)(sourceX + pixel));
+        __m256i left = _mm256_i32gather_epi32((const int *)line, indices, 4);
+        __m256i right = _mm256_i32gather_epi32((const int *)(line + 1), indices, 4);
+        __m256i weights = _mm256_loadu_si256((const __m256i *)(weightX + pixel));
+        _mm256_storeu_si256((__m256i *)(_out + pixel), blendPixelPairs256(left, right, weights));
+    }
+#endif
+#if defined(__SSE2__)
+    for (; pixel + 4 <= count; pixel += 4) {
+        const int32_t * x = sourceX + pixel;
+        __m128i left = _mm_set_epi32((int)line[x[3]], (int)line[x[2]], (int)line[x[1]], (int)line[x[0]]);
+        __m128i right = _mm_set_epi32((int)line[x[3] + 1], (int)line[x[2] + 1], (int)line[x[1] + 1], (int)line[x[0] + 1]);
+        __m128i weights = _mm_loadu_si128((const __m128i *)(weightX + pixel));
+        _mm_storeu_si128((__m128i *)(_out + pixel), blendPixelPairs128(left, right, weights));
+    }
+#endif
+    for (; pixel < count; pixel++) {
+        blendLines(line + sourceX[pixel], line + sourceX[pixel] + 1, weightX[pixel] & 0xff, 1, _out + pixel);
+    }
+}
+
+// Scales target rows first to end-1 of the current job
+int scaleRows(const Scaler * _scaler, int first, int end) {
+    uint32_t line[ScreenWidth + 1], nextLine[ScreenWidth + 1], blended[ScreenWidth + 1];
+    int previousSource = -1;
+    for (int y = first; y < end; y++) {
+        uint32_t * row = _scaler->target + (size_t)y * _scaler->pitch;
+        int scaledY = y - _scaler->top;
+        int source;
+        if (scaledY < 0 || scaledY >= _scaler->scaledHeight) {
+            fillRow(row, _scaler->width, OpaqueBlack);
+            continue;
+        }
+        source = _scaler->sourceY[scaledY];
+        fillRow(row, _scaler->left, OpaqueBlack);
+        fillRow(row + _scaler->left + _scaler->scaledWidth, _scaler->width - _scaler->left - _scaler->scaledWidth, OpaqueBlack);
+        if (_scaler->mode == ScaleMode_Bilinear) {
+            int sourceRow = source >> 8;
+            indexedToRGBA(_scaler, _scaler->frame->pixels[sourceRow], ScreenWidth, line);
+            indexedToRGBA(_scaler, _scaler->frame->pixels[sourceRow + 1 < ScreenHeight ? sourceRow + 1 : sourceRow], ScreenWidth, nextLine);
+            blendLines(line, nextLine, source & 0xff, ScreenWidth, blended);
+            blended[ScreenWidth] = blended[ScreenWidth - 1];
+            scaleLineBilinear(blended, _scaler->sourceX, _scaler->weightX, _scaler->scaledWidth, row + _scaler->left);
+            continue;
+        }
+        if (source == previousSource) {
+            // Same source row as the one above
+            memcpy(row + _scaler->left, row - _scaler->pitch + _scaler->left, _scaler->scaledWidth * sizeof(uint32_t));
+            continue;
+        }
+        previousSource = source;
+        indexedToRGBA(_scaler, _scaler->frame->pixels[source], ScreenWidth, line);
+        if (_scaler->mode == ScaleMode_Integer) {
+            scaleLineInteger(line, _scaler->factor, row + _scaler->left);
+        } else {
+            scaleLineNearest(line, _scaler->sourceX, _scaler->scaledWidth, row + _scaler->left);
+        }
+    }
+    return 0;
+}
+
+// Takes strips until there are none left
+int scaleStrips(Scaler * _scaler) {
+    uint32_t strip;
+    while ((strip = __atomic_fetch_add(&_scaler->nextStrip, 1, __ATOMIC_RELAXED)) < (uint32_t)_scaler->stripCount) {
+        scaleRows(_scaler, (int)((int64_t)_scaler->height * strip / _scaler->stripCount),
+                  (int)((int64_t)_scaler->height * (strip + 1) / _scaler->stripCount));
+    }
+    return 0;
+}
+
+void scalerThread(void * _scaler) {
+    Scaler * scaler = _scaler;
+    for (;;) {
+        waitSemaphore(&scaler->work);
+        if (scaler->stopping) {
+            break;
+        }
+        scaleStrips(scaler);
+        postSemaphore(&scaler->finished);
+    }
+}
+
+int freeScaler(Scaler * _scaler) {
+    _scaler->stopping = 1;
+    for (int thread = 0; thread < _scaler->threadCount; thread++) {
+        postSemaphore(&_scaler->work);
+    }
+    for (int thread = 0; thread < _scaler->threadCount; thread++) {
+        joinThread(_scaler->threads[thread]);
+    }
+    freeSemaphore(&_scaler->work);
+    freeSemaphore(&_scaler->finished);
+    free(_scaler->sourceX);
+    free(_scaler->sourceY);
+    free(_scaler->weightX);
+    memset(_scaler, 0, sizeof(Scaler));
+    return 0;
+}
+
+// Works out where every target pixel comes from. Sampling happens at pixel centers.
+int layoutScaler(Scaler * _scaler) {
+    if (_scaler->mode == ScaleMode_Integer) {
+        int factorX = _scaler->width / ScreenWidth;
+        int factorY = _scaler->height / ScreenHeight;
+        _scaler->factor = factorX < factorY ? factorX : factorY;
+        if (_scaler->factor < 1) {
+            // Too small for even 1x, stretch it down instead
+            _scaler->mode = ScaleMode_Stretch;
+        }
+    }
+    if (_scaler->mode == ScaleMode_Integer) {
+        _scaler->scaledWidth = ScreenWidth * _scaler->factor;
+        _scaler->scaledHeight = ScreenHeight * _scaler->factor;
+    } else {
+        _scaler->scaledWidth = _scaler->width;
+        _scaler->scaledHeight = _scaler->height;
+    }
+    _scaler->left = (_scaler->width - _scaler->scaledWidth) / 2;
+    _scaler->top = (_scaler->height - _scaler->scaledHeight) / 2;
+    for (int x = 0; x < _scaler->scaledWidth; x++) {
+        if (_scaler->mode == ScaleMode_Bilinear) {
+            int64_t position = ((int64_t)(2 * x + 1) * ScreenWidth * 256 / _scaler->scaledWidth - 256) / 2;
+            position = position < 0 ? 0 : position > (ScreenWidth - 1) * 256 ? (ScreenWidth - 1) * 256 : position;
+            _scaler->sourceX[x] = (int32_t)(position >> 8);
+            _scaler->weightX[x] = (uint32_t)(position & 0xff) * 0x10001u;
+        } else {
+            _scaler->sourceX[x] = (int32_t)((int64_t)(2 * x + 1) * ScreenWidth / (2 * _scaler->scaledWidth));
+        }
+    }
+    for (int y = 0; y < _scaler->scaledHeight; y++) {
+        if (_scaler->mode == ScaleMode_Bilinear) {
+            int64_t position = ((int64_t)(2 * y + 1) * ScreenHeight * 256 / _scaler->scaledHeight - 256) / 2;
+            _scaler->sourceY[y] = (int32_t)(position < 0 ? 0 : position > (ScreenHeight - 1) * 256 ? (ScreenHeight - 1) * 256 : position);
+        } else {
+            _scaler->sourceY[y] = (int32_t)((int64_t)(2 * y + 1) * ScreenHeight / (2 * _scaler->scaledHeight));
+        }
+    }
+    return 0;
+}
+
+// Sets up scaling to a width x height target. Pass 0 threads for one per core, up to ScalerMaxThreads.
+int initScaler(Scaler * _scaler, int width, int height, enum ScaleMode mode, int threadCount) {
+    memset(_scaler, 0, sizeof(Scaler));
+    if (width <= 0 || height <= 0) {
+        return -1;
+    }
+    _scaler->width = width;
+    _scaler->height = height;
+    _scaler->mode = mode;
+    _scaler->sourceX = malloc(width * sizeof(int32_t));
+    _scaler->sourceY = malloc(height * sizeof(int32_t));
+    _scaler->weightX = malloc(width * sizeof(uint32_t));
+    if (!_scaler->sourceX || !_scaler->sourceY || !_scaler->weightX) {
+        free(_scaler->sourceX);
+        free(_scaler->sourceY);
+        free(_scaler->weightX);
+        return -1;
+    }
+    for (int color = 0; color < 64; color++) {
+        uint32_t rgb = NESPalette[color];
+        _scaler->rgba[color] = OpaqueBlack | ((rgb & 0xff) << 16) | (rgb & 0xff00) | ((rgb >> 16) & 0xff);
+    }
+    layoutScaler(_scaler);
+    if (threadCount <= 0) {
+        threadCount = getCoreCount();
+    }
+    if (threadCount > ScalerMaxThreads) {
+        threadCount = ScalerMaxThreads;
+    }
+    initSemaphore(&_scaler->work, 0);
+    initSemaphore(&_scaler->finished, 0);
+    // The calling thread is one of them
+    for (int thread = 1; thread < threadCount; thread++) {
+        if (startThread(&_scaler->threads[_scaler->threadCount], scalerThread, _scaler)) {
+            break;
+        }
+        _scaler->threadCount++;
+    }
+    return 0;
+}
+
+// Scales a frame into target, pitch is the distance between rows in pixels
+int scaleFrame(Scaler * _scaler, const Framebuffer * frame, uint32_t * target, int pitch) {
+    _scaler->frame = frame;
+    _scaler->target = target;
+    _scaler->pitch = pitch;
+    _scaler->stripCount = (_scaler->threadCount + 1) * ScalerStripsPerThread;
+    if (_scaler->stripCount > _scaler->height) {
+        _scaler->stripCount = _scaler->height;
+    }
+    _scaler->nextStrip = 0;
+    for (int thread = 0; thread < _scaler->threadCount; thread++) {
+        postSemaphore(&_scaler->work);
+    }
+    scaleStrips(_scaler);
+    for (int thread = 0; thread < _scaler->threadCount; thread++) {
+        waitSemaphore(&_scaler->finished);
+    }
+    return 0;
+}
+
+// Whatever plays the sound sets this up and drains it.
+// Without one nothing gets synthesized at all.
+AudioRing * audioRing = NULL;
+
+// Whatever shows the picture sets this up, it gets called on the render thread
+FramePresenter framePresenter = NULL;
+void * framePresenterArgument = NULL;
+
+// Ctrl+C (or closing the console on Windows) ends the game loop instead of the program,
+// so whatever is being recorded still gets finished. A second one quits right away.
+#ifdef _WIN32
+BOOL WINAPI stopOnConsoleEvent(DWORD event) {
+    if (!running || (event != CTRL_C_EVENT && event != CTRL_BREAK_EVENT && event != CTRL_CLOSE_EVENT)) {
+        return FALSE;
+    }
+    running = 0;
+    return TRUE;
+}
+#else
+void stopOnSignal(int signalNumber) {
+    (void)signalNumber;
+    running = 0;
+}
+#endif
+
+int stopOnInterrupt() {
+#ifdef _WIN32
+    return SetConsoleCtrlHandler(stopOnConsoleEvent, TRUE) ? 0 : -1;
+#else
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopOnSignal;
+    // Back to the default after the first one
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    return sigaction(SIGINT, &action, NULL) || sigaction(SIGTERM, &action, NULL) ? -1 : 0;
+#endif
+}
+
+// recorder can be NULL if nothing should be recorded
+int Start(double frameRate, long frames, MovieRecorder * _recorder) {
+    FramePacer pacer;
+    static AudioSynth synth;
+    int16_t samples[APU_BufferSize];
+    RenderPipeline * pipeline = startRenderPipeline(framePresenter, framePresenterArgument);
+    Reset();
+    initFramePacer(&pacer, frameRate);
+    initAudioSynth(&synth, frameRate);
+    stopOnInterrupt();
+    // endless loop, need I say more?
+    // It waits for an NMI, which is the VBlank signal from the PPU.
+    // We don't have one, so the pacer plays VBlank instead.
+    while (running) {
+        waitForNextFrame(&pacer);
+        latchInput(&inputQueue);
+        if (_recorder && recordFrame(_recorder, gs->JOYPAD_PORT1, gs->JOYPAD_PORT2)) {
+            // Keeps playing, stopRecording() tells
+            _recorder = NULL;
+        }
+        smb_step(1, gs->JOYPAD_PORT1);
+        if (audioRing) {
+            pushAudio(audioRing, samples, synthesizeFrame(&synth, gs, samples));
+        }
+        if (pipeline) {
+            publishFrame(pipeline);
+        }
+        if (frames > 0 && !--frames) {
+            break;
+        }
+    }
+    if (pipeline) {
+        stopRenderPipeline(pipeline);
+    }
+    printFramePacerStats(&pacer);
+    printTaskStats();
+    freeFramePacer(&pacer);
+    return 0;
+}
+
+// Multi-instance runner
+// Runs lots of completely separate games at once, spread over all cores.
+// Each game has its own GameState, a worker just points gs at whichever one it's running.
+//
+// Scheduling is work-stealing: every worker starts out owning an even slice of the instances
+// and takes them one by one from the front. Once its slice is empty it goes and steals
+// the back half of someone else's. A slice is two 32 bit indices packed into one 64 bit word,
+// so both taking and stealing are a single compare-and-swap.
+struct SMBInstance {
+    GameState state;
+    byte input;
+    uint64_t frames;
+};
+typedef struct SMBInstance SMBInstance;
+
+#define packSlice(first, end) (((uint64_t)(end) << 32) | (uint32_t)(first))
+#define sliceFirst(slice) ((uint32_t)(slice))
+#define sliceEnd(slice) ((uint32_t)((slice) >> 32))
+
+struct RunnerWorker {
+    // first/end of this workers slice of instances
+    uint64_t slice;
+    uint64_t frames;
+    int index;
+    struct Runner * runner;
+    Thread thread;
+    // Keep workers off each others cache lines
+    byte padding[CACHE_LINE_SIZE];
+};
+typedef struct RunnerWorker RunnerWorker;
+
+// Runs one instance, which gs already points at, forward by batchFrames frames
+typedef int (*RunnerStep)(struct Runner * _runner, int instance);
+
+struct Runner {
+    SMBInstance * instances;
+    int instanceCount;
+    RunnerWorker * workers;
+    int workerCount;
+    // Frames every instance runs per call to runRunner()
+    int batchFrames;
+    // Does more than just smb_step() if set, argument is for it to use
+    RunnerStep step;
+    void * argument;
+    uint64_t totalFrames;
+    uint64_t totalNanoseconds;
+};
+typedef struct Runner Runner;
+
+int freeRunner(Runner * _runner) {
+    free(_runner->instances);
+    free(_runner->workers);
+    memset(_runner, 0, sizeof(Runner));
+    return 0;
+}
+
+// Sets up instanceCount freshly reset games.
+// Pass 0 threads to use one per core.
+int initRunner(Runner * _runner, int instanceCount, int threadCount) {
+    int i;
+    GameState * previous = gs;
+    memset(_runner, 0, sizeof(Runner));
+    if (threadCount <= 0) {
+        threadCount = getCoreCount();
+    }
+    if (threadCount > instanceCount) {
+        threadCount = instanceCount;
+    }
+    _runner->instances = calloc(instanceCount, sizeof(SMBInstance));
+    _runner->workers = calloc(threadCount, sizeof(RunnerWorker));
+    if (!_runner->instances || !_runner->workers) {
+        freeRunner(_runner);
+        return -1;
+    }
+    _runner->instanceCount = instanceCount;
+    _runner->workerCount = threadCount;
+    for (i = 0; i < instanceCount; i++) {
+        gs = &_runner->instances[i].state;
+        Reset();
+    }
+    gs = previous;
+    return 0;
+}
+
+// Takes the next instance from the front of our own slice
+int takeInstance(RunnerWorker * _worker) {
+    uint64_t slice = __atomic_load_n(&_worker->slice, __ATOMIC_ACQUIRE);
+    while (sliceFirst(slice) < sliceEnd(slice)) {
+        uint64_t next = packSlice(sliceFirst(slice) + 1, sliceEnd(slice));
+        if (__atomic_compare_exchange_n(&_worker->slice, &slice, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return (int)sliceFirst(slice);
+        }
+    }
+    return -1;
+}
+
+// Steals the back half of some other workers slice and makes it ours.
+// Returns 0 if there was nothing left anywhere.
+int stealInstances(RunnerWorker * _worker) {
+    Runner * runner = _worker->runner;
+    int attempt;
+    for (attempt = 1; attempt < runner->workerCount; attempt++) {
+        RunnerWorker * victim = &runner->workers[(_worker->index + attempt) % runner->workerCount];
+        uint64_t slice = __atomic_load_n(&victim->slice, __ATOMIC_ACQUIRE);
+        while (sliceFirst(slice) < sliceEnd(slice)) {
+            uint32_t remaining = sliceEnd(slice) - sliceFirst(slice);
+            uint32_t middle = sliceEnd(slice) - (remaining + 1) / 2;
+            if (__atomic_compare_exchange_n(&victim->slice, &slice, packSlice(sliceFirst(slice), middle), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&_worker->slice, packSlice(middle, sliceEnd(slice)), __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+void runnerWorkerThread(void * _worker) {
+    RunnerWorker * worker = _worker;
+    Runner * runner = worker->runner;
+    for (;;) {
+        int instance = takeInstance(worker);
+        if (instance < 0) {
+            if (!stealInstances(worker)) {
+                break;
+            }
+            continue;
+        }
+        gs = &runner->instances[instance].state;
+        if (runner->step) {
+            runner->step(runner, instance);
+        } else {
+            smb_step(runner->batchFrames, runner->instances[instance].input);
+        }
+        runner->instances[instance].frames += runner->batchFrames;
+        worker->frames += runner->batchFrames;
+    }
+    gs = &gameState;
+}
+
+// Runs every instance forward by frames frames
+int runRunner(Runner * _runner, int frames) {
+    int i;
+    uint64_t start = getTimeNanoseconds();
+    _runner->batchFrames = frames;
+    for (i = 0; i < _runner->workerCount; i++) {
+        RunnerWorker * worker = &_runner->workers[i];
+        worker->index = i;
+        worker->runner = _runner;
+        worker->frames = 0;
+        worker->slice = packSlice((uint64_t)_runner->instanceCount * i / _runner->workerCount,
+                                  (uint64_t)_runner->instanceCount * (i + 1) / _runner->workerCount);
+    }
+    // The calling thread pulls its weight as worker 0
+    for (i = 1; i < _runner->workerCount; i++) {
+        if (startThread(&_runner->workers[i].thread, runnerWorkerThread, &_runner->workers[i])) {
+            // Couldn't get a thread, it's slice will get stolen
+            _runner->workers[i].thread = 0;
+        }
+    }
+    runnerWorkerThread(&_runner->workers[0]);
+    for (i = 1; i < _runner->workerCount; i++) {
+        if (_runner->workers[i].thread) {
+            joinThread(_runner->workers[i].thread);
+        }
+    }
+    for (i = 0; i < _runner->workerCount; i++) {
+        _runner->totalFrames += _runner->workers[i].frames;
+    }
+    _runner->totalNanoseconds += getTimeNanoseconds() - start;
+    return 0;
+}
+
+// Aggregate frames per second across all instances so far
+double runnerFPS(Runner * _runner) {
+    if (!_runner->totalNanoseconds) {
+        return 0.0;
+    }
+    return (double)_runner->totalFrames * 1000000000.0 / (double)_runner->totalNanoseconds;
+}
+
+// Reinforcement learning environment
+// A plain C ABI for training on lots of games at once. Every env_step_batch() call plays
+// frameSkip frames of every game on all cores, through the runner, and writes observations,
+// rewards and done flags straight into buffers the caller handed over with env_set_outputs(),
+// like a shared memory tensor. Nothing gets copied in between, every game writes its own rows.
+//
+// Observations are a downsampled greyscale picture and/or a RAM vector, see EnvRAM_*.
+// Rewards are points scored, minus lifePenalty for every life lost.
+// A game is done when a life is lost, the timer ran out or it's game over,
+// it goes back to the start state by itself then, like most vectorized environments do.
+//
+// Layout of the buffers, all rows back to back by instance:
+// frames: instances * env_frame_size() bytes, rows of ScreenWidth / downsample pixels
+// ram: instances * EnvRAMSize bytes
+// rewards: instances floats
+// dones: instances bytes
+#define EnvRAM_PlayerState 0
+#define EnvRAM_PlayerPage 1
+#define EnvRAM_PlayerX 2
+#define EnvRAM_PlayerYHigh 3
+#define EnvRAM_PlayerY 4
+#define EnvRAM_PlayerXSpeed 5
+#define EnvRAM_PlayerYSpeed 6
+#define EnvRAM_PlayerStatus 7
+#define EnvRAM_Lives 8
+#define EnvRAM_World 9
+#define EnvRAM_Area 10
+#define EnvRAM_TimerExpired 11
+// Then EnvRAMEnemyFields bytes per enemy slot: flag, ID, state, page, x, y
+#define EnvRAM_Enemies 12
+#define EnvRAMEnemyFields 6
+#define EnvRAMSize (EnvRAM_Enemies + EnemySlots * EnvRAMEnemyFields)
+
+struct Environment {
+    Runner runner;
+    int frameSkip;
+    // 0 for no pictures
+    int downsample;
+    float lifePenalty;
+    // Where the observations go, any of them can be NULL
+    byte * frames;
+    byte * ram;
+    float * rewards;
+    byte * dones;
+    // What env_reset() and finished games go back to
+    GameState start;
+    // One per instance, so every game only redraws what changed
+    Renderer * renderers;
+    // Score and lives at the last step, by instance
+    uint32_t * scores;
+    byte * lives;
+    // NESPalette in greyscale
+    byte luma[64];
+};
+typedef struct Environment Environment;
+
+uint32_t playerScore(const GameState * _state) {
+    uint32_t score = 0;
+    for (int digit = 0; digit < PlayerScoreDisplayLength; digit++) {
+        score = score * 10 + _state->PlayerScoreDisplay[digit];
+    }
+    return score;
+}
+
+size_t env_frame_size(const Environment * _env) {
+    if (!_env->downsample) {
+        return 0;
+    }
+    return (size_t)(ScreenWidth / _env->downsample) * (ScreenHeight / _env->downsample);
+}
+
+size_t env_ram_size() {
+    return EnvRAMSize;
+}
+
+int env_destroy(Environment * _env) {
+    if (!_env) {
+        return 0;
+    }
+    freeRunner(&_env->runner);
+    free(_env->renderers);
+    free(_env->scores);
+    free(_env->lives);
+    free(_env);
+    return 0;
+}
+
+// Writes the observations of an instance, which gs points at
+int writeEnvironmentObservation(Environment * _env, int instance) {
+    if (_env->frames && _env->downsample) {
+        int width = ScreenWidth / _env->downsample;
+        int height = ScreenHeight / _env->downsample;
+        byte * out = _env->frames + instance * env_frame_size(_env);
+        byte line[ScreenWidth];
+        if (prepareFrame(&_env->renderers[instance], gs)) {
+            // Nothing to draw with, no ROM
+            memset(out, 0, env_frame_size(_env));
+        } else {
+            // Only the lines that get sampled are drawn at all
+            for (int y = 0; y < height; y++, out += width) {
+                renderScanline(&_env->renderers[instance], gs, y * _env->downsample, line);
+                for (int x = 0; x < width; x++) {
+                    out[x] = _env->luma[line[x * _env->downsample]];
+                }
+            }
+        }
+    }
+    if (_env->ram) {
+        byte * ram = _env->ram + instance * EnvRAMSize;
+        ram[EnvRAM_PlayerState] = gs->SprObject_State[FirstPlayerSlot];
+        ram[EnvRAM_PlayerPage] = gs->SprObject_PageLoc[FirstPlayerSlot];
+        ram[EnvRAM_PlayerX] = gs->SprObject_X_Position[FirstPlayerSlot];
+        ram[EnvRAM_PlayerYHigh] = gs->SprObject_Y_HighPos[FirstPlayerSlot];
+        ram[EnvRAM_PlayerY] = gs->SprObject_Y_Position[FirstPlayerSlot];
+        ram[EnvRAM_PlayerXSpeed] = gs->SprObject_X_Speed[FirstPlayerSlot];
+        ram[EnvRAM_PlayerYSpeed] = gs->SprObject_Y_Speed[FirstPlayerSlot];
+        ram[EnvRAM_PlayerStatus] = gs->PlayerStatus;
+        ram[EnvRAM_Lives] = gs->NumberofLives;
+        ram[EnvRAM_World] = gs->WorldNumber;
+        ram[EnvRAM_Area] = gs->AreaNumber;
+        ram[EnvRAM_TimerExpired] = gs->GameTimerExpiredFlag;
+        for (int enemy = 0; enemy < EnemySlots; enemy++) {
+            byte * fields = ram + EnvRAM_Enemies + enemy * EnvRAMEnemyFields;
+            fields[0] = gs->Enemy_Flag[enemy];
+            fields[1] = gs->Enemy_ID[enemy];
+            fields[2] = gs->SprObject_State[FirstEnemySlot + enemy];
+            fields[3] = gs->SprObject_PageLoc[FirstEnemySlot + enemy];
+            fields[4] = gs->SprObject_X_Position[FirstEnemySlot + enemy];
+            fields[5] = gs->SprObject_Y_Position[FirstEnemySlot + enemy];
+        }
+    }
+    return 0;
+}
+
+// Puts an instance, which gs points at, back to the start
+int restartEnvironmentInstance(Environment * _env, int instance) {
+    memcpy(gs, &_env->start, sizeof(GameState));
+    gs->timeline = newTimeline();
+    _env->scores[instance] = playerScore(gs);
+    _env->lives[instance] = gs->NumberofLives;
+    return 0;
+}
+
+// RunnerStep of the environment, runs on the workers
+int stepEnvironmentInstance(Runner * _runner, int instance) {
+    Environment * env = _runner->argument;
+    uint32_t score;
+    float reward;
+    int lostLife, done;
+    smb_step(env->frameSkip, _runner->instances[instance].input);
+    score = playerScore(gs);
+    reward = (float)score - (float)env->scores[instance];
+    // Losing the last life wraps NumberofLives around from 0 to 0xff and ends the game
+    lostLife = gs->NumberofLives < env->lives[instance]
+        || (env->lives[instance] == 0 && gs->NumberofLives == 0xff)
+        || gs->OperMode == GameOverModeValue;
+    if (lostLife) {
+        reward -= env->lifePenalty;
+    }
+    done = lostLife || gs->GameTimerExpiredFlag;
+    env->scores[instance] = score;
+    env->lives[instance] = gs->NumberofLives;
+    if (env->rewards) {
+        env->rewards[instance] = reward;
+    }
+    if (env->dones) {
+        env->dones[instance] = (byte)done;
+    }
+    if (done) {
+        restartEnvironmentInstance(env, instance);
+    }
+    return writeEnvironmentObservation(env, instance);
+}
+
+// Sets up instances games, playing frameSkip frames per step and downsampling pictures by downsample
+// (1, 2, 4 or 8, 0 for no pictures). Pass 0 threads to use one per core. Returns NULL if it's out of memory.
+Environment * env_create(int instances, int frameSkip, int downsample, int threads) {
+    Environment * env = calloc(1, sizeof(Environment));
+    GameState * previous = gs;
+    if (!env) {
+        return NULL;
+    }
+    if (initRunner(&env->runner, instances, threads)) {
+        free(env);
+        return NULL;
+    }
+    env->frameSkip = frameSkip > 0 ? frameSkip : 1;
+    env->downsample = downsample == 1 || downsample == 2 || downsample == 4 || downsample == 8 ? downsample : 0;
+    env->lifePenalty = 1000.0f;
+    env->runner.step = stepEnvironmentInstance;
+    env->runner.argument = env;
+    env->scores = calloc(instances, sizeof(uint32_t));
+    env->lives = calloc(instances, 1);
+    env->renderers = env->downsample ? calloc(instances, sizeof(Renderer)) : NULL;
+    if (!env->scores || !env->lives || (env->downsample && !env->renderers)) {
+        env_destroy(env);
+        return NULL;
+    }
+    for (int color = 0; color < 64; color++) {
+        uint32_t rgb = NESPalette[color];
+        env->luma[color] = (byte)((((rgb >> 16) & 0xff) * 77 + ((rgb >> 8) & 0xff) * 150 + (rgb & 0xff) * 29) >> 8);
+    }
+    gs = &env->start;
+    Reset();
+    gs = previous;
+    return env;
+}
+
+// Where observations, rewards and done flags go, see the layout above. Any of them can be NULL.
+int env_set_outputs(Environment * _env, byte * frames, byte * ram, float * rewards, byte * dones) {
+    _env->frames = frames;
+    _env->ram = ram;
+    _env->rewards = rewards;
+    _env->dones = dones;
+    return 0;
+}
+
+// Starts every game over, from start if given, otherwise from a freshly reset game,
+// and writes their first observations
+int env_reset(Environment * _env, const GameState * start) {
+    GameState * previous = gs;
+    if (start) {
+        memcpy(&_env->start, start, sizeof(GameState));
+    }
+    for (int instance = 0; instance < _env->runner.instanceCount; instance++) {
+        gs = &_env->runner.instances[instance].state;
+        restartEnvironmentInstance(_env, instance);
+        writeEnvironmentObservation(_env, instance);
+        if (_env->rewards) {
+            _env->rewards[instance] = 0.0f;
+        }
+        if (_env->dones) {
+            _env->dones[instance] = 0;
+        }
+    }
+    gs = previous;
+    return 0;
+}
+
+// Plays one step of the first n games, game i holding the buttons in actions[i].
+// Returns the amount of games stepped.
+int env_step_batch(Environment * _env, const byte * actions, int n) {
+    int instanceCount = _env->runner.instanceCount;
+    if (n > instanceCount) {
+        n = instanceCount;
+    }
+    for (int instance = 0; instance < n; instance++) {
+        _env->runner.instances[instance].input = actions[instance];
+    }
+    // The runner only hands out the first n
+    _env->runner.instanceCount = n;
+    runRunner(&_env->runner, _env->frameSkip);
+    _env->runner.instanceCount = instanceCount;
+    return n;
+}
+
+// Input search
+// Looks for input sequences that get somewhere, like routes or glitches, by brute force.
+// Starting from any snapshot, every state in the frontier gets every input of the input set
+// held for holdFrames frames, and the results become the next frontier. That's breadth-first,
+// or with bestFirst the frontier is the beamWidth best scoring states instead (a beam search,
+// which is what best-first turns into when a whole level gets expanded at once on all cores).
+// States reached more than once only get followed the first time, see VisitedSet.
+// Which of the candidates reaching the same state counts as the first one doesn't depend
+// on the threads: it's the one with the lowest index, so every run finds the same inputs.
+//
+// Children aren't kept while a level gets expanded, only their score and whether they're new.
+// The ones that make it into the next frontier get played again from their parent,
+// which is a lot cheaper than copying every child around.
+#define SearchMaxProbes 256
+#define NoSearchNode 0xffffffffu
+
+// Higher is better
+typedef int64_t (*SearchScore)(const GameState * _state);
+// Whether the search can stop, start is the snapshot the search started from
+typedef int (*SearchGoal)(const GameState * _state, const GameState * _start);
+
+// Hashes of every state seen so far. Open addressing over 64 bit keys, a free slot gets claimed
+// with a compare-and-swap, so any number of threads can insert at once without locking.
+// Keys never get removed. 0 marks a free slot, a hash of 0 gets stored as 1.
+//
+// Next to every key is its owner, the lowest one of everybody that inserted it. Owners go up
+// from level to level, so a key from an earlier level keeps its owner and is a duplicate for
+// everybody after. Once all inserts of a level are done, the owner is the same whatever order
+// the threads got there in.
+struct VisitedSet {
+    uint64_t * keys;
+    uint64_t * owners;
+    uint64_t mask;
+    uint64_t count;
+};
+typedef struct VisitedSet VisitedSet;
+
+// capacity gets rounded up to a power of two, it takes 16 bytes per state
+int initVisitedSet(VisitedSet * _set, uint64_t capacity) {
+    uint64_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    _set->keys = calloc(size, sizeof(uint64_t));
+    _set->owners = malloc(size * sizeof(uint64_t));
+    _set->mask = size - 1;
+    _set->count = 0;
+    if (!_set->keys || !_set->owners) {
+        free(_set->keys);
+        free(_set->owners);
+        memset(_set, 0, sizeof(VisitedSet));
+        return -1;
+    }
+    // Nobody yet, any owner is lower
+    memset(_set->owners, 0xff, size * sizeof(uint64_t));
+    return 0;
+}
+
+int freeVisitedSet(VisitedSet * _set) {
+    free(_set->keys);
+    free(_set->owners);
+    memset(_set, 0, sizeof(VisitedSet));
+    return 0;
+}
+
+// Inserts the hash for owner. Returns its slot, to ask visitedOwner() once everybody is done,
+// or -1 if the neighbourhood is packed too tight to tell. Treat that as new.
+int64_t insertVisited(VisitedSet * _set, uint64_t hash, uint64_t owner) {
+    uint64_t key = hash ? hash : 1;
+    for (uint64_t probe = 0; probe < SearchMaxProbes; probe++) {
+        uint64_t index = (key + probe) & _set->mask;
+        uint64_t * slot = &_set->keys[index];
+        uint64_t seen = __atomic_load_n(slot, __ATOMIC_RELAXED);
+        if (!seen && __atomic_compare_exchange_n(slot, &seen, key, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            __atomic_add_fetch(&_set->count, 1, __ATOMIC_RELAXED);
+            seen = key;
+        }
+        // If the swap failed, seen is whoever beat us to the slot
+        if (seen == key) {
+            // Lowers the owner to ours, unless somebody lower got there already
+            uint64_t current = __atomic_load_n(&_set->owners[index], __ATOMIC_RELAXED);
+            while (owner < current
+                   && !__atomic_compare_exchange_n(&_set->owners[index], &current, owner, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            }
+            return (int64_t)index;
+        }
+    }
+    return -1;
+}
+
+// The owner of a slot from insertVisited()
+uint64_t visitedOwner(const VisitedSet * _set, int64_t slot) {
+    return _set->owners[slot];
+}
+
+// How every frontier state got there, enough to play it back from the start
+struct SearchNode {
+    uint32_t parent;
+    byte input;
+};
+typedef struct SearchNode SearchNode;
+
+// A child of frontier state parent with the given input, before it's decided whether it's kept
+struct SearchCandidate {
+    int64_t score;
+    // Where its state is in the visited set, -1 if it didn't fit
+    int64_t slot;
+    uint32_t parent;
+    byte input;
+    // Whether it's at the goal, and whether nobody got to its state before it
+    byte goal;
+    byte fresh;
+};
+typedef struct SearchCandidate SearchCandidate;
+
+enum SearchPhase {
+    SearchPhase_Expand,
+    SearchPhase_Replay
+};
+
+struct Search {
+    // Settings, initSearch() fills in defaults
+    byte inputs[16];
+    int inputCount;
+    int holdFrames;
+    int beamWidth;
+    int bestFirst;
+    int threadCount;
+    SearchScore score;
+    // NULL to just search for levels levels
+    SearchGoal goal;
+
+    // Two frontiers of beamWidth states, the current one and the next one
+    GameState * frontier;
+    GameState * nextFrontier;
+    uint32_t * frontierNodes;
+    uint32_t * nextFrontierNodes;
+    uint32_t frontierCount;
+    // frontierCount * inputCount of them, by parent * inputCount + input
+    SearchCandidate * candidates;
+    // The ones making it into the next frontier
+    uint32_t * kept;
+    uint32_t keptCount;
+    SearchNode * nodes;
+    uint32_t nodeCount;
+    uint32_t nodeCapacity;
+    VisitedSet visited;
+    // Owner in the visited set of candidate 0 of this level, see markFreshCandidates()
+    uint64_t ownerBase;
+    const GameState * start;
+    enum SearchPhase phase;
+    // Next piece of work to be taken by a worker
+    uint32_t next;
+    // Candidate that reached the goal, NoSearchNode until then
+    uint32_t goalCandidate;
+
+    // Results
+    // Node that reached the goal, or the best scoring one so far
+    uint32_t goalNode;
+    uint32_t bestNode;
+    int64_t bestScore;
+    uint64_t exploredFrames;
+    uint64_t duplicates;
+    uint64_t nanoseconds;
+};
+typedef struct Search Search;
+
+// Gets far in the game, then far in the level
+int64_t scoreProgress(const GameState * _state) {
+    return ((int64_t)_state->WorldNumber << 24) | ((int64_t)_state->AreaNumber << 16)
+        | (_state->SprObject_PageLoc[FirstPlayerSlot] << 8) | _state->SprObject_X_Position[FirstPlayerSlot];
+}
+
+// Made it into some other area
+int goalAreaChange(const GameState * _state, const GameState * _start) {
+    return _state->WorldNumber != _start->WorldNumber || _state->AreaNumber != _start->AreaNumber;
+}
+
+// Got into a world past 8, which only glitches like the Minus World can do
+int goalGlitchWorld(const GameState * _state, const GameState * _start) {
+    (void)_start;
+    return _state->WorldNumber > 7;
+}
+
+int freeSearch(Search * _search) {
+    free(_search->frontier);
+    free(_search->nextFrontier);
+    free(_search->frontierNodes);
+    free(_search->nextFrontierNodes);
+    free(_search->candidates);
+    free(_search->kept);
+    free(_search->nodes);
+    freeVisitedSet(&_search->visited);
+    memset(_search, 0, sizeof(Search));
+    return 0;
+}
+
+// Sets up a search keeping up to beamWidth states per level, with room for visitedCapacity states in total
+int initSearch(Search * _search, int beamWidth, uint64_t visitedCapacity) {
+    // Standing, walking, running and jumping both ways, the rest rarely matters
+    const byte inputs[] = {
+        0, Right_Dir, Right_Dir | B_Button, Right_Dir | A_Button, Right_Dir | A_Button | B_Button,
+        Left_Dir, Left_Dir | A_Button, A_Button, Down_Dir
+    };
+    memset(_search, 0, sizeof(Search));
+    memcpy(_search->inputs, inputs, sizeof(inputs));
+    _search->inputCount = sizeof(inputs);
+    _search->holdFrames = 4;
+    _search->beamWidth = beamWidth;
+    _search->bestFirst = 1;
+    _search->threadCount = getCoreCount();
+    _search->score = scoreProgress;
+    _search->frontier = malloc(beamWidth * sizeof(GameState));
+    _search->nextFrontier = malloc(beamWidth * sizeof(GameState));
+    _search->frontierNodes = malloc(beamWidth * sizeof(uint32_t));
+    _search->nextFrontierNodes = malloc(beamWidth * sizeof(uint32_t));
+    _search->candidates = malloc(beamWidth * sizeof(_search->inputs) * sizeof(SearchCandidate));
+    _search->kept = malloc(beamWidth * sizeof(uint32_t));
+    if (!_search->frontier || !_search->nextFrontier || !_search->frontierNodes || !_search->nextFrontierNodes
+        || !_search->candidates || !_search->kept || initVisitedSet(&_search->visited, visitedCapacity)) {
+        freeSearch(_search);
+        return -1;
     }
+    return 0;
+}
 
-    ColdBoot:
-    // Clear memory
-    // TODO: Tell memory from where until where to clear
-    InitalizeMemory();
+// Plays one input of a child on gs, starting from its parent
+int playSearchInput(const Search * _search, uint32_t parent, byte input) {
+    memcpy(gs, &_search->frontier[parent], sizeof(GameState));
+    return smb_step(_search->holdFrames, input);
+}
 
-    // SND_DELTA_REG
-    OperMode = 0;
-    // Set warm boot flag
-    WarmBootValidation = 0xa5;
-    // Set seed for pseudorandom register
-    PseudoRandomBitReg = 0xa5;
-    // Enable sound except DMC
-    SND_MASTERCTRL_REG = 0b00001111;
-    // turn off clipping for OAM and background
-    ppu.PPU_CTRL_REG2 = 0b00000110;
-    // initialize both name tables
-    MoveAllSpritesOffscreen();
-    InitializeNameTables();
-    // set flag to disable screen output
-    DisableScreenFlag++;
-    // Enable NMIs
-    WritePPUReg1(Mirror_PPU_CTRL_REG1 | 0b10000000);
-    // endless loop, need I say more?
-    while(running) {
-        //while(!nonMaskableInterrupt); // Maybe waiting for an interrupt, since NMIs got enabled?
-        // Yes! I was correct!! It waits for an NMI interrupt!!
-        // The NMI is the VBlank signal from the PPU!!
-        // So the above Loop will need to be stopped via the PPU thread
-        if (nonMaskableInterrupt) {
-            NonMaskableInterrupt();
+void searchWorkerThread(void * _search) {
+    Search * search = _search;
+    GameState * scratch = malloc(sizeof(GameState));
+    uint32_t work = search->phase == SearchPhase_Expand ? search->frontierCount : search->keptCount;
+    uint32_t index;
+    if (!scratch) {
+        return;
+    }
+    while ((index = __atomic_fetch_add(&search->next, 1, __ATOMIC_RELAXED)) < work) {
+        if (search->phase == SearchPhase_Replay) {
+            const SearchCandidate * candidate = &search->candidates[search->kept[index]];
+            gs = &search->nextFrontier[index];
+            playSearchInput(search, candidate->parent, candidate->input);
+            continue;
+        }
+        gs = scratch;
+        for (int input = 0; input < search->inputCount; input++) {
+            uint32_t candidateIndex = index * search->inputCount + input;
+            SearchCandidate * candidate = &search->candidates[candidateIndex];
+            playSearchInput(search, index, search->inputs[input]);
+            candidate->parent = index;
+            candidate->input = search->inputs[input];
+            candidate->slot = insertVisited(&search->visited, hashState(scratch), search->ownerBase + candidateIndex);
+            candidate->score = search->score(scratch);
+            candidate->goal = search->goal && search->goal(scratch, search->start);
+        }
+    }
+    gs = &gameState;
+    free(scratch);
+}
+
+// Runs one phase on all threads, the calling one included
+int runSearchPhase(Search * _search, enum SearchPhase phase) {
+    Thread threads[256];
+    int threadCount = _search->threadCount < 256 ? _search->threadCount : 256;
+    int started = 0;
+    GameState * previous = gs;
+    _search->phase = phase;
+    _search->next = 0;
+    for (int thread = 1; thread < threadCount; thread++) {
+        if (!startThread(&threads[started], searchWorkerThread, _search)) {
+            started++;
+        }
+    }
+    searchWorkerThread(_search);
+    for (int thread = 0; thread < started; thread++) {
+        joinThread(threads[thread]);
+    }
+    gs = previous;
+    return 0;
+}
+
+// Decides which candidates are new once the whole level is expanded. Of the ones that got to
+// the same state only the lowest one is, and the lowest new one at the goal is the one reaching it.
+int markFreshCandidates(Search * _search) {
+    uint32_t candidateCount = _search->frontierCount * _search->inputCount;
+    for (uint32_t index = 0; index < candidateCount; index++) {
+        SearchCandidate * candidate = &_search->candidates[index];
+        candidate->fresh = candidate->slot < 0 || visitedOwner(&_search->visited, candidate->slot) == _search->ownerBase + index;
+        if (candidate->fresh && candidate->goal && _search->goalCandidate == NoSearchNode) {
+            _search->goalCandidate = index;
+        }
+    }
+    _search->ownerBase += candidateCount;
+    return 0;
+}
+
+// The search for qsort(), best first, earlier candidate first on ties so the result doesn't depend on it
+THREAD_LOCAL const Search * sortingSearch;
+
+int compareCandidates(const void * a, const void * b) {
+    const SearchCandidate * first = &sortingSearch->candidates[*(const uint32_t *)a];
+    const SearchCandidate * second = &sortingSearch->candidates[*(const uint32_t *)b];
+    if (first->score != second->score) {
+        return first->score > second->score ? -1 : 1;
+    }
+    return *(const uint32_t *)a < *(const uint32_t *)b ? -1 : 1;
+}
+
+// Turns a candidate into a node, returns its index
+uint32_t addSearchNode(Search * _search, uint32_t candidateIndex) {
+    const SearchCandidate * candidate = &_search->candidates[candidateIndex];
+    if (_search->nodeCount == _search->nodeCapacity) {
+        uint32_t capacity = _search->nodeCapacity ? _search->nodeCapacity * 2 : 4096;
+        SearchNode * nodes = realloc(_search->nodes, capacity * sizeof(SearchNode));
+        if (!nodes) {
+            return NoSearchNode;
+        }
+        _search->nodes = nodes;
+        _search->nodeCapacity = capacity;
+    }
+    _search->nodes[_search->nodeCount].parent = _search->frontierNodes[candidate->parent];
+    _search->nodes[_search->nodeCount].input = candidate->input;
+    return _search->nodeCount++;
+}
+
+// Picks the next frontier out of the candidates of this level
+int selectSearchFrontier(Search * _search) {
+    uint32_t candidateCount = _search->frontierCount * _search->inputCount;
+    uint32_t fresh = 0;
+    _search->keptCount = 0;
+    for (uint32_t index = 0; index < candidateCount; index++) {
+        if (!_search->candidates[index].fresh) {
+            _search->duplicates++;
+            continue;
+        }
+        fresh++;
+        // Breadth-first keeps whatever came first
+        if (_search->keptCount < (uint32_t)_search->beamWidth) {
+            _search->kept[_search->keptCount++] = index;
+        }
+    }
+    if (_search->bestFirst && fresh > (uint32_t)_search->beamWidth) {
+        // Too many to keep, the best ones win
+        uint32_t * all = malloc(fresh * sizeof(uint32_t));
+        uint32_t count = 0;
+        if (!all) {
+            return -1;
+        }
+        for (uint32_t index = 0; index < candidateCount; index++) {
+            if (_search->candidates[index].fresh) {
+                all[count++] = index;
+            }
+        }
+        sortingSearch = _search;
+        qsort(all, count, sizeof(uint32_t), compareCandidates);
+        memcpy(_search->kept, all, _search->beamWidth * sizeof(uint32_t));
+        free(all);
+    }
+    return 0;
+}
+
+// Searches up to levels inputs deep from start, or until the goal is reached.
+// Returns 1 if the goal was reached, goalNode has the way there then. bestNode always has the best state.
+int searchInputs(Search * _search, const GameState * start, int levels) {
+    uint64_t begin = getTimeNanoseconds();
+    _search->start = start;
+    _search->nodeCount = 0;
+    _search->goalNode = NoSearchNode;
+    _search->bestNode = NoSearchNode;
+    _search->bestScore = _search->score(start);
+    _search->goalCandidate = NoSearchNode;
+    memcpy(&_search->frontier[0], start, sizeof(GameState));
+    _search->frontierNodes[0] = NoSearchNode;
+    _search->frontierCount = 1;
+    insertVisited(&_search->visited, hashState(start), _search->ownerBase++);
+    for (int level = 0; level < levels && _search->frontierCount; level++) {
+        GameState * states;
+        uint32_t * nodes;
+        runSearchPhase(_search, SearchPhase_Expand);
+        markFreshCandidates(_search);
+        _search->exploredFrames += (uint64_t)_search->frontierCount * _search->inputCount * _search->holdFrames;
+        if (_search->goalCandidate != NoSearchNode) {
+            _search->goalNode = addSearchNode(_search, _search->goalCandidate);
+            break;
+        }
+        if (selectSearchFrontier(_search)) {
+            break;
+        }
+        for (uint32_t index = 0; index < _search->keptCount; index++) {
+            uint32_t node = addSearchNode(_search, _search->kept[index]);
+            if (node == NoSearchNode) {
+                _search->keptCount = index;
+                break;
+            }
+            _search->nextFrontierNodes[index] = node;
+            if (_search->candidates[_search->kept[index]].score > _search->bestScore || _search->bestNode == NoSearchNode) {
+                _search->bestScore = _search->candidates[_search->kept[index]].score;
+                _search->bestNode = node;
+            }
+        }
+        runSearchPhase(_search, SearchPhase_Replay);
+        states = _search->frontier;
+        _search->frontier = _search->nextFrontier;
+        _search->nextFrontier = states;
+        nodes = _search->frontierNodes;
+        _search->frontierNodes = _search->nextFrontierNodes;
+        _search->nextFrontierNodes = nodes;
+        _search->frontierCount = _search->keptCount;
+    }
+    _search->nanoseconds += getTimeNanoseconds() - begin;
+    return _search->goalNode != NoSearchNode;
+}
+
+// Inputs on the way to a node, oldest first, each one held for holdFrames frames.
+// Returns how many there are, only the first capacity get written.
+int searchPath(const Search * _search, uint32_t node, byte * _inputs, int capacity) {
+    int length = 0;
+    for (uint32_t at = node; at != NoSearchNode; at = _search->nodes[at].parent) {
+        length++;
+    }
+    for (uint32_t at = node, index = length; at != NoSearchNode; at = _search->nodes[at].parent) {
+        if (--index < (uint32_t)capacity) {
+            _inputs[index] = _search->nodes[at].input;
+        }
+    }
+    return length;
+}
+
+// Records the way to a node as a movie, after whatever prefix it started from (can be NULL)
+int writeSearchMovie(const Search * _search, uint32_t node, const Movie * prefix, const char * path) {
+    MovieRecorder recorder;
+    byte secondPlayer = 0;
+    int length = searchPath(_search, node, NULL, 0);
+    byte * inputs = malloc(length ? length : 1);
+    if (!inputs || startRecording(&recorder, path, prefix ? prefix->players : 1)) {
+        free(inputs);
+        return -1;
+    }
+    searchPath(_search, node, inputs, length);
+    for (size_t offset = 0; prefix && offset + 1 + prefix->players <= prefix->size; offset += 1 + prefix->players) {
+        const byte * run = prefix->data + offset;
+        for (int frame = 0; frame < run[0]; frame++) {
+            recordFrame(&recorder, run[1], prefix->players == 2 ? run[2] : 0);
+        }
+        secondPlayer = prefix->players == 2 ? run[2] : 0;
+    }
+    for (int step = 0; step < length; step++) {
+        for (int frame = 0; frame < _search->holdFrames; frame++) {
+            // The second controller stays on whatever the prefix left it at
+            recordFrame(&recorder, inputs[step], secondPlayer);
+        }
+    }
+    free(inputs);
+    return stopRecording(&recorder);
+}
+
+// Offline sound rendering
+// Renders every song and sound effect into its own WAV file, as fast as the CPU allows.
+// Only the sound engine and the APU run, there's no game logic or graphics involved,
+// and every track goes to whichever core is free.
+
+// WAV files get written as they're rendered, the sizes get filled in at the end
+struct WAVWriter {
+    FILE * file;
+    uint32_t samples;
+};
+typedef struct WAVWriter WAVWriter;
+
+void writeLittleEndian(byte * _out, uint32_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        _out[i] = (value >> (i * 8)) & 0xff;
+    }
+}
+
+int writeWAVHeader(WAVWriter * _writer) {
+    byte header[44];
+    uint32_t dataSize = _writer->samples * 2;
+    memcpy(header, "RIFF", 4);
+    writeLittleEndian(header + 4, 36 + dataSize, 4);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    writeLittleEndian(header + 16, 16, 4);
+    // PCM, mono
+    writeLittleEndian(header + 20, 1, 2);
+    writeLittleEndian(header + 22, 1, 2);
+    writeLittleEndian(header + 24, APU_SampleRate, 4);
+    writeLittleEndian(header + 28, APU_SampleRate * 2, 4);
+    writeLittleEndian(header + 32, 2, 2);
+    writeLittleEndian(header + 34, 16, 2);
+    memcpy(header + 36, "data", 4);
+    writeLittleEndian(header + 40, dataSize, 4);
+    return fwrite(header, sizeof(header), 1, _writer->file) == 1 ? 0 : -1;
+}
+
+int openWAV(WAVWriter * _writer, const char * path) {
+    memset(_writer, 0, sizeof(WAVWriter));
+    _writer->file = fopen(path, "wb");
+    if (!_writer->file) {
+        return -1;
+    }
+    return writeWAVHeader(_writer);
+}
+
+int writeWAVSamples(WAVWriter * _writer, const int16_t * samples, int count) {
+    byte data[APU_BufferSize * 2];
+    while (count > 0) {
+        int chunk = count > APU_BufferSize ? APU_BufferSize : count;
+        for (int sample = 0; sample < chunk; sample++) {
+            writeLittleEndian(data + sample * 2, (uint16_t)samples[sample], 2);
+        }
+        if (fwrite(data, 2, chunk, _writer->file) != (size_t)chunk) {
+            return -1;
+        }
+        _writer->samples += chunk;
+        samples += chunk;
+        count -= chunk;
+    }
+    return 0;
+}
+
+int closeWAV(WAVWriter * _writer) {
+    if (!_writer->file) {
+        return -1;
+    }
+    fseek(_writer->file, 0, SEEK_SET);
+    writeWAVHeader(_writer);
+    fclose(_writer->file);
+    _writer->file = NULL;
+    return 0;
+}
+
+// Every track is a value put into one of the sound queues
+struct SoundTrack {
+    const char * name;
+    size_t queue;
+    byte value;
+    // Whether the handler that plays it is transpiled
+    byte playable;
+};
+typedef struct SoundTrack SoundTrack;
+
+#define soundTrack(queue, value, handler) { #value, offsetof(GameState, queue), value, handler##Transpiled }
+const SoundTrack soundTracks[] = {
+    soundTrack(AreaMusicQueue, GroundMusic, MusicHandler),
+    soundTrack(AreaMusicQueue, WaterMusic, MusicHandler),
+    soundTrack(AreaMusicQueue, UndergroundMusic, MusicHandler),
+    soundTrack(AreaMusicQueue, CastleMusic, MusicHandler),
+    soundTrack(AreaMusicQueue, CloudMusic, MusicHandler),
+    soundTrack(AreaMusicQueue, PipeIntroMusic, MusicHandler),
+    soundTrack(AreaMusicQueue, StarPowerMusic, MusicHandler),
+    soundTrack(EventMusicQueue, DeathMusic, MusicHandler),
+    soundTrack(EventMusicQueue, GameOverMusic, MusicHandler),
+    soundTrack(EventMusicQueue, VictoryMusic, MusicHandler),
+    soundTrack(EventMusicQueue, EndOfCastleMusic, MusicHandler),
+    soundTrack(EventMusicQueue, AltGameOverMusic, MusicHandler),
+    soundTrack(EventMusicQueue, EndOfLevelMusic, MusicHandler),
+    soundTrack(EventMusicQueue, TimeRunningOutMusic, MusicHandler),
+    soundTrack(Square1SoundQueue, Sfx_SmallJump, Square1SfxHandler),
+    soundTrack(Square1SoundQueue, Sfx_Flagpole, Square1SfxHandler),
+    soundTrack(Square1SoundQueue, Sfx_Fireball, Square1SfxHandler),
+    soundTrack(Square1SoundQueue, Sfx_PipeDown_Injury, Square1SfxHandler),
+    soundTrack(Square1SoundQueue, Sfx_EnemySmack, Square1SfxHandler),
+    soundTrack(Square1SoundQueue, Sfx_EnemyStomp, Square1SfxHandler),
+    soundTrack(Square1SoundQueue, Sfx_Bump, Square1SfxHandler),
+    soundTrack(Square1SoundQueue, Sfx_BigJump, Square1SfxHandler),
+    soundTrack(Square2SoundQueue, Sfx_BowserFall, Square2SfxHandler),
+    soundTrack(Square2SoundQueue, Sfx_ExtraLife, Square2SfxHandler),
+    soundTrack(Square2SoundQueue, Sfx_PowerUpGrab, Square2SfxHandler),
+    soundTrack(Square2SoundQueue, Sfx_TimerTick, Square2SfxHandler),
+    soundTrack(Square2SoundQueue, Sfx_Blast, Square2SfxHandler),
+    soundTrack(Square2SoundQueue, Sfx_GrowVine, Square2SfxHandler),
+    soundTrack(Square2SoundQueue, Sfx_GrowPowerUp, Square2SfxHandler),
+    soundTrack(Square2SoundQueue, Sfx_CoinGrab, Square2SfxHandler),
+    soundTrack(NoiseSoundQueue, Sfx_BowserFlame, NoiseSfxHandler),
+    soundTrack(NoiseSoundQueue, Sfx_BrickShatter, NoiseSfxHandler),
+};
+#define soundTrackCount (int)(sizeof(soundTracks) / sizeof(soundTracks[0]))
+
+// Area music loops forever, so it gets cut off after this long
+#define SoundRenderMaxSeconds 90
+// Frames kept after a track ends so the last notes can ring out
+#define SoundRenderTailFrames 30
+
+struct SoundRenderJobs {
+    const char * directory;
+    int next;
+    // Indices into soundTracks of the playable ones
+    int tracks[soundTrackCount];
+    int trackCount;
+    uint64_t frames[soundTrackCount];
+};
+typedef struct SoundRenderJobs SoundRenderJobs;
+
+int soundStillPlaying() {
+    return gs->AreaMusicBuffer || gs->EventMusicBuffer || gs->Square1SoundBuffer
+        || gs->Square2SoundBuffer || gs->NoiseSoundBuffer || gs->PauseSoundBuffer;
+}
+
+// Renders one track into <directory>/<name>.wav, returns the amount of frames rendered
+uint64_t renderSoundTrack(const SoundTrack * track, const char * directory) {
+    GameState * state = calloc(1, sizeof(GameState));
+    GameState * previous = gs;
+    AudioSynth * synth = malloc(sizeof(AudioSynth));
+    int16_t samples[APU_BufferSize];
+    char path[1024];
+    WAVWriter writer;
+    uint64_t frame = 0;
+    int tail = SoundRenderTailFrames;
+    snprintf(path, sizeof(path), "%s/%s.wav", directory, track->name);
+    if (!state || !synth || openWAV(&writer, path)) {
+        free(state);
+        free(synth);
+        return 0;
+    }
+    gs = state;
+    initAudioSynth(synth, NTSC_FrameRate);
+    // The sound engine keeps quiet on the title screen
+    gs->OperMode = GameModeValue;
+    ((byte *)gs)[track->queue] = track->value;
+    for (frame = 0; frame < (uint64_t)(SoundRenderMaxSeconds * NTSC_FrameRate); frame++) {
+        gs->apuWriteCount = 0;
+        SoundEngine();
+        writeWAVSamples(&writer, samples, synthesizeFrame(synth, gs, samples));
+        if (!soundStillPlaying() && !tail--) {
+            break;
         }
-        // Did I just solve the NMI loop situation lmfao?
     }
+    closeWAV(&writer);
+    gs = previous;
+    free(synth);
+    free(state);
+    return frame;
+}
+
+void soundRenderThread(void * _jobs) {
+    SoundRenderJobs * jobs = _jobs;
+    for (;;) {
+        int job = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED);
+        if (job >= jobs->trackCount) {
+            break;
+        }
+        jobs->frames[job] = renderSoundTrack(&soundTracks[jobs->tracks[job]], jobs->directory);
+    }
+}
+
+// Renders every playable track into directory, using threads threads (0 for one per core).
+// Returns the total amount of frames rendered, _rendered gets the amount of tracks.
+uint64_t renderAllSoundTracks(const char * directory, int threads, int * _rendered) {
+    SoundRenderJobs jobs;
+    Thread workers[64];
+    int started = 0;
+    uint64_t total = 0;
+    memset(&jobs, 0, sizeof(jobs));
+    jobs.directory = directory;
+    for (int track = 0; track < soundTrackCount; track++) {
+        if (soundTracks[track].playable) {
+            jobs.tracks[jobs.trackCount++] = track;
+        }
+    }
+    *_rendered = jobs.trackCount;
+    if (threads <= 0) {
+        threads = getCoreCount();
+    }
+    if (threads > 64) {
+        threads = 64;
+    }
+    for (; started < threads - 1; started++) {
+        if (startThread(&workers[started], soundRenderThread, &jobs)) {
+            break;
+        }
+    }
+    soundRenderThread(&jobs);
+    for (int worker = 0; worker < started; worker++) {
+        joinThread(workers[worker]);
+    }
+    for (int track = 0; track < jobs.trackCount; track++) {
+        total += jobs.frames[track];
+    }
+    return total;
 }
 
 /*
 THREADS
 Main/CPU Thread
-PPU Thread
+PPU Thread (see Render pipeline)
 APU Thread(?)
 Controller thread
 
 */
 
-int main() {
+// Netplay
+// Two players, each on their own machine (or for now, their own port on this one), with rollback.
+// Nobody waits for the other sides input. The game goes ahead guessing that the remote player
+// is still pressing whatever they pressed last, and keeps a copy of the state from before every
+// frame that isn't confirmed yet. When the real input turns out different, the state from before
+// the first wrong frame gets loaded and everything since is played again, all within the same frame.
+// Saving a state is a single memcpy, and replaying RollbackFrames frames takes a tiny part of a frame.
+//
+// If the other side gets RollbackFrames behind, we wait for it instead of guessing even further.
+// Every packet repeats all inputs the other side hasn't confirmed yet, so lost packets don't matter.
+//
+// Packet layout, all little endian:
+// 0-3: "SMBN"
+// 4-7: first frame in here
+// 8-11: every frame of ours before this one has arrived at the sender
+// 12: amount of frames n
+// 13-: the senders input for those n frames
+#define RollbackFrames 8
+#define NetplayHistory 32 // Has to be a power of two, inputs from this far back are long confirmed
+#define NetplayMagic "SMBN"
+#define NetplayHeaderSize 13
+#define NetplayPacketSize (NetplayHeaderSize + NetplayHistory)
+// One state per frame that can still be rolled back, plus the one being played
+#define NetplayStates (RollbackFrames + 1)
+#define NoRollback 0xffffffffu
+
+struct NetplaySession {
+    UDPSocket socket;
+    word remotePort;
+    // 0 plays on the first controller port, 1 on the second
+    byte localPlayer;
+    // Next frame to be played
+    uint32_t frame;
+    // Every frame before this one has the remote players real input
+    uint32_t confirmedFrame;
+    // How far the remote side has gotten with our inputs
+    uint32_t remoteConfirmedFrame;
+    // First frame that was played with a wrong guess, NoRollback if there isn't any
+    uint32_t rollbackFrom;
+    // All by frame & (NetplayHistory - 1)
+    byte localInputs[NetplayHistory];
+    byte remoteInputs[NetplayHistory];
+    // Which frame remoteInputs holds, so gaps from lost packets show up
+    uint32_t remoteFrames[NetplayHistory];
+    // Remote input the frame was last played with, real or guessed
+    byte playedInputs[NetplayHistory];
+    // State from before the frame, by frame % NetplayStates
+    GameState states[NetplayStates];
+
+    // Statistics
+    uint64_t rollbacks;
+    uint64_t replayedFrames;
+    uint64_t stalls;
+    uint32_t longestRollback;
+    uint64_t longestRollbackNanoseconds;
+};
+typedef struct NetplaySession NetplaySession;
+
+// Starts a session for the game in gs, which should be freshly reset on both sides.
+// Returns NULL if there's no socket to be had.
+NetplaySession * startNetplay(byte localPlayer, word localPort, word remotePort) {
+    NetplaySession * session = calloc(1, sizeof(NetplaySession));
+    if (!session) {
+        return NULL;
+    }
+    if (openUDPSocket(&session->socket, localPort)) {
+        free(session);
+        return NULL;
+    }
+    session->remotePort = remotePort;
+    session->localPlayer = localPlayer;
+    session->rollbackFrom = NoRollback;
+    for (int index = 0; index < NetplayHistory; index++) {
+        // Nothing has arrived yet, not even for frame 0
+        session->remoteFrames[index] = NoRollback;
+    }
+    return session;
+}
+
+int stopNetplay(NetplaySession * _session) {
+    closeUDPSocket(&_session->socket);
+    free(_session);
+    return 0;
+}
+
+uint32_t readLittle32(const byte * data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+int writeLittle32(byte * _data, uint32_t value) {
+    for (int index = 0; index < 4; index++) {
+        _data[index] = (byte)(value >> (index * 8));
+    }
+    return 0;
+}
+
+// Sends every input the other side hasn't confirmed yet
+int sendNetplayInputs(NetplaySession * _session) {
+    byte packet[NetplayPacketSize];
+    uint32_t first = _session->remoteConfirmedFrame;
+    if (_session->frame - first > NetplayHistory) {
+        first = _session->frame - NetplayHistory;
+    }
+    memcpy(packet, NetplayMagic, 4);
+    writeLittle32(packet + 4, first);
+    writeLittle32(packet + 8, _session->confirmedFrame);
+    packet[12] = (byte)(_session->frame - first);
+    for (uint32_t frame = first; frame < _session->frame; frame++) {
+        packet[NetplayHeaderSize + frame - first] = _session->localInputs[frame & (NetplayHistory - 1)];
+    }
+    return sendUDP(&_session->socket, _session->remotePort, packet, NetplayHeaderSize + packet[12]);
+}
+
+// The remote input for a frame, or the guess for it if it hasn't arrived yet
+byte remoteNetplayInput(const NetplaySession * _session, uint32_t frame) {
+    int slot = frame & (NetplayHistory - 1);
+    if (_session->remoteFrames[slot] == frame) {
+        return _session->remoteInputs[slot];
+    }
+    if (!_session->confirmedFrame) {
+        return 0;
+    }
+    return _session->remoteInputs[(_session->confirmedFrame - 1) & (NetplayHistory - 1)];
+}
+
+// Plays one frame on gs, keeping the state from before it
+int playNetplayFrame(NetplaySession * _session, uint32_t frame) {
+    int slot = frame & (NetplayHistory - 1);
+    byte local = _session->localInputs[slot];
+    byte remote = remoteNetplayInput(_session, frame);
+    _session->playedInputs[slot] = remote;
+    memcpy(&_session->states[frame % NetplayStates], gs, sizeof(GameState));
+    gs->JOYPAD_PORT2 = _session->localPlayer ? local : remote;
+    return smb_step(1, _session->localPlayer ? remote : local);
+}
+
+// Goes back to the first wrongly guessed frame and plays everything since again
+int rollbackNetplay(NetplaySession * _session) {
+    uint64_t start = getTimeNanoseconds();
+    uint32_t frames = _session->frame - _session->rollbackFrom;
+    uint64_t nanoseconds;
+    smb_load_state(&_session->states[_session->rollbackFrom % NetplayStates]);
+    for (uint32_t frame = _session->rollbackFrom; frame < _session->frame; frame++) {
+        playNetplayFrame(_session, frame);
+    }
+    nanoseconds = getTimeNanoseconds() - start;
+    _session->rollbacks++;
+    _session->replayedFrames += frames;
+    if (frames > _session->longestRollback) {
+        _session->longestRollback = frames;
+    }
+    if (nanoseconds > _session->longestRollbackNanoseconds) {
+        _session->longestRollbackNanoseconds = nanoseconds;
+    }
+    _session->rollbackFrom = NoRollback;
+    return 0;
+}
+
+// Takes in every packet waiting. If some frame turns out to have been played with
+// the wrong input, everything from there on gets played again right away.
+int receiveNetplayInputs(NetplaySession * _session) {
+    byte packet[NetplayPacketSize];
+    int size;
+    while ((size = receiveUDP(&_session->socket, packet, sizeof(packet))) >= 0) {
+        uint32_t first;
+        if (size < NetplayHeaderSize || memcmp(packet, NetplayMagic, 4) || NetplayHeaderSize + packet[12] > size) {
+            continue;
+        }
+        first = readLittle32(packet + 4);
+        // Frame numbers only go up, so anything older is a packet that took the long way
+        if ((int32_t)(readLittle32(packet + 8) - _session->remoteConfirmedFrame) > 0) {
+            _session->remoteConfirmedFrame = readLittle32(packet + 8);
+        }
+        for (int index = 0; index < packet[12]; index++) {
+            uint32_t frame = first + index;
+            int slot = frame & (NetplayHistory - 1);
+            byte input = packet[NetplayHeaderSize + index];
+            if (frame - _session->confirmedFrame >= NetplayHistory || _session->remoteFrames[slot] == frame) {
+                // Already got it, or way out of range
+                continue;
+            }
+            _session->remoteFrames[slot] = frame;
+            _session->remoteInputs[slot] = input;
+            if (frame < _session->frame && _session->playedInputs[slot] != input && frame < _session->rollbackFrom) {
+                _session->rollbackFrom = frame;
+            }
+        }
+        while (_session->remoteFrames[_session->confirmedFrame & (NetplayHistory - 1)] == _session->confirmedFrame) {
+            _session->confirmedFrame++;
+        }
+    }
+    if (_session->rollbackFrom != NoRollback) {
+        rollbackNetplay(_session);
+    }
+    return 0;
+}
+
+// Keeps things going without playing a frame, like once everything has been played
+int updateNetplay(NetplaySession * _session) {
+    receiveNetplayInputs(_session);
+    return sendNetplayInputs(_session);
+}
+
+// Plays the next frame on gs with the given local input, once a display frame.
+// Returns 0 if it had to wait on the other side instead, the input is dropped then.
+int netplayAdvance(NetplaySession * _session, byte input) {
+    receiveNetplayInputs(_session);
+    // The other side can be ahead of us too, that's fine
+    if ((int32_t)(_session->frame - _session->confirmedFrame) >= RollbackFrames) {
+        _session->stalls++;
+        sendNetplayInputs(_session);
+        return 0;
+    }
+    _session->localInputs[_session->frame & (NetplayHistory - 1)] = input;
+    playNetplayFrame(_session, _session->frame);
+    _session->frame++;
+    sendNetplayInputs(_session);
+    return 1;
+}
+
+int printNetplayStats(const NetplaySession * _session) {
+    printf("player %d: %lu frames, %llu rollbacks, %llu frames replayed, %llu stalls, longest rollback %lu frames in %.3fms\n",
+        _session->localPlayer + 1, (unsigned long)_session->frame, (unsigned long long)_session->rollbacks,
+        (unsigned long long)_session->replayedFrames, (unsigned long long)_session->stalls,
+        (unsigned long)_session->longestRollback, (double)_session->longestRollbackNanoseconds / 1000000.0);
+    return 0;
+}
+
+// Netplay test
+// Plays both sides of a netplay session on this thread over loopback, each side going lag frames
+// at a time before the other gets a turn, so the remote input is always up to lag frames late.
+// Both sides and a plain run with the same inputs have to end up with the same state hash.
+
+// Made up inputs that change every few frames, like a person pressing buttons
+byte netplayTestInput(int player, uint32_t frame) {
+    uint32_t stretch = frame / 13 + player * 0x10000;
+    return (byte)hashBytes(player, &stretch, sizeof(stretch));
+}
+
+// Returns 0 if everything ended up in sync
+int runNetplayTest(uint32_t frames, int lag) {
+    static GameState states[3];
+    NetplaySession * sessions[2];
+    GameState * previous = gs;
+    uint64_t start = getTimeNanoseconds();
+    uint64_t hashes[3];
+    int result;
+    for (int player = 0; player < 3; player++) {
+        gs = &states[player];
+        Reset();
+    }
+    sessions[0] = startNetplay(0, 0, 0);
+    sessions[1] = startNetplay(1, 0, sessions[0] ? sessions[0]->socket.port : 0);
+    if (!sessions[0] || !sessions[1]) {
+        printf("Couldn't open a UDP socket\n");
+        gs = previous;
+        return -1;
+    }
+    sessions[0]->remotePort = sessions[1]->socket.port;
+    // Keep going until both sides have every input of the other
+    while (sessions[0]->confirmedFrame < frames || sessions[1]->confirmedFrame < frames) {
+        for (int player = 0; player < 2; player++) {
+            gs = &states[player];
+            for (int frame = 0; frame < lag; frame++) {
+                if (sessions[player]->frame < frames) {
+                    netplayAdvance(sessions[player], netplayTestInput(player, sessions[player]->frame));
+                } else {
+                    updateNetplay(sessions[player]);
+                }
+            }
+        }
+        if (getTimeNanoseconds() - start > 10000000000ull) {
+            printf("Gave up waiting on the other side\n");
+            break;
+        }
+    }
+    // Both sides are confirmed all the way now, so any guess left over gets fixed
+    for (int player = 0; player < 2; player++) {
+        gs = &states[player];
+        updateNetplay(sessions[player]);
+        hashes[player] = hashState(gs);
+        printNetplayStats(sessions[player]);
+    }
+    gs = &states[2];
+    for (uint32_t frame = 0; frame < frames; frame++) {
+        gs->JOYPAD_PORT2 = netplayTestInput(1, frame);
+        smb_step(1, netplayTestInput(0, frame));
+    }
+    hashes[2] = hashState(gs);
+    result = hashes[0] == hashes[2] && hashes[1] == hashes[2] ? 0 : -1;
+    printf("%s: %016llx %016llx, plain run %016llx\n", result ? "Out of sync" : "In sync",
+        (unsigned long long)hashes[0], (unsigned long long)hashes[1], (unsigned long long)hashes[2]);
+    stopNetplay(sessions[0]);
+    stopNetplay(sessions[1]);
+    gs = previous;
+    return result;
+}
+
+// Define SMB_NO_MAIN to build this as a library instead
+#ifndef SMB_NO_MAIN
+int main(int argc, char ** argv) {
     printf("Hello, Mario!\n");
-    Start();
+    // The ROM is optional for now, only the renderer and the area cache need it.
+    // The decoded tiles and areas get cached next to it so later starts skip decoding.
+    if (!loadROM("smb.nes")) {
+        loadTileCache("smb.chrcache");
+        loadAreaCache("smb.areacache");
+    }
+    // smb -runner <instances> <frames> [threads]
+    // Runs lots of separate games at once and prints the combined frame rate
+    if (argc > 3 && !strcmp(argv[1], "-runner")) {
+        Runner runner;
+        long frames = strtol(argv[3], NULL, 10);
+        int threads = argc > 4 ? (int)strtol(argv[4], NULL, 10) : 0;
+        if (initRunner(&runner, (int)strtol(argv[2], NULL, 10), threads)) {
+            printf("Couldn't set up the runner\n");
+            return 1;
+        }
+        while (frames > 0) {
+            int batch = frames > 600 ? 600 : (int)frames;
+            runRunner(&runner, batch);
+            frames -= batch;
+        }
+        printf("%d instances on %d threads: %llu frames in %.3fs (%.0f fps)\n", runner.instanceCount, runner.workerCount,
+            (unsigned long long)runner.totalFrames, (double)runner.totalNanoseconds / 1000000000.0, runnerFPS(&runner));
+        freeRunner(&runner);
+        return 0;
+    }
+    // smb -headless <frames> [-render]
+    // Runs the given amount of frames without pacing and prints how fast that went.
+    // With -render every frame also goes through the render pipeline.
+    if (argc > 2 && !strcmp(argv[1], "-headless")) {
+        long frames = strtol(argv[2], NULL, 10);
+        RenderPipeline * pipeline = NULL;
+        uint64_t start;
+        double seconds;
+        if (argc > 3 && !strcmp(argv[3], "-render")) {
+            pipeline = startRenderPipeline(NULL, NULL);
+        }
+        Reset();
+        start = getTimeNanoseconds();
+        while (frames > 0) {
+            if (pipeline) {
+                smb_step(1, 0);
+                publishFrame(pipeline);
+                frames--;
+            } else {
+                int batch = frames > 1000 ? 1000 : (int)frames;
+                smb_step(batch, 0);
+                frames -= batch;
+            }
+        }
+        if (pipeline) {
+            stopRenderPipeline(pipeline);
+        }
+        seconds = (double)(getTimeNanoseconds() - start) / 1000000000.0;
+        printf("%llu frames in %.3fs (%.0f fps)\n", (unsigned long long)fpsCounter.totalFrames, seconds, seconds > 0 ? (double)fpsCounter.totalFrames / seconds : 0.0);
+        printTaskStats();
+        return 0;
+    }
+    // smb -music <directory> [threads]
+    // Renders every song and sound effect to WAV files in directory
+    if (argc > 2 && !strcmp(argv[1], "-music")) {
+        int rendered;
+        uint64_t start = getTimeNanoseconds();
+        uint64_t frames = renderAllSoundTracks(argv[2], argc > 3 ? (int)strtol(argv[3], NULL, 10) : 0, &rendered);
+        double seconds = (double)(getTimeNanoseconds() - start) / 1000000000.0;
+        double audioSeconds = (double)frames / NTSC_FrameRate;
+        printf("%d tracks, %.1fs of audio in %.3fs (%.0fx realtime)\n", rendered, audioSeconds, seconds,
+            seconds > 0 ? audioSeconds / seconds : 0.0);
+        if (rendered < soundTrackCount) {
+            printf("%d more once their sound handlers are transpiled\n", soundTrackCount - rendered);
+        }
+        return 0;
+    }
+    // smb -scale <width> <height> [stretch|integer|bilinear] [frames] [threads]
+    // Scales frames to the given size as fast as possible and prints the time per frame
+    if (argc > 3 && !strcmp(argv[1], "-scale")) {
+        int width = (int)strtol(argv[2], NULL, 10);
+        int height = (int)strtol(argv[3], NULL, 10);
+        enum ScaleMode mode = ScaleMode_Stretch;
+        long frames = argc > 5 ? strtol(argv[5], NULL, 10) : 100;
+        static Framebuffer frame;
+        static Renderer renderer;
+        Scaler scaler;
+        uint32_t * target;
+        uint64_t start;
+        double milliseconds;
+        if (argc > 4 && !strcmp(argv[4], "integer")) {
+            mode = ScaleMode_Integer;
+        } else if (argc > 4 && !strcmp(argv[4], "bilinear")) {
+            mode = ScaleMode_Bilinear;
+        }
+        target = malloc((size_t)(width > 0 ? width : 1) * (height > 0 ? height : 1) * sizeof(uint32_t));
+        if (!target || initScaler(&scaler, width, height, mode, argc > 6 ? (int)strtol(argv[6], NULL, 10) : 0)) {
+            printf("Can't scale to %dx%d\n", width, height);
+            free(target);
+            return 1;
+        }
+        Reset();
+        if (renderFrame(&renderer, gs, &frame)) {
+            // No ROM, so some stripes instead
+            for (int y = 0; y < ScreenHeight; y++) {
+                for (int x = 0; x < ScreenWidth; x++) {
+                    frame.pixels[y][x] = (byte)((x / 8 + y / 8) & 0x3f);
+                }
+            }
+        }
+        start = getTimeNanoseconds();
+        for (long index = 0; index < frames; index++) {
+            scaleFrame(&scaler, &frame, target, width);
+        }
+        milliseconds = (double)(getTimeNanoseconds() - start) / 1000000.0;
+        printf("%dx%d on %d threads: %.3fms per frame\n", width, height, scaler.threadCount + 1, frames > 0 ? milliseconds / frames : 0.0);
+        freeScaler(&scaler);
+        free(target);
+        return 0;
+    }
+    // smb -env <instances> <steps> [frameskip] [downsample] [threads]
+    // Steps lots of environments with random buttons and prints the steps per second
+    if (argc > 3 && !strcmp(argv[1], "-env")) {
+        int instances = (int)strtol(argv[2], NULL, 10);
+        long steps = strtol(argv[3], NULL, 10);
+        Environment * env = env_create(instances, argc > 4 ? (int)strtol(argv[4], NULL, 10) : 4,
+            argc > 5 ? (int)strtol(argv[5], NULL, 10) : 2, argc > 6 ? (int)strtol(argv[6], NULL, 10) : 0);
+        byte * frames, * ram, * dones, * actions;
+        float * rewards;
+        uint64_t start, seed = 1;
+        double seconds;
+        if (!env) {
+            printf("Couldn't set up %d environments\n", instances);
+            return 1;
+        }
+        frames = malloc(instances * env_frame_size(env) + 1);
+        ram = malloc(instances * env_ram_size());
+        rewards = malloc(instances * sizeof(float));
+        dones = malloc(instances);
+        actions = malloc(instances);
+        if (!frames || !ram || !rewards || !dones || !actions) {
+            printf("Couldn't set up %d environments\n", instances);
+            free(frames);
+            free(ram);
+            free(rewards);
+            free(dones);
+            free(actions);
+            env_destroy(env);
+            return 1;
+        }
+        env_set_outputs(env, frames, ram, rewards, dones);
+        env_reset(env, NULL);
+        start = getTimeNanoseconds();
+        for (long step = 0; step < steps; step++) {
+            for (int instance = 0; instance < instances; instance++) {
+                seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+                actions[instance] = (byte)(seed >> 56);
+            }
+            env_step_batch(env, actions, instances);
+        }
+        seconds = (double)(getTimeNanoseconds() - start) / 1000000000.0;
+        printf("%ld steps of %d environments in %.3fs (%.0f steps/s)\n", steps, instances, seconds,
+            seconds > 0 ? (double)steps * instances / seconds : 0.0);
+        free(frames);
+        free(ram);
+        free(rewards);
+        free(dones);
+        free(actions);
+        env_destroy(env);
+        return 0;
+    }
+    // smb -search <levels> [-beam <states>] [-hold <frames>] [-bfs] [-goal area|glitchworld] [-from <movie>] [-out <movie>] [-threads <threads>] [-visited <states>]
+    // Searches for the inputs that get the furthest, or reach the goal, starting after the from movie
+    if (argc > 2 && !strcmp(argv[1], "-search")) {
+        int levels = (int)strtol(argv[2], NULL, 10);
+        int beamWidth = 1024;
+        int holdFrames = 4;
+        int bestFirst = 1;
+        int threads = 0;
+        // 16 bytes each, 256MB
+        long long visited = (long long)16 << 20;
+        SearchGoal goal = NULL;
+        const char * fromPath = NULL;
+        const char * outPath = NULL;
+        Movie prefix;
+        Search search;
+        uint32_t node;
+        int found;
+        for (int argument = 3; argument < argc; argument++) {
+            if (!strcmp(argv[argument], "-bfs")) {
+                bestFirst = 0;
+            } else if (argument + 1 >= argc) {
+                break;
+            } else if (!strcmp(argv[argument], "-beam")) {
+                beamWidth = (int)strtol(argv[++argument], NULL, 10);
+            } else if (!strcmp(argv[argument], "-hold")) {
+                holdFrames = (int)strtol(argv[++argument], NULL, 10);
+            } else if (!strcmp(argv[argument], "-threads")) {
+                threads = (int)strtol(argv[++argument], NULL, 10);
+            } else if (!strcmp(argv[argument], "-visited")) {
+                visited = strtoll(argv[++argument], NULL, 10);
+            } else if (!strcmp(argv[argument], "-goal")) {
+                argument++;
+                goal = !strcmp(argv[argument], "glitchworld") ? goalGlitchWorld : goalAreaChange;
+            } else if (!strcmp(argv[argument], "-from")) {
+                fromPath = argv[++argument];
+            } else if (!strcmp(argv[argument], "-out")) {
+                outPath = argv[++argument];
+            }
+        }
+        if (initSearch(&search, beamWidth > 0 ? beamWidth : 1, visited > 0 ? (uint64_t)visited : 1)) {
+            printf("Not enough memory for the search\n");
+            return 1;
+        }
+        search.holdFrames = holdFrames > 0 ? holdFrames : 1;
+        search.bestFirst = bestFirst;
+        search.goal = goal;
+        if (threads > 0) {
+            search.threadCount = threads;
+        }
+        Reset();
+        if (fromPath) {
+            if (loadMovie(&prefix, fromPath)) {
+                printf("Couldn't load %s\n", fromPath);
+                freeSearch(&search);
+                return 1;
+            }
+            playMovie(&prefix, NULL);
+        }
+        found = searchInputs(&search, gs, levels);
+        node = found ? search.goalNode : search.bestNode;
+        printf("%s after %llu frames in %.3fs (%.0f frames/s), %llu states, %llu duplicates, best score %llx\n",
+            found ? "Reached the goal" : "Searched", (unsigned long long)search.exploredFrames, (double)search.nanoseconds / 1000000000.0,
+            search.nanoseconds ? (double)search.exploredFrames * 1000000000.0 / (double)search.nanoseconds : 0.0,
+            (unsigned long long)search.visited.count, (unsigned long long)search.duplicates, (unsigned long long)search.bestScore);
+        if (outPath && node != NoSearchNode && writeSearchMovie(&search, node, fromPath ? &prefix : NULL, outPath)) {
+            printf("Couldn't write %s\n", outPath);
+        }
+        if (fromPath) {
+            freeMovie(&prefix);
+        }
+        freeSearch(&search);
+        return found || !goal ? 0 : 1;
+    }
+    // smb -netplay <frames> [lag]
+    // Plays both sides of a netplay session over loopback, the remote input arriving up to lag frames late
+    if (argc > 2 && !strcmp(argv[1], "-netplay")) {
+        int lag = argc > 3 ? (int)strtol(argv[3], NULL, 10) : RollbackFrames;
+        return runNetplayTest((uint32_t)strtol(argv[2], NULL, 10), lag > 0 ? lag : 1) ? 1 : 0;
+    }
+    // smb -replay <movie> [-hashes <file>]
+    // Plays a movie back uncapped, optionally writing the state hash of every frame to a file
+    if (argc > 2 && !strcmp(argv[1], "-replay")) {
+        Movie movie;
+        FILE * hashStream = NULL;
+        long frames;
+        uint64_t start;
+        double seconds;
+        if (loadMovie(&movie, argv[2])) {
+            printf("Couldn't load %s\n", argv[2]);
+            return 1;
+        }
+        if (argc > 4 && !strcmp(argv[3], "-hashes") && !(hashStream = fopen(argv[4], "w"))) {
+            printf("Couldn't write %s\n", argv[4]);
+            freeMovie(&movie);
+            return 1;
+        }
+        Reset();
+        start = getTimeNanoseconds();
+        frames = playMovie(&movie, hashStream);
+        seconds = (double)(getTimeNanoseconds() - start) / 1000000000.0;
+        printf("%ld of %lu frames in %.3fs (%.0f fps)\n", frames, (unsigned long)movie.frames, seconds, seconds > 0 ? (double)frames / seconds : 0.0);
+        if (hashStream) {
+            fclose(hashStream);
+        }
+        freeMovie(&movie);
+        return 0;
+    }
+    // smb [-pal] [-spritelimit] [-record <movie>] [frames]
+    // Runs at the speed of a real NES (NTSC unless told otherwise), forever or for the given amount of frames
+    {
+        double frameRate = NTSC_FrameRate;
+        long frames = 0;
+        MovieRecorder recorder;
+        MovieRecorder * recording = NULL;
+        for (int argument = 1; argument < argc; argument++) {
+            if (!strcmp(argv[argument], "-pal")) {
+                frameRate = PAL_FrameRate;
+            } else if (!strcmp(argv[argument], "-spritelimit")) {
+                gs->spriteLimit = 1;
+            } else if (!strcmp(argv[argument], "-record") && argument + 1 < argc) {
+                if (startRecording(&recorder, argv[++argument], 2)) {
+                    printf("Couldn't record to %s\n", argv[argument]);
+                    return 1;
+                }
+                recording = &recorder;
+            } else {
+                frames = strtol(argv[argument], NULL, 10);
+            }
+        }
+        Start(frameRate, frames, recording);
+        if (recording && stopRecording(recording)) {
+            printf("Couldn't write the movie\n");
+            return 1;
+        }
+    }
     return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file